@@ -14,74 +14,140 @@ extern "C"
 }
 
 #include <SDL.h>
+#include <cmath>
 
 #include "PacketQueue.hpp"
+#include "AudioGain.hpp"
+#include "AudioSink.hpp"
+#include "Telemetry.hpp"
+#include "Tracer.hpp"
 
 #define SDL_AUDIO_BUFFER_SIZE 1024
 #define MAX_AUDIO_FRAME_SIZE 192000
+#define MAX_AUDIO_CHANNELS 2		// multichannel sources are downmixed to stereo
+#define AUDIO_COMPENSATION_MAX_PPM 2000		// resampling correction stays well below audible pitch change
+#define AUDIO_SYNC_AVERAGE 0.9				// weight of the history in the averaged sync error
+#define AUDIO_NOSYNC_THRESHOLD 10.0			// errors this large are not corrected by resampling
 
 
 class Audio
 {
 	public:
 
-		Audio(AVStream *aStream)
+		// Takes ownership of the sink
+		Audio(AVStream *aStream, AudioSink *sink)
 		{
 			quitEvent = false;
-			packetQueue = new PacketQueue();
+			output = sink;
+			packetQueue = new PacketQueue("audio packets");
+			frame = FramePool::Instance().Get();
+			swr = NULL;
+			clock = 0;
+			audioBufferSize = 0;
+			audioBufferIndex = 0;
+			seekTarget = -1;
+			discardTarget = -1;
+			decodeSerial = 0;
+			syncError = 0;
+			averageError = 0;
+			syncCorrection = false;
+			compensating = false;
+
+			memoryId = MemoryGovernor::Instance().Register("audio buffer", MEMORY_FIXED);
+			MemoryGovernor::Instance().Charge(memoryId, sizeof(audioBuffer));
 		
 			audioStream = aStream;
-
-			codecContext = audioStream->codec;
-			codec = avcodec_find_decoder(codecContext->codec_id);
-
-			// Hack to play S16P audio - SDL only plays S16
-			if (codecContext->sample_fmt == AV_SAMPLE_FMT_S16P)
-				codecContext->request_sample_fmt = AV_SAMPLE_FMT_S16;
-
-			avcodec_open2(codecContext, codec, NULL);	
+			pendingStream = NULL;
+			pendingSerial = 0;
+			OpenCodec();
 
 			SDL_AudioSpec desiredSpecs;
-			SDL_AudioSpec specs;
 			desiredSpecs.freq = codecContext->sample_rate;
 			desiredSpecs.format = AUDIO_S16SYS;
-			desiredSpecs.channels = codecContext->channels;
+			desiredSpecs.channels = codecContext->channels > MAX_AUDIO_CHANNELS ? MAX_AUDIO_CHANNELS : codecContext->channels;
 			desiredSpecs.silence = 0;
 			desiredSpecs.samples = SDL_AUDIO_BUFFER_SIZE;
 			desiredSpecs.callback = PlaybackCallback;
 			desiredSpecs.userdata = this;
 			
-			if (SDL_OpenAudio(&desiredSpecs, &specs) < 0) {
-				SDL_Log("Failed to open audio: %s", SDL_GetError());
+			// Everything below is configured for what the output actually opened with
+			if (output->Open(&desiredSpecs, &specs) < 0)
+				specs = desiredSpecs;
+
+			outFormat = ToSampleFormat(specs.format);
+			if (outFormat == AV_SAMPLE_FMT_NONE)
+			{
+				// e.g. big-endian S32 - let the output convert from S16 instead
+				SDL_Log("Unsupported audio device format 0x%x, reopening as S16", specs.format);
+				output->Close();
+				if (output->Open(&desiredSpecs, NULL) < 0)
+					SDL_Log("Failed to reopen audio output");
+				specs = desiredSpecs;
+				outFormat = AV_SAMPLE_FMT_S16;
 			}
+
+			bPassthrough = isPassthrough();
 		}
 
 		~Audio()
 		{
+			Quit();
+
+			output->Close();
+			delete output;
+
 			packetQueue->flush();
 			delete packetQueue;
 
-			Quit();
+			if (codecContext)
+				avcodec_close(codecContext);
 
-			SDL_PauseAudio(1);
-			SDL_CloseAudio();
+			swr_free(&swr);
+			FramePool::Instance().Put(frame);
+			MemoryGovernor::Instance().Unregister(memoryId);
 		}
 
 		void Start()
 		{
 			setResampler();
-			SDL_PauseAudio(0);
 
+			char chain[256];
+			describeChain(chain, sizeof(chain));
+			SDL_Log("Audio: %s", chain);
+
+			output->Pause(false);
+
+		}
+
+		// Human readable decoder -> resampler -> device chain for diagnostics
+		void describeChain(char *buf, int size)
+		{
+			const char *inName = av_get_sample_fmt_name(codecContext->sample_fmt);
+			const char *outName = av_get_sample_fmt_name(outFormat);
+
+			if (bPassthrough)
+			{
+				snprintf(buf, size, "decoder %s %d Hz %dch -> device (passthrough), SDL conversion: none",
+					inName, codecContext->sample_rate, codecContext->channels);
+				return;
+			}
+
+			snprintf(buf, size, "decoder %s %d Hz %dch -> swr%s%s%s -> device %s %d Hz %dch, SDL conversion: none",
+				inName, codecContext->sample_rate, codecContext->channels,
+				codecContext->sample_rate != specs.freq ? " resample" : "",
+				codecContext->channels != specs.channels ? " rematrix" : "",
+				codecContext->sample_fmt != outFormat ? " format" : "",
+				outName, specs.freq, specs.channels);
 		}
 
 		void Stop()
 		{
-			SDL_PauseAudio(1);
+			output->Pause(true);
 		}
 
 		void Resume()
 		{
-			SDL_PauseAudio(0);
+			output->Pause(false);
 		}
 
 		void PutPacket(AVPacket *pkt)
@@ -89,11 +155,16 @@ class Audio
 			packetQueue->Put(pkt);
 		}
 
+		void setVolume(double volume)
+		{
+			gain.setVolume(volume);
+		}
+
 		// Audio Clock with account of time to copy and process audio in buffer
 		double AudioClock()
 		{
 			//return clock;
-			int bytes_per_sec = codecContext->sample_rate * codecContext->channels * av_get_bytes_per_sample(codecContext->sample_fmt);
+			int bytes_per_sec = outputBytesPerSec();
 
 			int audioBufferDataSize = audioBufferSize - audioBufferIndex;
 	
@@ -103,15 +174,16 @@ class Audio
 				return clock;
 		}
 
+		// Unblocks the playback callback; the codec is closed in the destructor
 		void Quit()
 		{
 			quitEvent = true;
+			packetQueue->Abort();
+		}
 
-			if (codecContext)
-			{
-				avcodec_close(codecContext);
-			}
-
+		void setSpaceSignal(StageSignal *signal)
+		{
+			packetQueue->setSpaceSignal(signal);
 		}
 		
 		int getPacketSize()
@@ -124,10 +196,51 @@ class Audio
 			packetQueue->flush();
 		}
 
+		// False from a flush until the decoder takes the first packet queued
+		// after it; AudioClock still tells the old position meanwhile
+		bool clockSettled()
+		{
+			return decodeSerial == packetQueue->getSerial();
+		}
+
+		// Exact seek: audio before `target` (seconds) is decoded but not played.
+		// Call before flush_packet; -1 plays from wherever the seek landed.
+		void setSeekTarget(double target)
+		{
+			seekTarget = target;
+		}
+
+		// Decode `stream` instead, starting with the next packet queued. The
+		// packets still queued for the current stream are moved to `standby`.
+		// The device keeps its format; swr adapts.
+		void switchStream(AVStream *stream, PacketQueue *standby)
+		{
+			// The serial is published before the stream: the decoder must not
+			// see the switch with the previous generation's number
+			pendingSerial = packetQueue->MoveTo(standby);
+			pendingStream = stream;
+		}
+
+		// Audio clock minus the master clock, in seconds. While set, playback
+		// is stretched or squeezed through the resampler to close the gap.
+		void setSyncError(double error)
+		{
+			syncError = error;
+			syncCorrection = true;
+		}
+
+		// Audio is the master again - play at the nominal rate
+		void stopSyncCorrection()
+		{
+			syncCorrection = false;
+		}
+
 private:
 	static void PlaybackCallback(void *userdata, Uint8 *stream, int streamSize)
 	{
 		Audio *a = (Audio*)userdata;
+		Tracer::NameThread("audio");
+		TraceSpan span("audio callback", a->clock, a->packetQueue->getSize());
 		a->Playback(stream, streamSize);
 		return;
 	}
@@ -137,9 +250,97 @@ private:
 		return audioBufferSize - audioBufferIndex;
 	}
 
+	static AVSampleFormat ToSampleFormat(SDL_AudioFormat format)
+	{
+		switch (format)
+		{
+		case AUDIO_U8:		return AV_SAMPLE_FMT_U8;
+		case AUDIO_S16SYS:	return AV_SAMPLE_FMT_S16;
+		case AUDIO_S32SYS:	return AV_SAMPLE_FMT_S32;
+		case AUDIO_F32SYS:	return AV_SAMPLE_FMT_FLT;
+		default:			return AV_SAMPLE_FMT_NONE;
+		}
+	}
+
+	void OpenCodec()
+	{
+		codecContext = audioStream->codec;
+		codec = avcodec_find_decoder(codecContext->codec_id);
+
+		// Hack to play S16P audio - SDL only plays S16
+		if (codecContext->sample_fmt == AV_SAMPLE_FMT_S16P)
+			codecContext->request_sample_fmt = AV_SAMPLE_FMT_S16;
+
+		avcodec_open2(codecContext, codec, NULL);
+	}
+
+	bool isPassthrough()
+	{
+		return codecContext->sample_fmt == outFormat
+			&& codecContext->sample_rate == specs.freq
+			&& codecContext->channels == specs.channels;
+	}
+
+	// Runs on the playback thread when the first packet of the new stream arrives
+	void SwitchCodec()
+	{
+		avcodec_close(codecContext);
+
+		audioStream = pendingStream;
+		pendingStream = NULL;
+		OpenCodec();
+
+		swr_free(&swr);
+		setResampler();
+		bPassthrough = isPassthrough();
+		compensating = false;
+	}
+
+	// Spreads a correction of at most AUDIO_COMPENSATION_MAX_PPM over the next
+	// second of output; audio ahead of the master gets extra samples.
+	void Compensate()
+	{
+		if (!syncCorrection)
+		{
+			if (compensating)
+			{
+				swr_set_compensation(swr, 0, 0);
+				compensating = false;
+				averageError = 0;
+			}
+
+			// Correction forced the resampler on; drop it again if formats match
+			bPassthrough = isPassthrough();
+			return;
+		}
+
+		double error = syncError;
+		if (fabs(error) > AUDIO_NOSYNC_THRESHOLD)
+			return;
+
+		averageError = averageError * AUDIO_SYNC_AVERAGE + error * (1 - AUDIO_SYNC_AVERAGE);
+
+		int maxDelta = (int)(specs.freq * AUDIO_COMPENSATION_MAX_PPM / 1000000.0);
+		int delta = (int)(averageError * specs.freq);
+		if (delta > maxDelta)
+			delta = maxDelta;
+		if (delta < -maxDelta)
+			delta = -maxDelta;
+
+		swr_set_compensation(swr, delta, specs.freq);
+		compensating = true;
+	}
+
+	int outputBytesPerSec()
+	{
+		return specs.freq * specs.channels * av_get_bytes_per_sample(outFormat);
+	}
+
 	void Playback(Uint8 *stream, int streamSize)
 	{
 		int dataSizeToCopy;
+		Uint8 *samples = stream;
+		int sampleCount = streamSize / av_get_bytes_per_sample(outFormat);
 
 		while (streamSize > 0)
 		{
@@ -156,11 +357,29 @@ private:
 
 			if (audioBufferIndex >= audioBufferSize)
 			{
-				// Already played all decoded data - get more
+				// Already played all decoded data - get more; an empty queue here stalls the device
+				if (!quitEvent && packetQueue->getSize() == 0)
+					Telemetry::Instance().OnAudioUnderrun();
+
 				audioBufferSize = DecodeAudio(audioBuffer);
 				audioBufferIndex = 0;
+
+				if (quitEvent)
+				{
+					memset(stream, specs.silence, streamSize);
+					break;
+				}
 			}
 		}
+
+		if (outFormat == AV_SAMPLE_FMT_FLT)
+			gain.ProcessF32((float *)samples, sampleCount);
+		else if (outFormat == AV_SAMPLE_FMT_S16)
+			gain.ProcessS16((int16_t *)samples, sampleCount);
+		else if (outFormat == AV_SAMPLE_FMT_S32)
+			gain.ProcessS32((int32_t *)samples, sampleCount);
+		else if (outFormat == AV_SAMPLE_FMT_U8)
+			gain.ProcessU8((uint8_t *)samples, sampleCount);
 	}
 
 	int setResampler()
@@ -175,40 +394,72 @@ private:
 		av_opt_set_int(swr, "in_sample_rate", codecContext->sample_rate, 0);
 		av_opt_set_sample_fmt(swr, "in_sample_fmt", codecContext->sample_fmt, 0);
 
-		av_opt_set_int(swr, "out_channel_layout", channel_layout, 0);
-		av_opt_set_int(swr, "out_sample_rate", codecContext->sample_rate, 0);
-		av_opt_set_sample_fmt(swr, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
+		// Downmix happens in swr's rematrix when the device has fewer channels
+		uint64_t out_channel_layout = channel_layout;
+		if (specs.channels != codecContext->channels)
+			out_channel_layout = av_get_default_channel_layout(specs.channels);
+
+		av_opt_set_int(swr, "out_channel_layout", out_channel_layout, 0);
+		av_opt_set_int(swr, "out_sample_rate", specs.freq, 0);
+		av_opt_set_sample_fmt(swr, "out_sample_fmt", outFormat, 0);
 
 		return swr_init(swr);
 	}
 
 	int DecodeAudio(uint8_t *audioBuffer)
 	{
+		ProfileScope scope("audio decode");
+
 		AVPacket audioPacket;
-		AVFrame*  frame = av_frame_alloc();
 		int frameFinished = 0;
 
 		int audioDecodedSize, dataSize = 0;
+		int serial;
 
-		if (!quitEvent)
+		if (!quitEvent && packetQueue->Get(&audioPacket, &serial))
 		{
-			packetQueue->Get(&audioPacket);
+			if (serial != decodeSerial)
+			{
+				// A seek flush may have come in between; serials only grow
+				if (pendingStream && serial - pendingSerial >= 0)
+					SwitchCodec();
+				else
+					avcodec_flush_buffers(codecContext);
+				decodeSerial = serial;
+				discardTarget = seekTarget;
+			}
 
-			if (strcmp((char*)audioPacket.data, "LAST") == 0)
+			if (PacketQueue::IsLast(&audioPacket))
 			{
 				SDL_Event e;
 				e.type = SDL_QUIT;
 				SDL_PushEvent(&e);
 			}
+			else if (audioPacket.stream_index != audioStream->index)
+			{
+				// Queued for the previous track before the switch reached us
+			}
 			else
 			{
+				TraceSpan span("audio decode", audioPacket.pts != AV_NOPTS_VALUE ? audioPacket.pts * av_q2d(audioStream->time_base) : TRACE_NO_PTS, packetQueue->getSize());
 				audioDecodedSize = avcodec_decode_audio4(codecContext, frame, &frameFinished, &audioPacket);
 
-				if (frameFinished)
+				if (frameFinished && BeforeTarget(&audioPacket))
 				{
-					if (codecContext->sample_fmt != AV_SAMPLE_FMT_S16) {
-						dataSize = frame->nb_samples * codecContext->channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
-						swr_convert(swr, (uint8_t **)&audioBuffer, frame->nb_samples, (const uint8_t **)frame->extended_data, frame->nb_samples);
+					// Exact seek - skip conversion, nothing of this packet is played
+				}
+				else if (frameFinished)
+				{
+					// Rate correction needs the resampler even when formats match
+					if (syncCorrection)
+						bPassthrough = false;
+
+					if (!bPassthrough) {
+						// Resample, rematrix and convert in a single swr pass straight into the device format
+						Compensate();
+						int frameBytes = specs.channels * av_get_bytes_per_sample(outFormat);
+						int converted = swr_convert(swr, (uint8_t **)&audioBuffer, MAX_AUDIO_FRAME_SIZE / frameBytes, (const uint8_t **)frame->extended_data, frame->nb_samples);
+						dataSize = converted > 0 ? converted * frameBytes : 0;
 					}
 					else {
 						// Frame loaded from packets - copy it to intermediary buffer
@@ -224,11 +475,21 @@ private:
 			av_packet_unref(&audioPacket);
 		}
 
-		av_frame_free(&frame);
-
 		return dataSize;
 	}
 
+	bool BeforeTarget(AVPacket *packet)
+	{
+		if (discardTarget < 0 || packet->pts == AV_NOPTS_VALUE)
+			return false;
+
+		if (av_q2d(audioStream->time_base) * (packet->pts + packet->duration) <= discardTarget)
+			return true;
+
+		discardTarget = -1;
+		return false;
+	}
+
 	void UpdateClock(AVPacket *packet, int dataSize)
 	{
 		if (packet->dts != AV_NOPTS_VALUE)
@@ -238,23 +499,39 @@ private:
 		else
 		{
 			// if no pts, then compute it
-			clock += (double)dataSize / (codecContext->channels * codecContext->sample_rate * av_get_bytes_per_sample(codecContext->sample_fmt));
+			clock += (double)dataSize / outputBytesPerSec();
 		}
 	}
 
 private:
 	bool			quitEvent;
+	AudioSink		*output;
 
 	AVCodecContext  *codecContext;
 	AVCodec			*codec;
 	AVStream		*audioStream;
 	PacketQueue		*packetQueue;
-	AVPacket		*audioPacket;
-	AVFrame			*frame;
+	AVFrame			*frame;				// reused for every decode call
 	SwrContext		*swr;
+	SDL_AudioSpec	specs;				// what the device actually opened with
+	AVSampleFormat	outFormat;			// device sample format
+	bool			bPassthrough;		// decoder output already matches the device
+	AudioGain		gain;
 	double			clock;
 
 	uint8_t			audioBuffer[MAX_AUDIO_FRAME_SIZE];
 	unsigned int	audioBufferSize;
 	unsigned int	audioBufferIndex;
+
+	double			seekTarget;			// set by the seeking thread
+	double			discardTarget;		// playback thread's copy, taken with the new serial
+	int				decodeSerial;		// packet queue serial being decoded
+	AVStream		*pendingStream;		// switchStream target, taken with the new serial
+	int				pendingSerial;		// first serial of the pending stream
+
+	double			syncError;			// audio minus master clock, set by the Syncer
+	double			averageError;
+	bool			syncCorrection;		// another clock is the master
+	bool			compensating;		// swr has a compensation set
+	int				memoryId;
 };
@@ -0,0 +1,234 @@
+#pragma once
+
+#include "stdafx.h"
+#include <SDL.h>
+#include <stdint.h>
+#include <cstdio>
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+#define AUDIO_GAIN_SSE2
+#include <emmintrin.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#endif
+
+#define GAIN_UNITY 65536		// gain is stored as 16.16 fixed point
+
+// In-process software volume. The gain ramps linearly from the previous
+// value to the target over one buffer, so volume steps never click.
+class AudioGain
+{
+public:
+	AudioGain()
+	{
+		SDL_AtomicSet(&target, GAIN_UNITY);
+		current = 1.0f;
+	}
+
+	// volume in [0, 1], squared as a rough perceptual taper
+	void setVolume(double volume)
+	{
+		if (volume < 0)
+			volume = 0;
+		if (volume > 1)
+			volume = 1;
+
+		SDL_AtomicSet(&target, (int)(volume * volume * GAIN_UNITY));
+	}
+
+	double getVolume()
+	{
+		return SDL_sqrt((double)SDL_AtomicGet(&target) / GAIN_UNITY);
+	}
+
+	void ProcessS16(int16_t *samples, int count)
+	{
+		float end = (float)SDL_AtomicGet(&target) / GAIN_UNITY;
+		if (current == 1.0f && end == 1.0f)
+			return;
+
+		ScaleS16(samples, count, current, (end - current) / count);
+		current = end;
+	}
+
+	void ProcessF32(float *samples, int count)
+	{
+		float end = (float)SDL_AtomicGet(&target) / GAIN_UNITY;
+		if (current == 1.0f && end == 1.0f)
+			return;
+
+		ScaleF32(samples, count, current, (end - current) / count);
+		current = end;
+	}
+
+	void ProcessS32(int32_t *samples, int count)
+	{
+		float end = (float)SDL_AtomicGet(&target) / GAIN_UNITY;
+		if (current == 1.0f && end == 1.0f)
+			return;
+
+		// Rare device format - scalar is good enough; gain <= 1 cannot overflow
+		float step = (end - current) / count;
+		float g = current;
+		for (int i = 0; i < count; i++, g += step)
+			samples[i] = (int32_t)(samples[i] * (double)g);
+
+		current = end;
+	}
+
+	void ProcessU8(uint8_t *samples, int count)
+	{
+		float end = (float)SDL_AtomicGet(&target) / GAIN_UNITY;
+		if (current == 1.0f && end == 1.0f)
+			return;
+
+		// Unsigned, centred on 128; gain <= 1 stays in range
+		float step = (end - current) / count;
+		float g = current;
+		for (int i = 0; i < count; i++, g += step)
+			samples[i] = (uint8_t)(128 + (int)((samples[i] - 128) * g));
+
+		current = end;
+	}
+
+	// samples[i] *= gain + i * step, saturated to 16 bits
+	static void ScaleS16(int16_t *samples, int count, float gain, float step)
+	{
+		int i = 0;
+
+#ifdef AUDIO_GAIN_SSE2
+#ifdef __AVX2__
+		__m256 vstep = _mm256_set1_ps(step * 16);
+		__m256 g0 = _mm256_add_ps(_mm256_set1_ps(gain), _mm256_mul_ps(_mm256_set1_ps(step), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)));
+		__m256 g1 = _mm256_add_ps(g0, _mm256_set1_ps(step * 8));
+
+		for (; i + 16 <= count; i += 16)
+		{
+			__m256i s = _mm256_loadu_si256((const __m256i *)(samples + i));
+			__m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(s));
+			__m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(s, 1));
+
+			lo = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(lo), g0));
+			hi = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(hi), g1));
+
+			// packs works per 128-bit lane, permute restores sample order
+			__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+			_mm256_storeu_si256((__m256i *)(samples + i), packed);
+
+			g0 = _mm256_add_ps(g0, vstep);
+			g1 = _mm256_add_ps(g1, vstep);
+		}
+
+		gain += step * i;
+#endif
+
+		__m128 vstep4 = _mm_set1_ps(step * 8);
+		__m128 g0s = _mm_add_ps(_mm_set1_ps(gain), _mm_mul_ps(_mm_set1_ps(step), _mm_setr_ps(0, 1, 2, 3)));
+		__m128 g1s = _mm_add_ps(g0s, _mm_set1_ps(step * 4));
+		int start = i;
+
+		for (; i + 8 <= count; i += 8)
+		{
+			__m128i s = _mm_loadu_si128((const __m128i *)(samples + i));
+			__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);	// sign-extend
+			__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+
+			lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(lo), g0s));
+			hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(hi), g1s));
+
+			_mm_storeu_si128((__m128i *)(samples + i), _mm_packs_epi32(lo, hi));
+
+			g0s = _mm_add_ps(g0s, vstep4);
+			g1s = _mm_add_ps(g1s, vstep4);
+		}
+
+		gain += step * (i - start);
+#endif
+
+		for (; i < count; i++, gain += step)
+		{
+			int v = (int)(samples[i] * gain);
+			samples[i] = (int16_t)(v > 32767 ? 32767 : (v < -32768 ? -32768 : v));
+		}
+	}
+
+	// samples[i] *= gain + i * step
+	static void ScaleF32(float *samples, int count, float gain, float step)
+	{
+		int i = 0;
+
+#ifdef AUDIO_GAIN_SSE2
+#ifdef __AVX2__
+		__m256 vstep = _mm256_set1_ps(step * 8);
+		__m256 g = _mm256_add_ps(_mm256_set1_ps(gain), _mm256_mul_ps(_mm256_set1_ps(step), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)));
+
+		for (; i + 8 <= count; i += 8)
+		{
+			_mm256_storeu_ps(samples + i, _mm256_mul_ps(_mm256_loadu_ps(samples + i), g));
+			g = _mm256_add_ps(g, vstep);
+		}
+
+		gain += step * i;
+#endif
+
+		__m128 vstep4 = _mm_set1_ps(step * 4);
+		__m128 gs = _mm_add_ps(_mm_set1_ps(gain), _mm_mul_ps(_mm_set1_ps(step), _mm_setr_ps(0, 1, 2, 3)));
+		int start = i;
+
+		for (; i + 4 <= count; i += 4)
+		{
+			_mm_storeu_ps(samples + i, _mm_mul_ps(_mm_loadu_ps(samples + i), gs));
+			gs = _mm_add_ps(gs, vstep4);
+		}
+
+		gain += step * (i - start);
+#endif
+
+		for (; i < count; i++, gain += step)
+			samples[i] *= gain;
+	}
+
+	// Times the kernels on one stereo SDL_AUDIO_BUFFER_SIZE callback
+	static int Benchmark(int samplesPerCallback)
+	{
+		const int iterations = 100000;
+		int16_t *s16 = new int16_t[samplesPerCallback];
+		float *f32 = new float[samplesPerCallback];
+
+		for (int i = 0; i < samplesPerCallback; i++)
+		{
+			s16[i] = (int16_t)((i * 7919) & 0x7fff) - 16384;
+			f32[i] = s16[i] / 32768.0f;
+		}
+
+		double freq = (double)SDL_GetPerformanceFrequency();
+
+		Uint64 t0 = SDL_GetPerformanceCounter();
+		for (int n = 0; n < iterations; n++)
+			ScaleS16(s16, samplesPerCallback, 0.7f, (n & 1 ? 1e-6f : -1e-6f));
+		Uint64 t1 = SDL_GetPerformanceCounter();
+		for (int n = 0; n < iterations; n++)
+			ScaleF32(f32, samplesPerCallback, 0.7f, (n & 1 ? 1e-6f : -1e-6f));
+		Uint64 t2 = SDL_GetPerformanceCounter();
+
+#if defined(AUDIO_GAIN_SSE2) && defined(__AVX2__)
+		const char *isa = "AVX2";
+#elif defined(AUDIO_GAIN_SSE2)
+		const char *isa = "SSE2";
+#else
+		const char *isa = "scalar";
+#endif
+		fprintf(stdout, "gain kernel (%s), %d samples per callback\n", isa, samplesPerCallback);
+		fprintf(stdout, "  S16: %.1f ns/callback\n", (t1 - t0) / freq * 1e9 / iterations);
+		fprintf(stdout, "  F32: %.1f ns/callback\n", (t2 - t1) / freq * 1e9 / iterations);
+
+		delete[] s16;
+		delete[] f32;
+
+		return 0;
+	}
+
+private:
+	SDL_atomic_t	target;
+	float			current;		// only touched by the audio callback
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "stdafx.h"
+#include <SDL.h>
+#include <cstdio>
+
+// Where decoded audio goes. Sinks pull through the SDL_AudioSpec callback,
+// so Audio fills buffers the same way for every output. A sink starts paused.
+class AudioSink
+{
+public:
+	virtual ~AudioSink() {}
+
+	// `obtained` receives the format the output actually runs at. When it
+	// is NULL the output must run at exactly `desired`, converting if needed.
+	virtual int Open(SDL_AudioSpec *desired, SDL_AudioSpec *obtained) = 0;
+	virtual void Pause(bool bPause) = 0;
+	virtual void Close() = 0;
+};
+
+// Pulls buffers on its own thread as fast as Audio can fill them - no
+// device clock, so playback runs at decode speed. Optionally writes the
+// interleaved PCM to a raw file.
+class NullAudioSink : public AudioSink
+{
+public:
+	NullAudioSink(const char *path = 0) : thread(0), buffer(0), file(0)
+	{
+		this->path = path;
+		mutex = SDL_CreateMutex();
+		cond = SDL_CreateCond();
+		bPause = true;
+		bRunning = false;
+	}
+
+	~NullAudioSink()
+	{
+		Close();
+		SDL_DestroyMutex(mutex);
+		SDL_DestroyCond(cond);
+	}
+
+	int Open(SDL_AudioSpec *desired, SDL_AudioSpec *obtained)
+	{
+		spec = *desired;
+		spec.silence = 0;
+		spec.size = spec.samples * spec.channels * SDL_AUDIO_BITSIZE(spec.format) / 8;
+		if (obtained)
+			*obtained = spec;
+
+		if (path)
+		{
+			file = fopen(path, "wb");
+			if (file == NULL)
+			{
+				SDL_Log("Cannot write %s", path);
+				return -1;
+			}
+
+			SDL_Log("Audio: raw pcm %d Hz %dch to %s", spec.freq, spec.channels, path);
+		}
+
+		buffer = new Uint8[spec.size];
+		bRunning = true;
+		thread = SDL_CreateThread(PullThread, "audio sink", this);
+
+		return 0;
+	}
+
+	void Pause(bool bPause)
+	{
+		SDL_LockMutex(mutex);
+		this->bPause = bPause;
+		SDL_CondSignal(cond);
+		SDL_UnlockMutex(mutex);
+	}
+
+	void Close()
+	{
+		if (thread)
+		{
+			SDL_LockMutex(mutex);
+			bRunning = false;
+			SDL_CondSignal(cond);
+			SDL_UnlockMutex(mutex);
+
+			SDL_WaitThread(thread, NULL);
+			thread = 0;
+		}
+
+		if (file)
+		{
+			fclose(file);
+			file = 0;
+		}
+
+		delete[] buffer;
+		buffer = 0;
+	}
+
+private:
+	static int PullThread(void *arg)
+	{
+		NullAudioSink *sink = (NullAudioSink*)arg;
+		sink->Pull();
+		return 0;
+	}
+
+	void Pull()
+	{
+		for (;;)
+		{
+			SDL_LockMutex(mutex);
+			while (bPause && bRunning)
+				SDL_CondWait(cond, mutex);
+			bool bQuit = !bRunning;
+			SDL_UnlockMutex(mutex);
+
+			if (bQuit)
+				break;
+
+			spec.callback(spec.userdata, buffer, spec.size);
+
+			if (file)
+				fwrite(buffer, 1, spec.size, file);
+		}
+	}
+
+private:
+	const char		*path;
+	SDL_AudioSpec	spec;
+	SDL_Thread		*thread;
+	SDL_mutex		*mutex;
+	SDL_cond		*cond;
+	Uint8			*buffer;
+	FILE			*file;
+	bool			bPause;
+	bool			bRunning;
+};
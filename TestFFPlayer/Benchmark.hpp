@@ -0,0 +1,741 @@
+#pragma once
+
+#include "stdafx.h"
+
+extern "C"
+{
+	#include <libavcodec/avcodec.h>
+	#include <libavformat/avformat.h>
+	#include <libavfilter/avfilter.h>
+	#include <libavfilter/buffersink.h>
+	#include <libswscale/swscale.h>
+	#include <libswresample/swresample.h>
+	#include <libavutil/mem.h>
+	#include <libavutil/opt.h>
+	#include <libavutil/imgutils.h>
+	#include <libavutil/channel_layout.h>
+}
+
+#include <SDL.h>
+#include <cstdio>
+#include <cmath>
+#include <map>
+#include <string>
+#include "Syncer.hpp"
+#include "Telemetry.hpp"
+#include "PacketQueue.hpp"
+#include "Profiler.hpp"
+
+#define BENCH_SECONDS 5					// length of every generated clip
+#define BENCH_FPS 30
+#define BENCH_SAMPLE_RATE 48000
+#define BENCH_QUEUE_DEPTH 16			// packets the reader thread may run ahead
+#define BENCH_TIME_TOLERANCE 0.15		// timings may grow this much before it is a regression
+#define BENCH_INTERLEAVE_TOLERANCE_MS 5.0
+#define BENCH_ALLOC_TOLERANCE 0.25		// allocations per frame
+#define BENCH_WAIT_TOLERANCE_US 50.0	// contended lock wait per frame
+
+// Profiling builds time every lock, so their numbers get their own baseline
+#ifdef FF_PROFILE
+#define BENCH_DEFAULT_BASELINE "bench_baseline_profile.txt"
+#else
+#define BENCH_DEFAULT_BASELINE "bench_baseline.txt"
+#endif
+
+// One generated clip: a video encoding plus an audio encoding in Matroska.
+// Encoders are tried in order; a case without any is skipped.
+struct BenchCase
+{
+	const char		*name;
+	const char		*videoEncoders[3];
+	int				width;
+	int				height;
+	AVPixelFormat	pixFmt;
+	const char		*audioEncoder;
+	const char		*audioDecoder;		// NULL = default decoder for the codec
+	AVSampleFormat	sampleFmt;			// encoder input format
+	const char		*channelLayout;
+};
+
+static const BenchCase benchCases[] =
+{
+	{ "mpeg2_480p_s16p",		{ "mpeg2video" },							 854,  480, AV_PIX_FMT_YUV420P,		"mp2",	"mp2fixed", AV_SAMPLE_FMT_S16,	"stereo" },
+	{ "mpeg2_1080p_51",			{ "mpeg2video" },							1920, 1080, AV_PIX_FMT_YUV420P,		"ac3",	NULL,		AV_SAMPLE_FMT_FLTP,	"5.1" },
+	{ "h264_480p_fltp",			{ "libx264" },								 854,  480, AV_PIX_FMT_YUV420P,		"aac",	NULL,		AV_SAMPLE_FMT_FLTP,	"stereo" },
+	{ "h264_1080p_fltp",		{ "libx264" },								1920, 1080, AV_PIX_FMT_YUV420P,		"aac",	NULL,		AV_SAMPLE_FMT_FLTP,	"stereo" },
+	{ "h264_1080p10_51",		{ "libx264" },								1920, 1080, AV_PIX_FMT_YUV420P10LE,	"ac3",	NULL,		AV_SAMPLE_FMT_FLTP,	"5.1" },
+	{ "hevc_1080p_fltp",		{ "libx265" },								1920, 1080, AV_PIX_FMT_YUV420P,		"aac",	NULL,		AV_SAMPLE_FMT_FLTP,	"stereo" },
+	{ "hevc_2160p10_51",		{ "libx265" },								3840, 2160, AV_PIX_FMT_YUV420P10LE,	"ac3",	NULL,		AV_SAMPLE_FMT_FLTP,	"5.1" },
+	{ "vp9_1080p_fltp",			{ "libvpx-vp9" },							1920, 1080, AV_PIX_FMT_YUV420P,		"aac",	NULL,		AV_SAMPLE_FMT_FLTP,	"stereo" },
+	{ "vp9_1080p10_s16p",		{ "libvpx-vp9" },							1920, 1080, AV_PIX_FMT_YUV420P10LE,	"mp2",	"mp2fixed", AV_SAMPLE_FMT_S16,	"stereo" },
+	{ "av1_720p_fltp",			{ "libaom-av1", "librav1e", "libsvtav1" },	1280,  720, AV_PIX_FMT_YUV420P,		"aac",	NULL,		AV_SAMPLE_FMT_FLTP,	"stereo" },
+	{ "av1_2160p_51",			{ "libaom-av1", "librav1e", "libsvtav1" },	3840, 2160, AV_PIX_FMT_YUV420P,		"ac3",	NULL,		AV_SAMPLE_FMT_FLTP,	"5.1" },
+};
+
+// How a metric may drift before the run fails
+struct BenchMetric
+{
+	const char	*name;
+	bool		relative;
+	double		tolerance;
+};
+
+static const BenchMetric benchMetrics[] =
+{
+	{ "codec_decode_ms",		true,	BENCH_TIME_TOLERANCE },		// per frame, avcodec alone
+	{ "sws_convert_ms",			true,	BENCH_TIME_TOLERANCE },		// per frame, sws to the display YUV420P
+	{ "audio_decode_ms_per_sec",	true,	BENCH_TIME_TOLERANCE },		// decode + swr per second of audio
+	{ "interleave_max_ms",		false,	BENCH_INTERLEAVE_TOLERANCE_MS },	// largest A/V distance in demux order
+	{ "interleave_corrections",	false,	2 },						// Syncer corrections on those clocks
+	{ "allocs_per_frame",		false,	BENCH_ALLOC_TOLERANCE },	// AllocStats: packet queue nodes and copies
+	{ "lock_wait_us_per_frame",	false,	BENCH_WAIT_TOLERANCE_US },	// contended lock waits, FF_PROFILE builds only
+};
+
+#define BENCH_METRIC_COUNT (sizeof(benchMetrics) / sizeof(benchMetrics[0]))
+
+// Writes a synthetic clip from lavfi test sources
+class BenchMedia
+{
+public:
+	BenchMedia(const BenchCase &c) : bc(c)
+	{
+		output = NULL;
+		videoContext = NULL;
+		audioContext = NULL;
+		videoGraph = NULL;
+		audioGraph = NULL;
+		videoSink = NULL;
+		audioSink = NULL;
+		frame = av_frame_alloc();
+	}
+
+	~BenchMedia()
+	{
+		avfilter_graph_free(&videoGraph);
+		avfilter_graph_free(&audioGraph);
+		CloseCodec(&videoContext);
+		CloseCodec(&audioContext);
+
+		if (output)
+		{
+			if (output->pb)
+				avio_closep(&output->pb);
+			avformat_free_context(output);
+		}
+
+		av_frame_free(&frame);
+	}
+
+	// Returns AVERROR_ENCODER_NOT_FOUND when this build cannot produce the case
+	int Generate(const char *path)
+	{
+		AVCodec *videoCodec = FindVideoEncoder();
+		AVCodec *audioCodec = avcodec_find_encoder_by_name(bc.audioEncoder);
+		if (videoCodec == NULL || audioCodec == NULL || !SupportsSampleFmt(audioCodec))
+			return AVERROR_ENCODER_NOT_FOUND;
+
+		if (avformat_alloc_output_context2(&output, NULL, "matroska", path) < 0)
+			return -1;
+
+		if (OpenVideoEncoder(videoCodec) < 0 || OpenAudioEncoder(audioCodec) < 0)
+			return -1;
+
+		char desc[256];
+		snprintf(desc, sizeof(desc), "testsrc2=size=%dx%d:rate=%d:duration=%d,format=pix_fmts=%s",
+			bc.width, bc.height, BENCH_FPS, BENCH_SECONDS, av_get_pix_fmt_name(bc.pixFmt));
+		videoSink = BuildSource(&videoGraph, "buffersink", desc);
+
+		snprintf(desc, sizeof(desc), "aevalsrc=0.2*sin(2*PI*440*t)|0.2*sin(2*PI*660*t):c=%s:s=%d:d=%d,aformat=sample_fmts=%s",
+			bc.channelLayout, BENCH_SAMPLE_RATE, BENCH_SECONDS, av_get_sample_fmt_name(bc.sampleFmt));
+		audioSink = BuildSource(&audioGraph, "abuffersink", desc);
+
+		if (videoSink == NULL || audioSink == NULL)
+			return -1;
+
+		if (audioContext->frame_size > 0)
+			av_buffersink_set_frame_size(audioSink, audioContext->frame_size);
+
+		if (avio_open(&output->pb, path, AVIO_FLAG_WRITE) < 0 || avformat_write_header(output, NULL) < 0)
+			return -1;
+
+		// Keep the two streams interleaved by media time
+		bool videoDone = false;
+		bool audioDone = false;
+		double videoTime = 0;
+		double audioTime = 0;
+
+		while (!videoDone || !audioDone)
+		{
+			if (!videoDone && (audioDone || videoTime <= audioTime))
+				videoDone = !Pump(videoSink, videoContext, 0, &videoTime);
+			else
+				audioDone = !Pump(audioSink, audioContext, 1, &audioTime);
+		}
+
+		Encode(videoContext, 0, NULL);
+		Encode(audioContext, 1, NULL);
+
+		return av_write_trailer(output);
+	}
+
+private:
+	AVCodec* FindVideoEncoder()
+	{
+		for (int i = 0; i < 3 && bc.videoEncoders[i]; i++)
+		{
+			AVCodec *codec = avcodec_find_encoder_by_name(bc.videoEncoders[i]);
+			if (codec == NULL)
+				continue;
+
+			// The bit depth must be native to the encoder
+			if (codec->pix_fmts == NULL)
+				return codec;
+			for (const AVPixelFormat *p = codec->pix_fmts; *p != AV_PIX_FMT_NONE; p++)
+				if (*p == bc.pixFmt)
+					return codec;
+		}
+
+		return NULL;
+	}
+
+	bool SupportsSampleFmt(AVCodec *codec)
+	{
+		if (codec->sample_fmts == NULL)
+			return true;
+		for (const AVSampleFormat *f = codec->sample_fmts; *f != AV_SAMPLE_FMT_NONE; f++)
+			if (*f == bc.sampleFmt)
+				return true;
+		return false;
+	}
+
+	int OpenVideoEncoder(AVCodec *codec)
+	{
+		videoContext = avcodec_alloc_context3(codec);
+		videoContext->width = bc.width;
+		videoContext->height = bc.height;
+		videoContext->pix_fmt = bc.pixFmt;
+		videoContext->time_base = av_make_q(1, BENCH_FPS);
+		videoContext->framerate = av_make_q(BENCH_FPS, 1);
+		videoContext->gop_size = 2 * BENCH_FPS;
+
+		// Fastest settings - the clips only have to exist, not look good
+		AVDictionary *opts = NULL;
+		av_dict_set(&opts, "preset", "ultrafast", 0);
+		av_dict_set(&opts, "x265-params", "log-level=error", 0);
+		av_dict_set(&opts, "deadline", "realtime", 0);
+		av_dict_set(&opts, "cpu-used", "8", 0);
+		av_dict_set(&opts, "strict", "-2", 0);
+
+		int ret = OpenEncoder(videoContext, codec, &opts);
+		av_dict_free(&opts);
+		return ret;
+	}
+
+	int OpenAudioEncoder(AVCodec *codec)
+	{
+		audioContext = avcodec_alloc_context3(codec);
+		audioContext->sample_rate = BENCH_SAMPLE_RATE;
+		audioContext->sample_fmt = bc.sampleFmt;
+		audioContext->channel_layout = strcmp(bc.channelLayout, "5.1") == 0 ? AV_CH_LAYOUT_5POINT1 : AV_CH_LAYOUT_STEREO;
+		audioContext->channels = av_get_channel_layout_nb_channels(audioContext->channel_layout);
+		audioContext->bit_rate = 192000;
+		audioContext->time_base = av_make_q(1, BENCH_SAMPLE_RATE);
+
+		AVDictionary *opts = NULL;
+		av_dict_set(&opts, "strict", "-2", 0);
+
+		int ret = OpenEncoder(audioContext, codec, &opts);
+		av_dict_free(&opts);
+		return ret;
+	}
+
+	int OpenEncoder(AVCodecContext *context, AVCodec *codec, AVDictionary **opts)
+	{
+		if (output->oformat->flags & AVFMT_GLOBALHEADER)
+			context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+		if (avcodec_open2(context, codec, opts) < 0)
+			return -1;
+
+		AVStream *stream = avformat_new_stream(output, codec);
+		stream->time_base = context->time_base;
+		return avcodec_parameters_from_context(stream->codecpar, context);
+	}
+
+	// Source-only graph "<desc> -> sink"
+	static AVFilterContext* BuildSource(AVFilterGraph **graph, const char *sinkName, const char *desc)
+	{
+		AVFilterContext *sink = NULL;
+		*graph = avfilter_graph_alloc();
+
+		if (avfilter_graph_create_filter(&sink, avfilter_get_by_name(sinkName), "out", NULL, NULL, *graph) < 0)
+			return NULL;
+
+		AVFilterInOut *inputs = avfilter_inout_alloc();
+		inputs->name = av_strdup("out");
+		inputs->filter_ctx = sink;
+		inputs->pad_idx = 0;
+		inputs->next = NULL;
+
+		AVFilterInOut *outputs = NULL;
+		int ret = avfilter_graph_parse_ptr(*graph, desc, &inputs, &outputs, NULL);
+		avfilter_inout_free(&inputs);
+		avfilter_inout_free(&outputs);
+
+		if (ret < 0 || avfilter_graph_config(*graph, NULL) < 0)
+		{
+			fprintf(stderr, "Cannot build %s\n", desc);
+			return NULL;
+		}
+
+		return sink;
+	}
+
+	// Pulls one frame from a source and encodes it. Returns false at the end.
+	bool Pump(AVFilterContext *sink, AVCodecContext *context, int streamIndex, double *time)
+	{
+		if (av_buffersink_get_frame(sink, frame) < 0)
+			return false;
+
+		*time = frame->pts * av_q2d(context->time_base);
+		Encode(context, streamIndex, frame);
+		av_frame_unref(frame);
+
+		return true;
+	}
+
+	// A NULL frame drains the encoder
+	void Encode(AVCodecContext *context, int streamIndex, AVFrame *in)
+	{
+		AVPacket packet;
+		int gotPacket;
+
+		do
+		{
+			av_init_packet(&packet);
+			packet.data = NULL;
+			packet.size = 0;
+
+			if (context->codec_type == AVMEDIA_TYPE_VIDEO)
+				avcodec_encode_video2(context, &packet, in, &gotPacket);
+			else
+				avcodec_encode_audio2(context, &packet, in, &gotPacket);
+
+			if (gotPacket)
+			{
+				AVStream *stream = output->streams[streamIndex];
+				av_packet_rescale_ts(&packet, context->time_base, stream->time_base);
+				packet.stream_index = streamIndex;
+				av_interleaved_write_frame(output, &packet);
+				av_packet_unref(&packet);
+			}
+		} while (in == NULL && gotPacket);
+	}
+
+	static void CloseCodec(AVCodecContext **context)
+	{
+		if (*context)
+		{
+			avcodec_close(*context);
+			avcodec_free_context(context);
+		}
+	}
+
+private:
+	const BenchCase	&bc;
+	AVFormatContext	*output;
+	AVCodecContext	*videoContext;
+	AVCodecContext	*audioContext;
+	AVFilterGraph	*videoGraph;
+	AVFilterGraph	*audioGraph;
+	AVFilterContext	*videoSink;
+	AVFilterContext	*audioSink;
+	AVFrame			*frame;
+};
+
+// Times the codec work under the player: decoding, the sws conversion to
+// YUV420P and the audio decode + swr to the device format, on a clip read
+// through a PacketQueue. It does not run Video or Audio themselves - no
+// pipeline, picture handoff or presentation - so the interleave metrics
+// show how far apart the demuxed streams are, not playback A/V sync.
+class BenchRun
+{
+public:
+	BenchRun()
+	{
+		formatContext = NULL;
+		videoContext = NULL;
+		audioContext = NULL;
+		sws = NULL;
+		swr = NULL;
+		picture = NULL;
+		audioBuffer = (uint8_t *)av_malloc(MAX_AUDIO_FRAME_SIZE);
+		frame = av_frame_alloc();
+		videoStream = -1;
+		audioStream = -1;
+		packets = NULL;
+		spaceSignal = NULL;
+	}
+
+	~BenchRun()
+	{
+		CloseCodec(&videoContext);
+		CloseCodec(&audioContext);
+		avformat_close_input(&formatContext);
+		sws_freeContext(sws);
+		swr_free(&swr);
+		av_free(picture);
+		av_free(audioBuffer);
+		av_frame_free(&frame);
+	}
+
+	int Open(const char *path, const char *audioDecoder)
+	{
+		if (avformat_open_input(&formatContext, path, NULL, NULL) < 0)
+			return -1;
+
+		avformat_find_stream_info(formatContext, NULL);
+
+		videoStream = av_find_best_stream(formatContext, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+		audioStream = av_find_best_stream(formatContext, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+		if (videoStream < 0 || audioStream < 0)
+			return -1;
+
+		videoContext = OpenCodec(formatContext->streams[videoStream], NULL);
+		audioContext = OpenCodec(formatContext->streams[audioStream], audioDecoder);
+		if (videoContext == NULL || audioContext == NULL)
+			return -1;
+
+		// Same targets the player uses: YUV420P texture, stereo S16 device
+		picture = (uint8_t *)av_malloc(avpicture_get_size(AV_PIX_FMT_YUV420P, videoContext->width, videoContext->height));
+
+		uint64_t layout = audioContext->channel_layout ? audioContext->channel_layout : av_get_default_channel_layout(audioContext->channels);
+		swr = swr_alloc_set_opts(NULL, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, BENCH_SAMPLE_RATE,
+			layout, audioContext->sample_fmt, audioContext->sample_rate, 0, NULL);
+
+		return swr_init(swr);
+	}
+
+	// Fills values[] in benchMetrics order
+	void Measure(double *values)
+	{
+		Syncer sync(NULL, NULL);
+		Telemetry::Instance().Reset();
+		ProfileScope scope("decode");
+
+		// Packets reach the decoders through a PacketQueue fed by a reader
+		// thread, as in the player, so its allocations and lock waits count
+		PacketQueue queue("bench packets");
+		StageSignal space;
+		queue.setSpaceSignal(&space);
+		packets = &queue;
+		spaceSignal = &space;
+
+		AllocStats::Take(NULL);
+		double waitStart = Profiler::TotalWaitMs();
+		SDL_Thread *reader = SDL_CreateThread(ReadThread, "bench demux", this);
+
+		double freq = (double)SDL_GetPerformanceFrequency();
+		Uint64 decodeTicks = 0, convertTicks = 0, audioTicks = 0;
+		int videoFrames = 0;
+		int64_t audioSamples = 0;
+		double audioClock = -1;
+		double maxOffset = 0;
+
+		AVPacket packet;
+		int frameFinished;
+
+		while (queue.Get(&packet))
+		{
+			if (PacketQueue::IsLast(&packet))
+				break;
+
+			Uint64 t0 = SDL_GetPerformanceCounter();
+
+			if (packet.stream_index == videoStream)
+			{
+				avcodec_decode_video2(videoContext, frame, &frameFinished, &packet);
+				Uint64 t1 = SDL_GetPerformanceCounter();
+				decodeTicks += t1 - t0;
+
+				if (frameFinished)
+				{
+					Convert();
+					convertTicks += SDL_GetPerformanceCounter() - t1;
+					videoFrames++;
+
+					double videoClock = av_frame_get_best_effort_timestamp(frame) * av_q2d(formatContext->streams[videoStream]->time_base);
+					if (audioClock >= 0)
+					{
+						sync.computeFrameDelay(videoClock, audioClock);
+						double offset = fabs(videoClock - audioClock);
+						if (offset > maxOffset)
+							maxOffset = offset;
+					}
+				}
+			}
+			else if (packet.stream_index == audioStream)
+			{
+				avcodec_decode_audio4(audioContext, frame, &frameFinished, &packet);
+				if (frameFinished)
+				{
+					// Clock runs on converted output, like a device would consume it
+					if (audioClock < 0)
+						audioClock = av_frame_get_best_effort_timestamp(frame) * av_q2d(formatContext->streams[audioStream]->time_base);
+
+					int converted = swr_convert(swr, &audioBuffer, MAX_AUDIO_FRAME_SIZE / 4, (const uint8_t **)frame->extended_data, frame->nb_samples);
+					if (converted > 0)
+					{
+						audioSamples += converted;
+						audioClock += (double)converted / BENCH_SAMPLE_RATE;
+					}
+				}
+				audioTicks += SDL_GetPerformanceCounter() - t0;
+			}
+
+			av_packet_unref(&packet);
+		}
+
+		SDL_WaitThread(reader, NULL);
+		int allocs = AllocStats::Take(NULL);
+		double waitMs = Profiler::TotalWaitMs() - waitStart;
+
+		double audioSeconds = (double)audioSamples / BENCH_SAMPLE_RATE;
+
+		values[0] = videoFrames ? decodeTicks / freq * 1000 / videoFrames : 0;
+		values[1] = videoFrames ? convertTicks / freq * 1000 / videoFrames : 0;
+		values[2] = audioSeconds > 0 ? audioTicks / freq * 1000 / audioSeconds : 0;
+		values[3] = maxOffset * 1000;
+		values[4] = Telemetry::Instance().syncCorrections();
+		values[5] = videoFrames ? (double)allocs / videoFrames : 0;
+		values[6] = videoFrames ? waitMs * 1000 / videoFrames : 0;
+	}
+
+private:
+	static int ReadThread(void *arg)
+	{
+		ProfileScope scope("demux");
+		((BenchRun*)arg)->Read();
+		return 0;
+	}
+
+	// Keeps at most BENCH_QUEUE_DEPTH packets queued, then marks the end
+	void Read()
+	{
+		AVPacket packet;
+
+		for (;;)
+		{
+			unsigned int seen = spaceSignal->Sequence();
+			if (packets->getSize() >= BENCH_QUEUE_DEPTH)
+			{
+				spaceSignal->WaitChange(seen);
+				continue;
+			}
+
+			if (av_read_frame(formatContext, &packet) < 0)
+				break;
+
+			packets->Put(&packet);
+		}
+
+		PacketQueue::MakeLast(&packet);
+		packets->Put(&packet);
+	}
+
+	void Convert()
+	{
+		sws = sws_getCachedContext(sws,
+			videoContext->width, videoContext->height, videoContext->pix_fmt,
+			videoContext->width, videoContext->height, AV_PIX_FMT_YUV420P,
+			SWS_BILINEAR, NULL, NULL, NULL);
+
+		AVPicture pictureYUV420P;
+		avpicture_fill(&pictureYUV420P, picture, AV_PIX_FMT_YUV420P, videoContext->width, videoContext->height);
+		sws_scale(sws, frame->data, frame->linesize, 0, videoContext->height, pictureYUV420P.data, pictureYUV420P.linesize);
+	}
+
+	static AVCodecContext* OpenCodec(AVStream *stream, const char *decoderName)
+	{
+		AVCodec *codec = decoderName ? avcodec_find_decoder_by_name(decoderName) : NULL;
+		if (codec == NULL)
+			codec = avcodec_find_decoder(stream->codec->codec_id);
+		if (codec == NULL)
+			return NULL;
+
+		AVCodecContext *context = avcodec_alloc_context3(codec);
+		avcodec_copy_context(context, stream->codec);
+
+		if (avcodec_open2(context, codec, NULL) < 0)
+			avcodec_free_context(&context);
+
+		return context;
+	}
+
+	static void CloseCodec(AVCodecContext **context)
+	{
+		if (*context)
+		{
+			avcodec_close(*context);
+			avcodec_free_context(context);
+		}
+	}
+
+private:
+	AVFormatContext	*formatContext;
+	AVCodecContext	*videoContext;
+	AVCodecContext	*audioContext;
+	SwsContext		*sws;
+	SwrContext		*swr;
+	uint8_t			*picture;			// converted YUV420P frame
+	uint8_t			*audioBuffer;		// converted stereo S16
+	AVFrame			*frame;
+	int				videoStream;
+	int				audioStream;
+	PacketQueue		*packets;			// reader thread -> Measure
+	StageSignal		*spaceSignal;
+};
+
+// --bench [baseline] [--update]: generates the matrix (once), runs every
+// case and compares with the stored baseline. Returns 1 on regression.
+class Benchmark
+{
+public:
+	static int Run(int argc, char **argv)
+	{
+		const char *baselinePath = BENCH_DEFAULT_BASELINE;
+		bool update = false;
+
+		for (int i = 0; i < argc; i++)
+		{
+			if (strcmp(argv[i], "--update") == 0)
+				update = true;
+			else
+				baselinePath = argv[i];
+		}
+
+		av_register_all();
+		avfilter_register_all();
+		av_log_set_level(AV_LOG_ERROR);
+
+		std::map<std::string, double> baseline;
+		bool haveBaseline = LoadBaseline(baselinePath, baseline);
+		std::map<std::string, double> current;
+		int regressions = 0;
+		int compared = 0;
+
+		fprintf(stdout, "%-20s %10s %10s %10s %10s %6s %9s %9s\n", "case", "decode ms", "convert ms", "audio ms/s", "intlv ms", "fixes", "allocs/f", "wait us/f");
+
+		for (size_t i = 0; i < sizeof(benchCases) / sizeof(benchCases[0]); i++)
+		{
+			const BenchCase &bc = benchCases[i];
+
+			char path[256];
+			snprintf(path, sizeof(path), "bench_%s.mkv", bc.name);
+
+			if (!Exists(path))
+			{
+				BenchMedia media(bc);
+				int ret = media.Generate(path);
+				if (ret < 0)
+				{
+					remove(path);
+					fprintf(stdout, "%-20s %s\n", bc.name, ret == AVERROR_ENCODER_NOT_FOUND ? "skipped (no encoder)" : "skipped (generation failed)");
+					continue;
+				}
+			}
+
+			BenchRun run;
+			if (run.Open(path, bc.audioDecoder) < 0)
+			{
+				fprintf(stdout, "%-20s skipped (no decoder)\n", bc.name);
+				continue;
+			}
+
+			double values[BENCH_METRIC_COUNT];
+			run.Measure(values);
+
+			fprintf(stdout, "%-20s %10.3f %10.3f %10.3f %10.2f %6.0f %9.2f %9.1f\n", bc.name, values[0], values[1], values[2], values[3], values[4], values[5], values[6]);
+
+			for (size_t m = 0; m < BENCH_METRIC_COUNT; m++)
+			{
+				std::string key = std::string(bc.name) + " " + benchMetrics[m].name;
+				current[key] = values[m];
+
+				std::map<std::string, double>::iterator base = baseline.find(key);
+				if (base != baseline.end())
+					compared++;
+				if (haveBaseline && !update && base != baseline.end() && IsRegression(benchMetrics[m], base->second, values[m]))
+				{
+					fprintf(stdout, "  REGRESSION %s: %.3f -> %.3f\n", key.c_str(), base->second, values[m]);
+					regressions++;
+				}
+			}
+		}
+
+		Profiler::Report();
+
+		if (!haveBaseline || update)
+		{
+			SaveBaseline(baselinePath, current);
+			fprintf(stdout, "Baseline written to %s\n", baselinePath);
+			return 0;
+		}
+
+		// A baseline from before a metric was renamed compares nothing
+		if (compared == 0)
+			fprintf(stdout, "No metric of %s matches this build - rerun with --update\n", baselinePath);
+
+		fprintf(stdout, "%d regression(s) against %s\n", regressions, baselinePath);
+		return regressions ? 1 : 0;
+	}
+
+private:
+	static bool IsRegression(const BenchMetric &metric, double base, double value)
+	{
+		if (metric.relative)
+			return value > base * (1 + metric.tolerance);
+
+		return value > base + metric.tolerance;
+	}
+
+	static bool Exists(const char *path)
+	{
+		FILE *f = fopen(path, "rb");
+		if (f == NULL)
+			return false;
+		fclose(f);
+		return true;
+	}
+
+	// "<case> <metric> <value>" per line
+	static bool LoadBaseline(const char *path, std::map<std::string, double> &values)
+	{
+		FILE *f = fopen(path, "r");
+		if (f == NULL)
+			return false;
+
+		char name[128], metric[64];
+		double value;
+		while (fscanf(f, "%127s %63s %lf", name, metric, &value) == 3)
+			values[std::string(name) + " " + metric] = value;
+
+		fclose(f);
+		return true;
+	}
+
+	static void SaveBaseline(const char *path, const std::map<std::string, double> &values)
+	{
+		FILE *f = fopen(path, "w");
+		if (f == NULL)
+		{
+			fprintf(stderr, "Cannot write %s\n", path);
+			return;
+		}
+
+		for (std::map<std::string, double>::const_iterator i = values.begin(); i != values.end(); ++i)
+			fprintf(f, "%s %.6f\n", i->first.c_str(), i->second);
+
+		fclose(f);
+	}
+};
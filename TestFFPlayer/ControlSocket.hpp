@@ -0,0 +1,330 @@
+#pragma once
+
+#include "stdafx.h"
+#include <SDL.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "Telemetry.hpp"
+
+#ifdef _WIN32
+#include <winsock2.h>
+// AF_UNIX came with the Windows 10 SDK 10.0.17134; older SDKs build
+// without the control socket
+#ifdef NTDDI_WIN10_RS4
+#include <afunix.h>
+#else
+#define CONTROL_UNSUPPORTED
+#endif
+typedef SOCKET control_socket_t;
+#define CONTROL_INVALID INVALID_SOCKET
+#define CONTROL_CLOSE closesocket
+#define CONTROL_SEND_FLAGS 0
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <unistd.h>
+typedef int control_socket_t;
+#define CONTROL_INVALID (-1)
+#define CONTROL_CLOSE close
+#ifdef MSG_NOSIGNAL
+#define CONTROL_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define CONTROL_SEND_FLAGS 0
+#endif
+#endif
+
+#define CONTROL_MAX_CLIENTS 8
+#define CONTROL_LINE_SIZE 1024
+#define CONTROL_MIN_SUBSCRIBE_MS 50
+
+// Fills `reply` for one command line. Runs on the control thread.
+typedef void (*ControlHandler)(void *arg, const char *command, std::string &reply);
+
+// Line-based control endpoint on a Unix-domain socket. Every command gets
+// one reply line. "subscribe <ms>" makes the connection receive the reply
+// to "metrics" every <ms> milliseconds until "unsubscribe".
+// Everything here runs on its own thread.
+class ControlSocket
+{
+public:
+	ControlSocket(const char *path, ControlHandler handler, void *arg)
+	{
+		this->path = path;
+		this->handler = handler;
+		this->arg = arg;
+		listener = CONTROL_INVALID;
+		wakeSend = CONTROL_INVALID;
+		wakeRecv = CONTROL_INVALID;
+		thread = 0;
+		SDL_AtomicSet(&quit, 0);
+	}
+
+	~ControlSocket()
+	{
+		Stop();
+	}
+
+	int Start()
+	{
+#ifdef CONTROL_UNSUPPORTED
+		SDL_Log("Control socket %s: this build has no AF_UNIX (Windows 10 SDK 10.0.17134 or later needed)", path);
+		return -1;
+#else
+#ifdef _WIN32
+		WSADATA wsa;
+		WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+		// A socket left behind by a crashed player would make bind fail
+		remove(path);
+
+		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener == CONTROL_INVALID
+			|| bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0
+			|| listen(listener, CONTROL_MAX_CLIENTS) != 0)
+		{
+			SDL_Log("Control socket %s: cannot listen", path);
+			Close(listener);
+			return -1;
+		}
+
+		// A connection to ourselves wakes the blocked select for Stop; there
+		// is no socketpair on Windows
+		wakeSend = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (wakeSend == CONTROL_INVALID
+			|| connect(wakeSend, (struct sockaddr *)&addr, sizeof(addr)) != 0
+			|| (wakeRecv = accept(listener, NULL, NULL)) == CONTROL_INVALID)
+		{
+			SDL_Log("Control socket %s: cannot connect to itself", path);
+			Close(wakeSend);
+			Close(listener);
+			return -1;
+		}
+
+		thread = SDL_CreateThread(ListenThread, "control", this);
+		SDL_Log("Control socket listening on %s", path);
+		return 0;
+#endif
+	}
+
+	void Stop()
+	{
+		if (thread == 0)
+			return;
+
+		SDL_AtomicSet(&quit, 1);
+		send(wakeSend, "q", 1, CONTROL_SEND_FLAGS);
+		SDL_WaitThread(thread, NULL);
+		thread = 0;
+
+		for (size_t i = 0; i < clients.size(); i++)
+			Close(clients[i].fd);
+		clients.clear();
+
+		Close(wakeSend);
+		Close(wakeRecv);
+		Close(listener);
+		remove(path);
+#ifdef _WIN32
+		WSACleanup();
+#endif
+	}
+
+private:
+	struct Client
+	{
+		control_socket_t	fd;
+		std::string			pending;		// bytes after the last newline
+		Uint32				subscribeMs;	// 0 = not subscribed
+		Uint32				nextPush;
+	};
+
+	static int ListenThread(void *arg)
+	{
+		ControlSocket *c = (ControlSocket*)arg;
+		c->Serve();
+		return 0;
+	}
+
+	// Blocks until a client or Stop has something, or the next subscription
+	// push is due - no wakeups at all while nobody is connected
+	void Serve()
+	{
+		while (!SDL_AtomicGet(&quit))
+		{
+			fd_set readable;
+			FD_ZERO(&readable);
+			FD_SET(listener, &readable);
+			FD_SET(wakeRecv, &readable);
+			int maxFd = (int)(listener > wakeRecv ? listener : wakeRecv);
+
+			for (size_t i = 0; i < clients.size(); i++)
+			{
+				FD_SET(clients[i].fd, &readable);
+				if ((int)clients[i].fd > maxFd)
+					maxFd = (int)clients[i].fd;
+			}
+
+			struct timeval timeout;
+			int untilPush = UntilNextPush();
+			timeout.tv_sec = untilPush / 1000;
+			timeout.tv_usec = (untilPush % 1000) * 1000;
+
+			int ready = select(maxFd + 1, &readable, NULL, NULL, untilPush < 0 ? NULL : &timeout);
+			Telemetry::Instance().OnWakeup();
+
+			if (ready > 0 && FD_ISSET(listener, &readable))
+				Accept();
+
+			for (size_t i = 0; i < clients.size(); )
+			{
+				bool alive = true;
+				if (ready > 0 && FD_ISSET(clients[i].fd, &readable))
+					alive = Receive(clients[i]);
+				if (alive)
+					alive = Push(clients[i]);
+
+				if (alive)
+				{
+					i++;
+				}
+				else
+				{
+					Close(clients[i].fd);
+					clients.erase(clients.begin() + i);
+				}
+			}
+		}
+	}
+
+	void Accept()
+	{
+		control_socket_t fd = accept(listener, NULL, NULL);
+		if (fd == CONTROL_INVALID)
+			return;
+
+		if (clients.size() >= CONTROL_MAX_CLIENTS)
+		{
+			Close(fd);
+			return;
+		}
+
+		Client c;
+		c.fd = fd;
+		c.subscribeMs = 0;
+		c.nextPush = 0;
+		clients.push_back(c);
+	}
+
+	// Returns false when the peer went away
+	bool Receive(Client &c)
+	{
+		char buf[CONTROL_LINE_SIZE];
+		int n = recv(c.fd, buf, sizeof(buf), 0);
+		if (n <= 0)
+			return false;
+
+		c.pending.append(buf, n);
+
+		size_t eol;
+		while ((eol = c.pending.find('\n')) != std::string::npos)
+		{
+			std::string line = c.pending.substr(0, eol);
+			c.pending.erase(0, eol + 1);
+
+			if (!line.empty() && line[line.size() - 1] == '\r')
+				line.erase(line.size() - 1);
+			if (line.empty())
+				continue;
+
+			std::string reply;
+			int ms;
+			if (sscanf(line.c_str(), "subscribe %d", &ms) == 1)
+			{
+				c.subscribeMs = ms < CONTROL_MIN_SUBSCRIBE_MS ? CONTROL_MIN_SUBSCRIBE_MS : ms;
+				c.nextPush = SDL_GetTicks();
+				reply = "ok";
+			}
+			else if (line == "unsubscribe")
+			{
+				c.subscribeMs = 0;
+				reply = "ok";
+			}
+			else
+			{
+				handler(arg, line.c_str(), reply);
+			}
+
+			if (!Send(c, reply))
+				return false;
+		}
+
+		// A line longer than this is not a command
+		if (c.pending.size() > CONTROL_LINE_SIZE)
+			c.pending.clear();
+
+		return true;
+	}
+
+	// Milliseconds until the earliest subscription is due, -1 for none
+	int UntilNextPush()
+	{
+		int wait = -1;
+		Uint32 now = SDL_GetTicks();
+
+		for (size_t i = 0; i < clients.size(); i++)
+		{
+			if (clients[i].subscribeMs == 0)
+				continue;
+
+			int due = SDL_TICKS_PASSED(now, clients[i].nextPush) ? 0 : (int)(clients[i].nextPush - now);
+			if (wait < 0 || due < wait)
+				wait = due;
+		}
+
+		return wait;
+	}
+
+	bool Push(Client &c)
+	{
+		if (c.subscribeMs == 0 || SDL_TICKS_PASSED(SDL_GetTicks(), c.nextPush) == 0)
+			return true;
+
+		c.nextPush = SDL_GetTicks() + c.subscribeMs;
+
+		std::string reply;
+		handler(arg, "metrics", reply);
+		return Send(c, reply);
+	}
+
+	static bool Send(Client &c, const std::string &reply)
+	{
+		std::string line = reply + "\n";
+		return send(c.fd, line.c_str(), (int)line.size(), CONTROL_SEND_FLAGS) == (int)line.size();
+	}
+
+	static void Close(control_socket_t &fd)
+	{
+		if (fd != CONTROL_INVALID)
+			CONTROL_CLOSE(fd);
+		fd = CONTROL_INVALID;
+	}
+
+private:
+	const char			*path;
+	ControlHandler		handler;
+	void				*arg;
+	control_socket_t	listener;
+	control_socket_t	wakeSend;			// Stop writes here ...
+	control_socket_t	wakeRecv;			// ... to end the select in Serve
+	SDL_Thread			*thread;
+	SDL_atomic_t		quit;
+	std::vector<Client>	clients;
+};
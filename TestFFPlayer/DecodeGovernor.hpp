@@ -0,0 +1,165 @@
+#pragma once
+
+#include "stdafx.h"
+#include <SDL.h>
+
+extern "C"
+{
+	#include <libavcodec/avcodec.h>
+}
+
+#define DECODE_AVERAGE 0.9				// weight of the history in the decode time average
+#define DECODE_HIGH_LOAD 0.9			// decode time / frame budget that costs a level
+#define DECODE_LOW_LOAD 0.5				// ... and that earns one back
+#define DECODE_SETTLE_FRAMES 60			// frames between level changes
+#define DECODE_MAX_SETTLE_FRAMES 3600	// backoff limit for a level that keeps failing
+#define DECODE_DEFAULT_FPS 25
+
+enum DecodeLevel
+{
+	DECODE_FULL,
+	DECODE_SKIP_LOOP_FILTER,			// no deblocking on non-reference frames
+	DECODE_SKIP_NONREF,					// non-reference frames are not decoded at all
+	DECODE_LOWRES						// half resolution, where the codec supports it
+};
+
+// Keeps video decode inside its frame budget on slow machines. The average
+// decode time per shown frame is compared with the time that frame covers;
+// over DECODE_HIGH_LOAD quality drops a level, under DECODE_LOW_LOAD it
+// comes back. The decoder applies the level, see Video::DecodeVideo.
+class DecodeGovernor
+{
+public:
+	DecodeGovernor()
+	{
+		Reset(0, 0);
+	}
+
+	// `frameDuration` is the nominal frame time, 0 if unknown. `maxLowres`
+	// is the codec's; without lowres support the last level is left out.
+	void Reset(double frameDuration, int maxLowres)
+	{
+		nominal = frameDuration > 0 ? frameDuration : 1.0 / DECODE_DEFAULT_FPS;
+		topLevel = maxLowres > 0 ? DECODE_LOWRES : DECODE_SKIP_NONREF;
+		lvl = DECODE_FULL;
+		average = 0;
+		budget = nominal;
+		samples = 0;
+		sinceChange = 0;
+		settle = DECODE_SETTLE_FRAMES;
+		raised = false;
+		Restart();
+	}
+
+	// After a seek: the next frame does not follow the previous one
+	void Restart()
+	{
+		lastPts = -1;
+	}
+
+	// A frame with `pts` came out after `decodeTime` seconds spent in the
+	// decoder since the previous one. Returns how many frames the decoder
+	// skipped in between (DECODE_SKIP_NONREF and up).
+	int OnFrame(double decodeTime, double pts)
+	{
+		double span = lastPts >= 0 ? pts - lastPts : nominal;
+		lastPts = pts;
+
+		// Discontinuity - no budget to compare with
+		if (span <= 0 || span > 1.0)
+			return 0;
+
+		int skipped = 0;
+		if (lvl >= DECODE_SKIP_NONREF)
+			skipped = (int)(span / nominal + 0.5) - 1;
+
+		average = samples ? average * DECODE_AVERAGE + decodeTime * (1 - DECODE_AVERAGE) : decodeTime;
+		budget = samples ? budget * DECODE_AVERAGE + span * (1 - DECODE_AVERAGE) : span;
+		samples++;
+		sinceChange++;
+
+		if (sinceChange < settle)
+			return skipped > 0 ? skipped : 0;
+
+		double l = load();
+		if (l > DECODE_HIGH_LOAD && lvl < topLevel)
+			Change(lvl + 1);
+		else if (l < DECODE_LOW_LOAD && lvl > DECODE_FULL)
+			Change(lvl - 1);
+
+		return skipped > 0 ? skipped : 0;
+	}
+
+	int level()
+	{
+		return lvl;
+	}
+
+	// Average decode time over the time the frames cover
+	double load()
+	{
+		return budget > 0 ? average / budget : 0;
+	}
+
+	AVDiscard skipLoopFilter()
+	{
+		return lvl >= DECODE_SKIP_LOOP_FILTER ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+	}
+
+	AVDiscard skipFrame()
+	{
+		return lvl >= DECODE_SKIP_NONREF ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+	}
+
+	// The decoder found lowres unusable after all; drops back a level if needed
+	void disableLowres()
+	{
+		topLevel = DECODE_SKIP_NONREF;
+		if (lvl > topLevel)
+			Change(topLevel);
+	}
+
+	int lowres()
+	{
+		return lvl >= DECODE_LOWRES ? 1 : 0;
+	}
+
+	static const char* LevelName(int level)
+	{
+		switch (level)
+		{
+		case DECODE_FULL:				return "full";
+		case DECODE_SKIP_LOOP_FILTER:	return "skip loop filter";
+		case DECODE_SKIP_NONREF:		return "skip non-reference frames";
+		case DECODE_LOWRES:				return "lowres";
+		default:						return "?";
+		}
+	}
+
+private:
+	void Change(int to)
+	{
+		// Quality raised and lost again right away - wait longer before the next try
+		if (to > lvl && raised && sinceChange < settle * 2 && settle < DECODE_MAX_SETTLE_FRAMES)
+			settle *= 2;
+
+		SDL_Log("[decode] %s -> %s: decode %.1f ms per frame against a %.1f ms budget (load %.2f), next change in %d frames",
+			LevelName(lvl), LevelName(to), average * 1000, budget * 1000, load(), settle);
+
+		raised = to < lvl;
+		lvl = to;
+		sinceChange = 0;
+	}
+
+private:
+	double	nominal;				// frame duration of the stream
+	int		topLevel;
+	int		lvl;
+	double	average;				// decode seconds per shown frame
+	double	budget;					// media seconds per shown frame
+	int		samples;
+	int		sinceChange;
+	int		settle;					// frames a level is held
+	bool	raised;					// the last change restored quality
+	double	lastPts;
+};
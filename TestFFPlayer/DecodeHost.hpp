@@ -0,0 +1,293 @@
+#pragma once
+
+#include "stdafx.h"
+
+extern "C"
+{
+	#include <libavcodec/avcodec.h>
+	#include <libavformat/avformat.h>
+	#include <libavutil/mem.h>
+	#include <libavutil/time.h>
+}
+
+#include <SDL.h>
+#include <cstdio>
+#include <vector>
+#include "ThreadPool.hpp"
+
+#define HOST_QUANTUM_MS 10			// decode time a stream gets before yielding its worker
+
+// One headless demux + decode pipeline. Only one task per stream is ever
+// queued, so its contexts are never touched by two workers at once. The
+// counters are read by the stats printer, so they change under statsLock.
+class HostStream
+{
+public:
+	HostStream(const char *filename)
+	{
+		this->filename = filename;
+		formatContext = NULL;
+		videoContext = NULL;
+		audioContext = NULL;
+		frame = av_frame_alloc();
+		videoStream = -1;
+		audioStream = -1;
+		finished = false;
+
+		statsLock = 0;
+		packets = 0;
+		bytes = 0;
+		videoFrames = 0;
+		audioFrames = 0;
+		decodeTicks = 0;
+		quanta = 0;
+		lastVideoFrames = 0;
+	}
+
+	~HostStream()
+	{
+		CloseCodec(&videoContext);
+		CloseCodec(&audioContext);
+		avformat_close_input(&formatContext);
+		av_frame_free(&frame);
+	}
+
+	int Open()
+	{
+		if (avformat_open_input(&formatContext, filename, NULL, NULL) < 0)
+		{
+			fprintf(stderr, "%s: cannot open\n", filename);
+			return -1;
+		}
+
+		avformat_find_stream_info(formatContext, NULL);
+
+		videoStream = av_find_best_stream(formatContext, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+		audioStream = av_find_best_stream(formatContext, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+
+		if (videoStream >= 0)
+			videoContext = OpenCodec(formatContext->streams[videoStream]);
+		if (audioStream >= 0)
+			audioContext = OpenCodec(formatContext->streams[audioStream]);
+
+		for (unsigned int i = 0; i < formatContext->nb_streams; i++)
+			if ((int)i != videoStream && (int)i != audioStream)
+				formatContext->streams[i]->discard = AVDISCARD_ALL;
+
+		return 0;
+	}
+
+	// Decodes for one quantum of time, so an expensive stream gets no more
+	// CPU than a cheap one. Returns false at end of stream.
+	bool Step()
+	{
+		AVPacket packet;
+		int frameFinished;
+		Uint64 start = SDL_GetPerformanceCounter();
+		Uint64 budget = SDL_GetPerformanceFrequency() * HOST_QUANTUM_MS / 1000;
+		Uint64 now = start;
+		bool end = false;
+		int stepPackets = 0, stepBytes = 0, stepVideo = 0, stepAudio = 0;
+
+		// At least one packet, however long it takes
+		do
+		{
+			if (av_read_frame(formatContext, &packet) < 0)
+			{
+				end = true;
+				break;
+			}
+
+			stepPackets++;
+			stepBytes += packet.size;
+
+			if (packet.stream_index == videoStream && videoContext)
+			{
+				avcodec_decode_video2(videoContext, frame, &frameFinished, &packet);
+				if (frameFinished)
+					stepVideo++;
+			}
+			else if (packet.stream_index == audioStream && audioContext)
+			{
+				avcodec_decode_audio4(audioContext, frame, &frameFinished, &packet);
+				if (frameFinished)
+					stepAudio++;
+			}
+
+			av_packet_unref(&packet);
+			now = SDL_GetPerformanceCounter();
+		} while (now - start < budget);
+
+		SDL_AtomicLock(&statsLock);
+		packets += stepPackets;
+		bytes += stepBytes;
+		videoFrames += stepVideo;
+		audioFrames += stepAudio;
+		decodeTicks += now - start;
+		quanta++;
+		finished = end;
+		SDL_AtomicUnlock(&statsLock);
+
+		return !end;
+	}
+
+	// Stats printer thread
+	void PrintStats(int id, double seconds)
+	{
+		double freq = (double)SDL_GetPerformanceFrequency();
+
+		SDL_AtomicLock(&statsLock);
+		int frames = videoFrames;
+		int audio = audioFrames;
+		int64_t total = bytes;
+		Uint64 ticks = decodeTicks;
+		int count = quanta;
+		bool done = finished;
+		SDL_AtomicUnlock(&statsLock);
+
+		fprintf(stdout, "  [%2d] %-32.32s %7.1f fps  %8d frames  %7d audio  %8.1f MB  %6.2f ms/quantum%s\n",
+			id, filename,
+			seconds > 0 ? (frames - lastVideoFrames) / seconds : 0,
+			frames, audio, total / 1048576.0,
+			count ? ticks / freq * 1000 / count : 0,
+			done ? "  (done)" : "");
+
+		lastVideoFrames = frames;
+	}
+
+private:
+	AVCodecContext* OpenCodec(AVStream *stream)
+	{
+		AVCodec *codec = avcodec_find_decoder(stream->codec->codec_id);
+		if (codec == NULL)
+			return NULL;
+
+		AVCodecContext *context = avcodec_alloc_context3(codec);
+		avcodec_copy_context(context, stream->codec);
+		context->thread_count = 1;			// the shared pool provides the parallelism
+
+		if (avcodec_open2(context, codec, NULL) < 0)
+			avcodec_free_context(&context);
+
+		return context;
+	}
+
+	static void CloseCodec(AVCodecContext **context)
+	{
+		if (*context)
+		{
+			avcodec_close(*context);
+			avcodec_free_context(context);
+		}
+	}
+
+private:
+	const char		*filename;
+	AVFormatContext	*formatContext;
+	AVCodecContext	*videoContext;
+	AVCodecContext	*audioContext;
+	AVFrame			*frame;
+	int				videoStream;
+	int				audioStream;
+
+	SDL_SpinLock	statsLock;
+	bool			finished;
+	int64_t			packets;
+	int64_t			bytes;
+	int				videoFrames;
+	int				audioFrames;
+	Uint64			decodeTicks;
+	int				quanta;
+	int				lastVideoFrames;	// printer thread only
+};
+
+// Runs many HostStreams on one work-stealing pool sized to the core count.
+// Nothing here touches process-wide SDL audio/video state.
+class DecodeHost
+{
+public:
+	DecodeHost()
+	{
+		active.value = 0;
+	}
+
+	~DecodeHost()
+	{
+		for (size_t i = 0; i < streams.size(); i++)
+			delete streams[i].stream;
+	}
+
+	int Run(int count, char **filenames)
+	{
+		av_register_all();
+		avformat_network_init();
+
+		for (int i = 0; i < count; i++)
+		{
+			Entry e;
+			e.host = this;
+			e.stream = new HostStream(filenames[i]);
+			if (e.stream->Open() < 0)
+			{
+				delete e.stream;
+				continue;
+			}
+			streams.push_back(e);
+		}
+
+		ThreadPool pool;
+		this->pool = &pool;
+
+		fprintf(stdout, "decoding %d streams on %d workers\n", (int)streams.size(), pool.size());
+
+		SDL_AtomicSet(&active, (int)streams.size());
+		for (size_t i = 0; i < streams.size(); i++)
+			pool.Submit(StepTask, &streams[i]);
+
+		Uint64 start = SDL_GetPerformanceCounter();
+		Uint64 last = start;
+
+		while (SDL_AtomicGet(&active) > 0)
+		{
+			SDL_Delay(1000);
+
+			Uint64 now = SDL_GetPerformanceCounter();
+			PrintStats((double)(now - last) / SDL_GetPerformanceFrequency());
+			last = now;
+		}
+
+		fprintf(stdout, "all streams finished in %.2f s\n", (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency());
+
+		return 0;
+	}
+
+private:
+	struct Entry
+	{
+		DecodeHost	*host;
+		HostStream	*stream;
+	};
+
+	// Runs one quantum, then re-queues the stream behind the others on this worker
+	static void StepTask(void *arg)
+	{
+		Entry *e = (Entry*)arg;
+
+		if (e->stream->Step())
+			e->host->pool->Submit(StepTask, e);
+		else
+			SDL_AtomicAdd(&e->host->active, -1);
+	}
+
+	void PrintStats(double seconds)
+	{
+		fprintf(stdout, "%d/%d streams active\n", SDL_AtomicGet(&active), (int)streams.size());
+		for (size_t i = 0; i < streams.size(); i++)
+			streams[i].stream->PrintStats((int)i, seconds);
+	}
+
+private:
+	std::vector<Entry>	streams;
+	ThreadPool			*pool;
+	SDL_atomic_t		active;
+};
@@ -0,0 +1,434 @@
+#pragma once
+
+#include "stdafx.h"
+
+extern "C"
+{
+	#include <libavutil/pixfmt.h>
+	#include <libavutil/imgutils.h>
+}
+
+#include <SDL.h>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define EXPORT_MAGIC 0x58454646			// "FFEX"
+#define EXPORT_VERSION 3
+#define EXPORT_SLOTS 8					// frames a reader may fall behind before it starts skipping
+#define EXPORT_MAX_READERS 8
+#define EXPORT_ALIGN 64
+
+// Shared layout: one ExportHeader, then EXPORT_SLOTS slots of slotSize bytes,
+// each an ExportSlot followed by the picture. Every slot is a seqlock: its
+// sequence is odd while the player writes it. Readers never take a lock and
+// the player never waits for them - a reader that is too slow sees a changed
+// sequence after reading and drops that frame.
+// Slots are sized for the first picture. Each slot carries its own geometry,
+// so smaller pictures (lowres, a filter change) keep flowing. A larger one
+// makes the player recreate the region under the same name and mark the old
+// one replaced; readers then reopen. On Windows the old mapping lives on
+// while a reader holds it, so there larger pictures are skipped until the
+// readers detach.
+struct ExportHeader
+{
+	uint32_t		magic;
+	uint32_t		version;
+	uint32_t		slotCount;
+	uint32_t		slotSize;
+	uint32_t		headerSize;			// offset of slot 0
+	int32_t			width;				// largest picture a slot holds
+	int32_t			height;
+	int32_t			format;				// AVPixelFormat of the pictures, planes contiguous
+	SDL_atomic_t	latest;				// number of the newest complete frame, 0 = none yet
+	SDL_atomic_t	replaced;			// 1 once the player publishes into a new region
+	SDL_atomic_t	readers[EXPORT_MAX_READERS];	// last frame each attached reader finished, 0 = free
+};
+
+struct ExportSlot
+{
+	SDL_atomic_t	sequence;			// 2 * frame number when complete, odd while written
+	int32_t			frame;
+	double			pts;				// seconds
+	int32_t			width;				// of this picture
+	int32_t			height;
+	uint32_t		planeOffset[3];		// from the end of ExportSlot
+	uint32_t		planePitch[3];
+};
+
+// Producer side, owned by Video
+class FrameExport
+{
+public:
+	FrameExport(const char *name) : base(0), mapSize(0), frames(0), oversized(false), failed(false)
+	{
+		this->name = name;
+#ifdef _WIN32
+		mapping = NULL;
+#else
+		fd = -1;
+#endif
+	}
+
+	~FrameExport()
+	{
+		if (base)
+		{
+			SDL_Log("Export %s: published %d frames", name, frames);
+
+			ExportHeader *header = (ExportHeader *)base;
+			for (int i = 0; i < EXPORT_MAX_READERS; i++)
+			{
+				int cursor = SDL_AtomicGet(&header->readers[i]);
+				if (cursor)
+					SDL_Log("  reader %d: %d frames behind", i, frames - cursor);
+			}
+		}
+
+		Unmap();
+
+#ifndef _WIN32
+		// Readers that still have it mapped keep their view
+		if (fd >= 0)
+			shm_unlink(name);
+#endif
+	}
+
+	// Copies a YUV420P picture into the next slot. Never blocks.
+	void Publish(const uint8_t *picture, int width, int height, double pts)
+	{
+		if (failed)
+			return;
+
+		if (base == 0 && Create(width, height) < 0)
+		{
+			failed = true;
+			return;
+		}
+
+		ExportHeader *header = (ExportHeader *)base;
+		int size = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, width, height, 1);
+		if (sizeof(ExportSlot) + size > header->slotSize)
+		{
+			// Tried once per run of larger pictures
+			if (oversized || Grow(width, height) < 0)
+			{
+				oversized = true;
+				return;
+			}
+			header = (ExportHeader *)base;
+		}
+		oversized = false;
+
+		int frame = ++frames;
+		ExportSlot *slot = Slot(frame);
+
+		SDL_AtomicSet(&slot->sequence, 2 * frame - 1);
+		slot->frame = frame;
+		slot->pts = pts;
+		SetGeometry(slot, width, height);
+		memcpy((uint8_t *)(slot + 1), picture, size);
+		SDL_AtomicSet(&slot->sequence, 2 * frame);
+
+		SDL_AtomicSet(&header->latest, frame);
+	}
+
+private:
+	// Moves to a region sized for `width` x `height`
+	int Grow(int width, int height)
+	{
+		ExportHeader *header = (ExportHeader *)base;
+
+#ifdef _WIN32
+		// The name stays bound to the old mapping while a reader holds it
+		for (int i = 0; i < EXPORT_MAX_READERS; i++)
+		{
+			if (SDL_AtomicGet(&header->readers[i]))
+			{
+				SDL_Log("Export %s: %dx%d does not fit the %dx%d slots and readers are attached, not exported",
+					name, width, height, header->width, header->height);
+				return -1;
+			}
+		}
+#endif
+
+		SDL_Log("Export %s: %dx%d does not fit the %dx%d slots, recreating", name, width, height, header->width, header->height);
+		SDL_AtomicSet(&header->replaced, 1);
+		Unmap();
+#ifndef _WIN32
+		// Readers keep the old object mapped until they reopen
+		shm_unlink(name);
+#endif
+
+		if (Create(width, height) < 0)
+		{
+			failed = true;
+			return -1;
+		}
+		return 0;
+	}
+
+	int Create(int width, int height)
+	{
+		int pictureSize = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, width, height, 1);
+
+		uint32_t headerSize = Align(sizeof(ExportHeader));
+		uint32_t slotSize = Align(sizeof(ExportSlot) + pictureSize);
+		mapSize = headerSize + EXPORT_SLOTS * slotSize;
+
+		if (Map() < 0)
+		{
+			SDL_Log("Export %s: cannot create shared memory", name);
+			return -1;
+		}
+
+		ExportHeader *header = (ExportHeader *)base;
+		memset(header, 0, headerSize);
+		header->version = EXPORT_VERSION;
+		header->slotCount = EXPORT_SLOTS;
+		header->slotSize = slotSize;
+		header->headerSize = headerSize;
+		header->width = width;
+		header->height = height;
+		header->format = AV_PIX_FMT_YUV420P;
+
+		for (int i = 0; i < EXPORT_SLOTS; i++)
+			SDL_AtomicSet(&((ExportSlot *)(base + headerSize + i * slotSize))->sequence, 0);
+
+		// Readers check the magic last
+		SDL_AtomicSet(&header->latest, 0);
+		header->magic = EXPORT_MAGIC;
+
+		SDL_Log("Export %s: %dx%d yuv420p, %d slots of %u bytes", name, width, height, EXPORT_SLOTS, slotSize);
+		return 0;
+	}
+
+	static void SetGeometry(ExportSlot *slot, int width, int height)
+	{
+		// Chroma planes round up for odd sizes, as Video packs them
+		int chromaWidth = (width + 1) / 2;
+		int chromaHeight = (height + 1) / 2;
+		slot->width = width;
+		slot->height = height;
+		slot->planeOffset[0] = 0;
+		slot->planeOffset[1] = width * height;
+		slot->planeOffset[2] = width * height + chromaWidth * chromaHeight;
+		slot->planePitch[0] = width;
+		slot->planePitch[1] = chromaWidth;
+		slot->planePitch[2] = chromaWidth;
+	}
+
+	ExportSlot* Slot(int frame)
+	{
+		ExportHeader *header = (ExportHeader *)base;
+		return (ExportSlot *)(base + header->headerSize + (frame % EXPORT_SLOTS) * header->slotSize);
+	}
+
+	static uint32_t Align(size_t size)
+	{
+		return (uint32_t)((size + EXPORT_ALIGN - 1) & ~(size_t)(EXPORT_ALIGN - 1));
+	}
+
+#ifdef _WIN32
+	int Map()
+	{
+		mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)mapSize, name);
+		if (mapping == NULL)
+			return -1;
+
+		base = (uint8_t *)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, mapSize);
+		return base ? 0 : -1;
+	}
+
+	void Unmap()
+	{
+		if (base)
+			UnmapViewOfFile(base);
+		if (mapping)
+			CloseHandle(mapping);
+		base = 0;
+		mapping = NULL;
+	}
+#else
+	int Map()
+	{
+		fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+		if (fd < 0)
+			return -1;
+
+		if (ftruncate(fd, mapSize) < 0)
+			return -1;
+
+		void *p = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			return -1;
+
+		base = (uint8_t *)p;
+		return 0;
+	}
+
+	void Unmap()
+	{
+		if (base)
+			munmap(base, mapSize);
+		if (fd >= 0)
+			close(fd);
+		base = 0;
+	}
+#endif
+
+private:
+	const char	*name;				// "/name" on POSIX, "Local\\name" on Windows
+	uint8_t		*base;
+	size_t		mapSize;
+	int			frames;
+	bool		oversized;			// the last picture did not fit and the region could not grow
+	bool		failed;				// no region could be created; export is off
+#ifdef _WIN32
+	HANDLE		mapping;
+#else
+	int			fd;
+#endif
+};
+
+// Consumer side for analytics processes. Usage:
+//		FrameExportReader r;  r.Open("/player");
+//		const ExportSlot *s = r.Next();  ... read r.Picture(s) in place, sized by s->width/height ...
+//		(Next stays NULL once replaced() - open a new reader under the same name)
+//		if (r.Release(s)) the data read was intact
+class FrameExportReader
+{
+public:
+	FrameExportReader() : base(0), mapSize(0), cursor(0), reader(-1), dropped(0)
+	{
+#ifdef _WIN32
+		mapping = NULL;
+#else
+		fd = -1;
+#endif
+	}
+
+	~FrameExportReader()
+	{
+		if (header() && reader >= 0)
+			SDL_AtomicSet(&header()->readers[reader], 0);
+
+#ifdef _WIN32
+		if (base)
+			UnmapViewOfFile(base);
+		if (mapping)
+			CloseHandle(mapping);
+#else
+		if (base)
+			munmap(base, mapSize);
+		if (fd >= 0)
+			close(fd);
+#endif
+	}
+
+	int Open(const char *name)
+	{
+#ifdef _WIN32
+		// Read-write: the reader stores its cursor in the header
+		mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+		if (mapping == NULL)
+			return -1;
+		base = (uint8_t *)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+#else
+		fd = shm_open(name, O_RDWR, 0);
+		if (fd < 0)
+			return -1;
+
+		struct stat st;
+		if (fstat(fd, &st) < 0)
+			return -1;
+
+		mapSize = st.st_size;
+		void *p = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		base = p == MAP_FAILED ? 0 : (uint8_t *)p;
+#endif
+		if (base == 0 || header()->magic != EXPORT_MAGIC || header()->version != EXPORT_VERSION)
+			return -1;
+
+		// Claim a cursor slot so the player can report how far behind we are
+		for (int i = 0; i < EXPORT_MAX_READERS && reader < 0; i++)
+			if (SDL_AtomicCAS(&header()->readers[i], 0, 1))
+				reader = i;
+
+		return 0;
+	}
+
+	ExportHeader* header()
+	{
+		return (ExportHeader *)base;
+	}
+
+	// Newest frame not seen yet, or NULL. Older unseen frames are skipped.
+	const ExportSlot* Next()
+	{
+		if (replaced())
+			return NULL;
+
+		int latest = SDL_AtomicGet(&header()->latest);
+		if (latest == 0 || latest == cursor)
+			return NULL;
+
+		if (cursor && latest - cursor > 1)
+			dropped += latest - cursor - 1;
+
+		ExportSlot *slot = (ExportSlot *)(base + header()->headerSize + (latest % header()->slotCount) * header()->slotSize);
+		snapshot = SDL_AtomicGet(&slot->sequence);
+		if (snapshot != 2 * latest)
+			return NULL;					// overwritten already
+
+		cursor = latest;
+		return slot;
+	}
+
+	const uint8_t* Picture(const ExportSlot *slot)
+	{
+		return (const uint8_t *)(slot + 1);
+	}
+
+	// True if the slot was not rewritten while it was being read
+	bool Release(const ExportSlot *slot)
+	{
+		bool intact = SDL_AtomicGet((SDL_atomic_t *)&slot->sequence) == snapshot;
+		if (!intact)
+			dropped++;
+
+		if (reader >= 0)
+			SDL_AtomicSet(&header()->readers[reader], cursor);
+
+		return intact;
+	}
+
+	int droppedFrames() { return dropped; }
+
+	// The player moved to a bigger region; this one gets no more frames
+	bool replaced()
+	{
+		return SDL_AtomicGet(&header()->replaced) != 0;
+	}
+
+private:
+	uint8_t		*base;
+	size_t		mapSize;
+	int			cursor;
+	int			snapshot;
+	int			reader;
+	int			dropped;
+#ifdef _WIN32
+	HANDLE		mapping;
+#else
+	int			fd;
+#endif
+};
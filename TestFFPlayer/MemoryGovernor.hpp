@@ -0,0 +1,277 @@
+#pragma once
+
+#include "stdafx.h"
+#include <SDL.h>
+#include <cstdio>
+#include <string>
+
+#define MEMORY_DEFAULT_BUDGET_MB 256
+#define MEMORY_MAX_COMPONENTS 32
+#define MEMORY_LOW_WATER 0.75			// pressure is relaxed again below this share of the budget
+#define MEMORY_SETTLE_MS 200			// time a level gets to take effect before the next one
+#define MEMORY_FULL_DEPTH 60			// packets per queue the demuxer reads ahead normally
+#define MEMORY_NO_PREFETCH_DEPTH 15
+#define MEMORY_MIN_DEPTH 4				// never less - decoders need some look-ahead
+
+// Eviction order, cheapest loss first. FIXED memory is only reported.
+enum MemoryClass
+{
+	MEMORY_PREFETCH,
+	MEMORY_CACHE,
+	MEMORY_QUEUE,
+	MEMORY_FIXED
+};
+
+// Pressure levels: each one adds to the previous
+enum MemoryLevel
+{
+	MEMORY_NORMAL,
+	MEMORY_PREFETCH_OFF,		// demux stops reading far ahead
+	MEMORY_CACHES_TRIMMED,		// idle pooled objects are freed
+	MEMORY_QUEUES_MINIMAL		// queues run at the minimum depth
+};
+
+// Frees what a cache can give back; returns the bytes released
+typedef int (*MemoryTrim)(void *arg);
+
+// One budget for every queue, pool and buffer of the player. Components
+// charge and release bytes as they go; going over the budget raises the
+// pressure level one step at a time, falling under the low-water mark
+// lowers it again.
+class MemoryGovernor
+{
+public:
+	MemoryGovernor()
+	{
+		mutex = SDL_CreateMutex();
+		count = 0;
+		for (int i = 0; i < MEMORY_MAX_COMPONENTS; i++)
+			components[i].used = false;
+		budget = (int64_t)MEMORY_DEFAULT_BUDGET_MB * 1024 * 1024;
+		total = 0;
+		countLock = 0;
+		SDL_AtomicSet(&level, MEMORY_NORMAL);
+		lastChange = 0;
+	}
+
+	~MemoryGovernor()
+	{
+		SDL_DestroyMutex(mutex);
+	}
+
+	static MemoryGovernor& Instance()
+	{
+		static MemoryGovernor governor;
+		return governor;
+	}
+
+	void setBudget(int megabytes)
+	{
+		if (megabytes <= 0)
+		{
+			SDL_Log("[memory] ignoring budget of %d MB", megabytes);
+			return;
+		}
+
+		budget = (int64_t)megabytes * 1024 * 1024;
+		SDL_Log("[memory] budget %d MB", megabytes);
+	}
+
+	// Returns an id for Charge, or -1 when every slot is taken
+	int Register(const char *name, MemoryClass cls, MemoryTrim trim = 0, void *arg = 0)
+	{
+		SDL_LockMutex(mutex);
+
+		int id;
+		for (id = 0; id < count; id++)
+			if (!components[id].used)
+				break;
+
+		if (id == MEMORY_MAX_COMPONENTS)
+		{
+			SDL_UnlockMutex(mutex);
+			return -1;
+		}
+
+		if (id == count)
+			count++;
+
+		Component &c = components[id];
+		c.used = true;
+		snprintf(c.name, sizeof(c.name), "%s", name);
+		c.cls = cls;
+		c.trim = trim;
+		c.arg = arg;
+		c.bytes = 0;
+
+		SDL_UnlockMutex(mutex);
+		return id;
+	}
+
+	// Releases whatever the component still has charged and frees its slot
+	void Unregister(int id)
+	{
+		if (id < 0)
+			return;
+
+		SDL_LockMutex(mutex);
+		Component &c = components[id];
+		SDL_AtomicLock(&countLock);
+		total -= c.bytes;
+		c.bytes = 0;
+		SDL_AtomicUnlock(&countLock);
+		c.used = false;
+		c.trim = 0;
+		SDL_UnlockMutex(mutex);
+	}
+
+	// Negative bytes release. Must not be called with a component's own lock held.
+	void Charge(int id, int bytes)
+	{
+		if (id < 0)
+			return;
+
+		// Totals are 64-bit so budgets past 2 GB work; SDL has no 64-bit atomics
+		SDL_AtomicLock(&countLock);
+		components[id].bytes += bytes;
+		total += bytes;
+		int64_t now = total;
+		SDL_AtomicUnlock(&countLock);
+
+		int lvl = SDL_AtomicGet(&level);
+		if ((now > budget && lvl < MEMORY_QUEUES_MINIMAL) || (now < budget * MEMORY_LOW_WATER && lvl > MEMORY_NORMAL))
+			Rebalance();
+	}
+
+	// Packets the demuxer may keep queued per stream at the current level
+	int queueDepth()
+	{
+		switch (SDL_AtomicGet(&level))
+		{
+		case MEMORY_NORMAL:				return MEMORY_FULL_DEPTH;
+		case MEMORY_QUEUES_MINIMAL:		return MEMORY_MIN_DEPTH;
+		default:						return MEMORY_NO_PREFETCH_DEPTH;
+		}
+	}
+
+	bool overBudget()
+	{
+		return Total() > budget;
+	}
+
+	// {"budget": .., "total": .., "level": .., "components": {"name": bytes, ..}}
+	std::string FormatJson()
+	{
+		char buf[128];
+		snprintf(buf, sizeof(buf), "{\"budget\": %lld, \"total\": %lld, \"level\": %d, \"components\": {",
+			(long long)budget, (long long)Total(), SDL_AtomicGet(&level));
+
+		std::string json = buf;
+
+		SDL_LockMutex(mutex);
+		bool first = true;
+		for (int i = 0; i < count; i++)
+		{
+			if (!components[i].used)
+				continue;
+
+			snprintf(buf, sizeof(buf), "%s\"%s\": %lld", first ? "" : ", ", components[i].name, (long long)Bytes(i));
+			json += buf;
+			first = false;
+		}
+		SDL_UnlockMutex(mutex);
+
+		return json + "}}";
+	}
+
+	void Report()
+	{
+		SDL_LockMutex(mutex);
+		SDL_Log("[memory] %.1f of %.1f MB, level %d", Total() / 1048576.0, budget / 1048576.0, SDL_AtomicGet(&level));
+		for (int i = 0; i < count; i++)
+			if (components[i].used)
+				SDL_Log("[memory]   %-24s %10lld bytes", components[i].name, (long long)Bytes(i));
+		SDL_UnlockMutex(mutex);
+	}
+
+private:
+	int64_t Total()
+	{
+		SDL_AtomicLock(&countLock);
+		int64_t bytes = total;
+		SDL_AtomicUnlock(&countLock);
+		return bytes;
+	}
+
+	int64_t Bytes(int id)
+	{
+		SDL_AtomicLock(&countLock);
+		int64_t bytes = components[id].bytes;
+		SDL_AtomicUnlock(&countLock);
+		return bytes;
+	}
+
+	void Rebalance()
+	{
+		// Whoever is already rebalancing will see our bytes too
+		if (SDL_TryLockMutex(mutex) != 0)
+			return;
+
+		Uint32 ticks = SDL_GetTicks();
+		int64_t now = Total();
+		int lvl = SDL_AtomicGet(&level);
+
+		if (lastChange == 0 || ticks - lastChange >= MEMORY_SETTLE_MS)
+		{
+			int previous = lvl;
+			if (now > budget && lvl < MEMORY_QUEUES_MINIMAL)
+				lvl++;
+			else if (now < budget * MEMORY_LOW_WATER && lvl > MEMORY_NORMAL)
+				lvl--;
+
+			if (lvl != previous)
+			{
+				// Published first: trimming charges back in, and must not escalate again
+				SDL_AtomicSet(&level, lvl);
+				lastChange = ticks ? ticks : 1;
+				SDL_Log("[memory] %.1f of %.1f MB - level %d, queue depth %d",
+					now / 1048576.0, budget / 1048576.0, lvl, queueDepth());
+
+				if (lvl == MEMORY_CACHES_TRIMMED && previous < lvl)
+					TrimCaches();
+			}
+		}
+
+		SDL_UnlockMutex(mutex);
+	}
+
+	void TrimCaches()
+	{
+		int freed = 0;
+		for (int i = 0; i < count; i++)
+			if (components[i].used && components[i].cls == MEMORY_CACHE && components[i].trim)
+				freed += components[i].trim(components[i].arg);
+
+		SDL_Log("[memory] trimmed caches, %d bytes freed", freed);
+	}
+
+private:
+	struct Component
+	{
+		bool			used;
+		char			name[32];
+		MemoryClass		cls;
+		int64_t			bytes;
+		MemoryTrim		trim;
+		void			*arg;
+	};
+
+	SDL_mutex		*mutex;
+	Component		components[MEMORY_MAX_COMPONENTS];
+	int				count;
+	int64_t			budget;
+	int64_t			total;
+	SDL_SpinLock	countLock;			// guards total and every component's bytes
+	SDL_atomic_t	level;
+	Uint32			lastChange;
+};
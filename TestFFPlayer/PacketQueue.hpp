@@ -1,6 +1,11 @@
 #pragma once
 #include "stdafx.h"
 #include <SDL.h>
+#include "Pool.hpp"
+#include "Pipeline.hpp"
+#include "MemoryGovernor.hpp"
+#include "Profiler.hpp"
+#include <cstdio>
 
 extern "C"
 {
@@ -14,37 +19,134 @@ extern "C"
 class PacketQueue
 {
 public:
-	PacketQueue()
+	// `name` labels the queue in the memory report
+	PacketQueue(const char *name = "packets")
 	{
 		mutex = SDL_CreateMutex();
 		cond = SDL_CreateCond();
+		Profiler::NameLock(lockProfile, name);
 		first_pkt = NULL;
 		last_pkt = NULL;
+		free_pkt = NULL;
 		nb_packets = 0;
 		size = 0;
+		aborted = false;
+		spaceSignal = NULL;
+		nb_free = 0;
+		serial = 0;
+
+		char freeName[64];
+		snprintf(freeName, sizeof(freeName), "%s (free)", name);
+		memoryId = MemoryGovernor::Instance().Register(name, MEMORY_QUEUE);
+		freeMemoryId = MemoryGovernor::Instance().Register(freeName, MEMORY_CACHE, TrimThunk, this);
 	}
 
 	~PacketQueue()
 	{
+		flush();
+
+		Trim();
+		MemoryGovernor::Instance().Unregister(memoryId);
+		MemoryGovernor::Instance().Unregister(freeMemoryId);
+
 		SDL_DestroyMutex(mutex);
 		SDL_DestroyCond(cond);
 	}
 
 	int getSize() { return nb_packets; }
 
+	// Flush generation of packets queued from now on
+	int getSerial() { return serial; }
+
+	// Bytes of packet data queued
+	int getBytes() { return size; }
+
+	// Frees the recycled nodes; returns the bytes released
+	int Trim()
+	{
+		Profiler::Lock(mutex, lockProfile);
+		AVPacketList *pkt = free_pkt;
+		int n = nb_free;
+		free_pkt = NULL;
+		nb_free = 0;
+		Profiler::Unlock(mutex, lockProfile);
+
+		while (pkt)
+		{
+			AVPacketList *next = pkt->next;
+			av_free(pkt);
+			pkt = next;
+		}
+
+		int bytes = n * (int)sizeof(AVPacketList);
+		MemoryGovernor::Instance().Charge(freeMemoryId, -bytes);
+		return bytes;
+	}
+
+	// Notified whenever a packet is taken out, i.e. space became available
+	void setSpaceSignal(StageSignal *signal)
+	{
+		spaceSignal = signal;
+	}
+
+	// Wakes every blocked Get; Get returns 0 from now on
+	void Abort()
+	{
+		Profiler::Lock(mutex, lockProfile);
+		aborted = true;
+		SDL_CondBroadcast(cond);
+		Profiler::Unlock(mutex, lockProfile);
+	}
+
+	// End-of-stream marker. It has no buffer, so unref on it is a no-op.
+	static void MakeLast(AVPacket *pkt)
+	{
+		av_init_packet(pkt);
+		pkt->data = (uint8_t*)"LAST";
+		pkt->size = 4;
+	}
+
+	static bool IsLast(const AVPacket *pkt)
+	{
+		return pkt->buf == NULL && pkt->data != NULL && strcmp((char*)pkt->data, "LAST") == 0;
+	}
+
+	// Takes ownership of the packet's reference; pkt is left blank.
 	int Put(AVPacket *pkt)
 	{
-		SDL_LockMutex(mutex);
+		// Some demuxers hand out packets that point into their own buffer,
+		// which the next av_read_frame overwrites - copy those before queueing
+		if (pkt->buf == NULL && !IsLast(pkt))
+		{
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 35, 100)
+			int ret = av_packet_make_refcounted(pkt);
+#else
+			int ret = av_dup_packet(pkt);
+#endif
+			if (ret < 0)
+			{
+				av_packet_unref(pkt);
+				return ret;
+			}
+			AllocStats::Count(pkt->size);
+		}
 
-		AVPacketList *newP;
-		if (av_dup_packet(pkt) < 0)
+		Profiler::Lock(mutex, lockProfile);
+
+		AVPacketList *newP = free_pkt;
+		bool recycled = newP != NULL;
+		if (newP)
 		{
-			SDL_UnlockMutex(mutex);
-			return -1;
+			free_pkt = newP->next;
+			nb_free--;
 		}
-			
-		newP = (AVPacketList*) av_malloc(sizeof(AVPacketList));
-		newP->pkt = *pkt;
+		else
+		{
+			newP = (AVPacketList*) av_malloc(sizeof(AVPacketList));
+			AllocStats::Count(sizeof(AVPacketList));
+		}
+
+		av_packet_move_ref(&newP->pkt, pkt);
 		newP->next = NULL;
   
 		if (!last_pkt)
@@ -55,21 +157,33 @@ public:
 		last_pkt = newP;
 		nb_packets++;
 		size += newP->pkt.size;
+		int bytes = newP->pkt.size + (int)sizeof(AVPacketList);
 		SDL_CondSignal(cond);
   
-		SDL_UnlockMutex(mutex);
+		Profiler::Unlock(mutex, lockProfile);
+
+		// Charged outside the lock - the governor may call back into Trim
+		MemoryGovernor::Instance().Charge(memoryId, bytes);
+		if (recycled)
+			MemoryGovernor::Instance().Charge(freeMemoryId, -(int)sizeof(AVPacketList));
 		return 0;
 	}
 
-	int Get(AVPacket *pkt)
+	// `packetSerial` receives the flush generation the packet was queued in.
+	// Without `block`, returns 0 at once when the queue is empty.
+	int Get(AVPacket *pkt, int *packetSerial = NULL, bool block = true)
 	{
 		AVPacketList *pkt1;
 		int ret = 0;
+		int bytes = 0;
 
-		SDL_LockMutex(mutex);
+		Profiler::Lock(mutex, lockProfile);
   
 		for(;;)
 		{
+			if (aborted)
+				break;
+
 			pkt1 = first_pkt;
 			if (pkt1)
 			{
@@ -79,58 +193,168 @@ public:
 				
 				nb_packets--;
 				size -= pkt1->pkt.size;
-				*pkt = pkt1->pkt;
-				av_free(pkt1);
+				av_packet_move_ref(pkt, &pkt1->pkt);
+				bytes = pkt->size + (int)sizeof(AVPacketList);
+				pkt1->next = free_pkt;
+				free_pkt = pkt1;
+				nb_free++;
+				if (packetSerial)
+					*packetSerial = serial;
 				ret = 1;
 				break;
 			}
+			else if (!block)
+			{
+				break;
+			}
 			else
 			{
-				SDL_CondWait(cond, mutex);
+				Profiler::CondWait(cond, mutex, lockProfile);
 			}
 		}
-		SDL_UnlockMutex(mutex);
+		Profiler::Unlock(mutex, lockProfile);
+
+		if (ret)
+		{
+			MemoryGovernor::Instance().Charge(memoryId, -bytes);
+			MemoryGovernor::Instance().Charge(freeMemoryId, (int)sizeof(AVPacketList));
+		}
+
+		if (ret && spaceSignal)
+			spaceSignal->Notify();
 
 		return ret;
 	}
 
 
+	// Drops queued packets timestamped before `ts` (stream time base); returns how many
+	int DropBefore(int64_t ts)
+	{
+		int count = 0;
+		int bytes = 0;
+
+		Profiler::Lock(mutex, lockProfile);
+
+		while (first_pkt)
+		{
+			AVPacketList *pkt = first_pkt;
+			int64_t pts = pkt->pkt.pts != AV_NOPTS_VALUE ? pkt->pkt.pts : pkt->pkt.dts;
+			if (pts == AV_NOPTS_VALUE || pts >= ts)
+				break;
+
+			first_pkt = pkt->next;
+			if (!first_pkt)
+				last_pkt = NULL;
+
+			nb_packets--;
+			size -= pkt->pkt.size;
+			bytes += pkt->pkt.size + (int)sizeof(AVPacketList);
+			av_packet_unref(&pkt->pkt);
+			pkt->next = free_pkt;
+			free_pkt = pkt;
+			nb_free++;
+			count++;
+		}
+
+		Profiler::Unlock(mutex, lockProfile);
+
+		MemoryGovernor::Instance().Charge(memoryId, -bytes);
+		MemoryGovernor::Instance().Charge(freeMemoryId, count * (int)sizeof(AVPacketList));
+		return count;
+	}
+
+	// Like flush, but the packets go to the end of `other` in order instead
+	// of being dropped. Returns the new flush generation.
+	int MoveTo(PacketQueue *other)
+	{
+		Profiler::Lock(mutex, lockProfile);
+
+		AVPacketList *list = first_pkt;
+		AVPacketList *tail = last_pkt;
+		int count = nb_packets;
+		int bytes = size + count * (int)sizeof(AVPacketList);
+
+		first_pkt = NULL;
+		last_pkt = NULL;
+		nb_packets = 0;
+		size = 0;
+		int newSerial = ++serial;
+
+		Profiler::Unlock(mutex, lockProfile);
+
+		MemoryGovernor::Instance().Charge(memoryId, -bytes);
+
+		for (AVPacketList *pkt = list; pkt != NULL; pkt = pkt->next)
+		{
+			if (IsLast(&pkt->pkt))
+				av_packet_unref(&pkt->pkt);
+			else
+				other->Put(&pkt->pkt);
+		}
+
+		// The emptied nodes are recycled here
+		if (list)
+		{
+			Profiler::Lock(mutex, lockProfile);
+			tail->next = free_pkt;
+			free_pkt = list;
+			nb_free += count;
+			Profiler::Unlock(mutex, lockProfile);
+
+			MemoryGovernor::Instance().Charge(freeMemoryId, count * (int)sizeof(AVPacketList));
+		}
+
+		return newSerial;
+	}
+
 	void flush()
 	{
 		AVPacketList *pkt, *pkt1;
 
-		SDL_LockMutex(mutex);
+		Profiler::Lock(mutex, lockProfile);
+
+		int count = nb_packets;
+		int bytes = size + count * (int)sizeof(AVPacketList);
 
 		for (pkt = first_pkt; pkt != NULL; pkt = pkt1) 
 		{
 			pkt1 = pkt->next;
-			//av_free_packet(&pkt->pkt);
-			if (strcmp((char*)pkt->pkt.data, "LAST") == 0)
-			{
-
-			}
-			else
-			{
-				av_packet_unref(&pkt->pkt);
-				av_freep(&pkt);
-			}
+			av_packet_unref(&pkt->pkt);
+			pkt->next = free_pkt;
+			free_pkt = pkt;
 		}
 
 		last_pkt = NULL;
 		first_pkt = NULL;
+		nb_free += count;
 		nb_packets = 0;
 		size = 0;
+		serial++;
+
+		Profiler::Unlock(mutex, lockProfile);
 
-		SDL_UnlockMutex(mutex);
+		MemoryGovernor::Instance().Charge(memoryId, -bytes);
+		MemoryGovernor::Instance().Charge(freeMemoryId, count * (int)sizeof(AVPacketList));
 	}
 
 private:
 	AVPacketList *first_pkt, *last_pkt;
+	AVPacketList *free_pkt;					// recycled nodes
+	int nb_free;
+	int serial;								// bumped by every flush, so consumers can tell a seek happened
 	int nb_packets;
 	int size;
 	SDL_mutex *mutex;
+	LockProfile lockProfile;
 	SDL_cond *cond;
-	bool bLast;
+	bool aborted;
+	StageSignal *spaceSignal;
+	int memoryId;							// queued packets
+	int freeMemoryId;						// recycled nodes
 
+	static int TrimThunk(void *arg)
+	{
+		return ((PacketQueue*)arg)->Trim();
+	}
 };
 
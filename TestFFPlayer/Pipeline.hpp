@@ -0,0 +1,155 @@
+#pragma once
+
+#include "stdafx.h"
+#include <SDL.h>
+#include "ThreadPool.hpp"
+#include "Profiler.hpp"
+#include "Tracer.hpp"
+
+#define MAX_PIPELINE_STAGES 8			// stages running at once; each holds a pool thread
+
+// Edge-triggered wakeup shared between pipeline stages. A stage reads the
+// sequence, checks its condition, and if it cannot proceed waits for the
+// sequence to move (data available, space available, resume, quit ...).
+class StageSignal
+{
+public:
+	StageSignal()
+	{
+		mutex = SDL_CreateMutex();
+		Profiler::NameLock(lockProfile, "stage signal");
+		cond = SDL_CreateCond();
+		seq = 0;
+	}
+
+	~StageSignal()
+	{
+		SDL_DestroyMutex(mutex);
+		SDL_DestroyCond(cond);
+	}
+
+	unsigned int Sequence()
+	{
+		Profiler::Lock(mutex, lockProfile);
+		unsigned int s = seq;
+		Profiler::Unlock(mutex, lockProfile);
+		return s;
+	}
+
+	void Notify()
+	{
+		Profiler::Lock(mutex, lockProfile);
+		seq++;
+		SDL_CondBroadcast(cond);
+		Profiler::Unlock(mutex, lockProfile);
+	}
+
+	void WaitChange(unsigned int seen)
+	{
+		Profiler::Lock(mutex, lockProfile);
+		while (seq == seen)
+			Profiler::CondWait(cond, mutex, lockProfile);
+		Profiler::Unlock(mutex, lockProfile);
+	}
+
+private:
+	SDL_mutex		*mutex;
+	LockProfile		lockProfile;
+	SDL_cond		*cond;
+	unsigned int	seq;
+};
+
+// Runs the player's stages (demux, video decode/convert, filter, subtitle
+// decode) on a pool of threads kept across Open/Reset. A stage is the
+// component's own long-lived loop: it holds its thread until it returns and
+// blocks in its own waits - on queue events, never on timers. This is not a
+// task scheduler; stages are not split into steps scheduled on readiness.
+// Rendering stays on the main thread and audio on SDL's callback.
+class Pipeline
+{
+public:
+	typedef int (*StageFunction)(void *arg);
+
+	Pipeline() : pool(MAX_PIPELINE_STAGES)
+	{
+		mutex = SDL_CreateMutex();
+		doneCond = SDL_CreateCond();
+		Profiler::NameLock(lockProfile, "pipeline");
+		running = 0;
+		stageCount = 0;
+	}
+
+	~Pipeline()
+	{
+		Join();
+
+		SDL_DestroyMutex(mutex);
+		SDL_DestroyCond(doneCond);
+	}
+
+	void Run(const char *name, StageFunction fn, void *arg)
+	{
+		Profiler::Lock(mutex, lockProfile);
+		if (stageCount == MAX_PIPELINE_STAGES)
+		{
+			// A stage queued behind blocking ones would never start
+			Profiler::Unlock(mutex, lockProfile);
+			SDL_Log("[pipeline] more than %d stages, %s not started", MAX_PIPELINE_STAGES, name);
+			return;
+		}
+		Stage *stage = &stages[stageCount++];
+		stage->pipeline = this;
+		stage->name = name;
+		stage->fn = fn;
+		stage->arg = arg;
+		running++;
+		Profiler::Unlock(mutex, lockProfile);
+
+		pool.Submit(StageTask, stage);
+	}
+
+	// Waits until every stage started with Run has returned
+	void Join()
+	{
+		Profiler::Lock(mutex, lockProfile);
+		while (running > 0)
+			Profiler::CondWait(doneCond, mutex, lockProfile);
+		stageCount = 0;
+		Profiler::Unlock(mutex, lockProfile);
+	}
+
+private:
+	struct Stage
+	{
+		Pipeline		*pipeline;
+		const char		*name;
+		StageFunction	fn;
+		void			*arg;
+	};
+
+	static void StageTask(void *arg)
+	{
+		Stage *stage = (Stage*)arg;
+		{
+			ProfileScope scope(stage->name);
+			// The stage records its own spans; one around the whole loop says nothing
+			Tracer::NameThread(stage->name);
+			stage->fn(stage->arg);
+		}
+
+		Pipeline *p = stage->pipeline;
+		Profiler::Lock(p->mutex, p->lockProfile);
+		p->running--;
+		SDL_CondBroadcast(p->doneCond);
+		Profiler::Unlock(p->mutex, p->lockProfile);
+	}
+
+private:
+	ThreadPool		pool;
+	Stage			stages[MAX_PIPELINE_STAGES];
+	SDL_mutex		*mutex;
+	LockProfile		lockProfile;
+	SDL_cond		*doneCond;
+	int				running;
+	int				stageCount;
+};
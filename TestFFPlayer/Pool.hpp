@@ -0,0 +1,167 @@
+#pragma once
+
+#include "stdafx.h"
+#include <SDL.h>
+#include <vector>
+#include "MemoryGovernor.hpp"
+#include "Profiler.hpp"
+
+extern "C"
+{
+	#include <libavcodec/avcodec.h>
+	#include <libavutil/mem.h>
+}
+
+// Counts heap allocations made by the playback pipeline (pool misses and
+// per-item allocations). Steady-state playback should report zero.
+class AllocStats
+{
+public:
+	static void Count(int bytes)
+	{
+		SDL_AtomicAdd(&allocs(), 1);
+		SDL_AtomicAdd(&bytes_(), bytes);
+		Profiler::Alloc(bytes);
+	}
+
+	// Returns the allocations since the previous call and resets the counters
+	static int Take(int *bytes)
+	{
+		int n = SDL_AtomicSet(&allocs(), 0);
+		int b = SDL_AtomicSet(&bytes_(), 0);
+		if (bytes)
+			*bytes = b;
+		return n;
+	}
+
+	// SDL timer callback - logs the allocation rate once per second
+	static Uint32 ReportTimer(Uint32 interval, void *userdata)
+	{
+		Telemetry::Instance().OnWakeup();
+		int bytes = 0;
+		int n = Take(&bytes);
+		if (n > 0)
+			SDL_Log("[alloc] %d allocations/s, %d bytes/s", n, bytes);
+		return interval;
+	}
+
+private:
+	static SDL_atomic_t& allocs()
+	{
+		static SDL_atomic_t value = { 0 };
+		return value;
+	}
+
+	static SDL_atomic_t& bytes_()
+	{
+		static SDL_atomic_t value = { 0 };
+		return value;
+	}
+};
+
+// Free list of AVFrames. A frame handed back is unreferenced but keeps its
+// AVFrame shell, so steady-state decoding never calls av_frame_alloc.
+class FramePool
+{
+public:
+	FramePool()
+	{
+		mutex = SDL_CreateMutex();
+		Profiler::NameLock(lockProfile, "frame pool");
+		memoryId = MemoryGovernor::Instance().Register("frame pool", MEMORY_CACHE, TrimThunk, this);
+	}
+
+	~FramePool()
+	{
+		MemoryGovernor::Instance().Unregister(memoryId);
+
+		for (size_t i = 0; i < frames.size(); i++)
+			av_frame_free(&frames[i]);
+
+		SDL_DestroyMutex(mutex);
+	}
+
+	static FramePool& Instance()
+	{
+		static FramePool pool;
+		return pool;
+	}
+
+	AVFrame* Get()
+	{
+		AVFrame* frame = NULL;
+
+		Profiler::Lock(mutex, lockProfile);
+		if (!frames.empty())
+		{
+			frame = frames.back();
+			frames.pop_back();
+		}
+		Profiler::Unlock(mutex, lockProfile);
+
+		if (frame == NULL)
+		{
+			frame = av_frame_alloc();
+			AllocStats::Count(sizeof(AVFrame));
+		}
+		else
+		{
+			MemoryGovernor::Instance().Charge(memoryId, -(int)sizeof(AVFrame));
+		}
+
+		return frame;
+	}
+
+	void Put(AVFrame* frame)
+	{
+		if (frame == NULL)
+			return;
+
+		av_frame_unref(frame);
+
+		Profiler::Lock(mutex, lockProfile);
+		frames.push_back(frame);
+		Profiler::Unlock(mutex, lockProfile);
+
+		MemoryGovernor::Instance().Charge(memoryId, sizeof(AVFrame));
+	}
+
+	// Bytes of picture or sample data `frame` holds references to
+	static int BufferBytes(const AVFrame *frame)
+	{
+		int bytes = 0;
+		for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++)
+			bytes += frame->buf[i]->size;
+		for (int i = 0; i < frame->nb_extended_buf; i++)
+			bytes += frame->extended_buf[i]->size;
+		return bytes;
+	}
+
+	// Frees the idle frames; returns the bytes released
+	int Trim()
+	{
+		Profiler::Lock(mutex, lockProfile);
+		std::vector<AVFrame*> idle;
+		idle.swap(frames);
+		Profiler::Unlock(mutex, lockProfile);
+
+		for (size_t i = 0; i < idle.size(); i++)
+			av_frame_free(&idle[i]);
+
+		int bytes = (int)(idle.size() * sizeof(AVFrame));
+		MemoryGovernor::Instance().Charge(memoryId, -bytes);
+		return bytes;
+	}
+
+private:
+	static int TrimThunk(void *arg)
+	{
+		return ((FramePool*)arg)->Trim();
+	}
+
+private:
+	std::vector<AVFrame*>	frames;
+	SDL_mutex				*mutex;
+	LockProfile				lockProfile;
+	int						memoryId;
+};
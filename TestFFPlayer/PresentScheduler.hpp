@@ -0,0 +1,154 @@
+#pragma once
+
+#include "stdafx.h"
+#include <SDL.h>
+#include <cmath>
+
+#define DEFAULT_REFRESH_RATE 60
+#define VBLANK_PHASE_GAIN 0.05		// how fast the vblank phase estimate follows measured presents
+
+// Maps frame due times onto display vblanks. The renderer presents with vsync,
+// so SDL_RenderPresent returns just after the vblank the frame went out on;
+// those timestamps anchor the vblank grid. Frames are submitted half a
+// refresh interval before their vblank, and any frame held on screen for
+// more or fewer vblanks than its timing asked for is counted.
+class PresentScheduler
+{
+public:
+	PresentScheduler()
+	{
+		interval = 1.0 / DEFAULT_REFRESH_RATE;
+		phase = 0;
+		anchored = false;
+		nextDue = -1;
+		intended = 0;
+		lastIntended = 0;
+		lastActual = 0;
+		presented = 0;
+		repeated = 0;
+		skipped = 0;
+		hasIntended = false;
+		unpaced = false;
+	}
+
+	// NULL = headless sink; frames are then timed by their delay alone
+	void setDisplay(SDL_Window *window)
+	{
+		if (window == NULL)
+		{
+			unpaced = true;
+			return;
+		}
+
+		SDL_DisplayMode mode;
+		int rate = DEFAULT_REFRESH_RATE;
+
+		if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &mode) == 0 && mode.refresh_rate > 0)
+			rate = mode.refresh_rate;
+
+		interval = 1.0 / rate;
+		SDL_Log("Display refresh %d Hz, vblank interval %.3f ms", rate, interval * 1000);
+	}
+
+	// Call right after SDL_RenderPresent returned
+	void Presented()
+	{
+		double now = Now();
+
+		if (unpaced)
+		{
+			presented++;
+			return;
+		}
+
+		if (!anchored)
+		{
+			phase = now;
+			anchored = true;
+		}
+
+		int64_t actual = (int64_t)floor((now - phase) / interval + 0.5);
+
+		// Follow the real vblank grid; reported refresh rates are rounded
+		phase += (now - (phase + actual * interval)) * VBLANK_PHASE_GAIN;
+
+		if (hasIntended && presented > 0)
+		{
+			int64_t expectedHold = intended - lastIntended;
+			int64_t actualHold = actual - lastActual;
+
+			if (actualHold > expectedHold)
+				repeated += (int)(actualHold - expectedHold);
+			else if (actualHold < expectedHold)
+				skipped += (int)(expectedHold - actualHold);
+		}
+
+		if (!hasIntended)
+			intended = actual;
+
+		lastIntended = intended;
+		lastActual = actual;
+		presented++;
+	}
+
+	// Plans the next frame `delay` seconds after the current one and
+	// returns how many ms to wait before rendering it.
+	Uint32 ScheduleNext(double delay)
+	{
+		double now = Now();
+
+		if (unpaced)
+			return delay > 0.001 ? (Uint32)(delay * 1000) : 1;
+
+		if (nextDue < 0 || nextDue + delay < now - interval)
+			nextDue = now;					// first frame, or too far behind - resync
+		else
+			nextDue += delay;
+
+		if (!anchored)
+		{
+			phase = now;
+			anchored = true;
+		}
+
+		intended = (int64_t)floor((nextDue - phase) / interval + 0.5);
+		if (intended <= lastActual)
+			intended = lastActual + 1;		// never the vblank already used
+		hasIntended = true;
+
+		double submit = phase + intended * interval - interval * 0.5 - now;
+		return submit > 0.001 ? (Uint32)(submit * 1000) : 1;
+	}
+
+	// Forget timing history, e.g. after a seek or resume
+	void Reset()
+	{
+		nextDue = -1;
+		hasIntended = false;
+	}
+
+	double refreshInterval() { return interval; }
+	int presentedCount() { return presented; }
+	int repeatedVblanks() { return repeated; }
+	int skippedVblanks() { return skipped; }
+
+	static double Now()
+	{
+		return (double)SDL_GetPerformanceCounter() / SDL_GetPerformanceFrequency();
+	}
+
+private:
+	double		interval;
+	double		phase;				// time of vblank 0
+	bool		anchored;
+	double		nextDue;			// ideal display time of the next frame
+	int64_t		intended;			// vblank the pending frame is meant for
+	int64_t		lastIntended;
+	int64_t		lastActual;
+	bool		hasIntended;
+	bool		unpaced;			// no display to snap to
+
+	int			presented;
+	int			repeated;			// extra vblanks a frame stayed on screen
+	int			skipped;			// vblanks a frame was cut short by
+};
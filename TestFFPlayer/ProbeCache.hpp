@@ -0,0 +1,326 @@
+#pragma once
+
+#include "stdafx.h"
+#include <SDL.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+extern "C"
+{
+	#include <libavcodec/avcodec.h>
+	#include <libavformat/avformat.h>
+	#include <libavutil/mem.h>
+}
+
+#define PROBE_CACHE_SUFFIX ".ffprobe"
+#define PROBE_CACHE_VERSION 1
+#define PROBE_CACHE_MAX_EXTRADATA (1 << 20)
+
+// Sidecar "<media>.ffprobe" holding what avformat_find_stream_info worked out
+// plus the seek index, so reopening a file skips probing and can seek at once.
+// Host byte order - the file is only ever read back on the machine that wrote it.
+// Keyed by path, size and modification time; anything that does not match
+// exactly, or a local file that cannot be stat'ed, means a normal probe.
+class ProbeCache
+{
+public:
+	// Fills the streams of a freshly opened context from the sidecar.
+	// Returns false, leaving the context untouched, when there is no valid entry.
+	static bool Load(AVFormatContext *context, const char *path)
+	{
+		FileIdentity id;
+		if (!Identify(path, &id))
+			return false;
+
+		FILE *f = fopen(SidecarPath(path).c_str(), "rb");
+		if (f == NULL)
+			return false;
+
+		bool ok = Read(f, context, path, id);
+		fclose(f);
+
+		if (ok)
+			SDL_Log("[probe cache] %s: %u streams from %s", path, context->nb_streams, PROBE_CACHE_SUFFIX);
+		return ok;
+	}
+
+	// Writes or refreshes the sidecar; failures (read-only media) are not errors
+	static void Save(AVFormatContext *context, const char *path)
+	{
+		FileIdentity id;
+		if (context == NULL || !Identify(path, &id))
+			return;
+
+		std::string sidecar = SidecarPath(path);
+		std::string temp = sidecar + ".tmp";
+
+		FILE *f = fopen(temp.c_str(), "wb");
+		if (f == NULL)
+			return;
+
+		bool ok = Write(f, context, path, id);
+		ok = fclose(f) == 0 && ok;
+
+		// Replace in one step, so a reader never sees half a file
+		remove(sidecar.c_str());
+		if (!ok || rename(temp.c_str(), sidecar.c_str()) != 0)
+			remove(temp.c_str());
+	}
+
+private:
+	struct FileIdentity
+	{
+		int64_t		size;
+		int64_t		mtime;
+	};
+
+	struct Header
+	{
+		char		magic[4];			// "FFPC"
+		int32_t		version;
+		int64_t		fileSize;
+		int64_t		fileTime;
+		int64_t		startTime;
+		int64_t		duration;
+		int64_t		bitRate;
+		int32_t		pathLength;			// path bytes follow the header
+		int32_t		streams;
+	};
+
+	struct StreamRecord
+	{
+		int32_t		codecType;
+		int32_t		codecId;
+		uint32_t	codecTag;
+		int32_t		format;				// pixel or sample format
+		int32_t		width;
+		int32_t		height;
+		int32_t		sampleRate;
+		int32_t		channels;
+		uint64_t	channelLayout;
+		int64_t		bitRate;
+		int32_t		frameSize;
+		int32_t		ticksPerFrame;
+		int32_t		profile;
+		int32_t		level;
+		AVRational	timeBase;
+		AVRational	codecTimeBase;
+		AVRational	avgFrameRate;
+		AVRational	realFrameRate;
+		AVRational	sampleAspect;
+		int64_t		startTime;
+		int64_t		duration;
+		int32_t		extradataSize;		// extradata bytes follow the record
+		int32_t		indexEntries;		// then this many IndexRecords
+	};
+
+	struct IndexRecord
+	{
+		int64_t		pos;
+		int64_t		timestamp;
+		int32_t		size;
+		int32_t		distance;
+		int32_t		flags;
+	};
+
+	// Only local files have an identity we can check
+	static bool Identify(const char *path, FileIdentity *id)
+	{
+		if (strstr(path, "://") != NULL)
+			return false;
+
+#ifdef _WIN32
+		struct _stat64 st;
+		if (_stat64(path, &st) != 0)
+			return false;
+#else
+		struct stat st;
+		if (stat(path, &st) != 0)
+			return false;
+#endif
+
+		id->size = st.st_size;
+		id->mtime = st.st_mtime;
+		return true;
+	}
+
+	static std::string SidecarPath(const char *path)
+	{
+		return std::string(path) + PROBE_CACHE_SUFFIX;
+	}
+
+	static bool Write(FILE *f, AVFormatContext *context, const char *path, FileIdentity id)
+	{
+		Header header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, "FFPC", 4);
+		header.version = PROBE_CACHE_VERSION;
+		header.fileSize = id.size;
+		header.fileTime = id.mtime;
+		header.startTime = context->start_time;
+		header.duration = context->duration;
+		header.bitRate = context->bit_rate;
+		header.pathLength = (int32_t)strlen(path);
+		header.streams = context->nb_streams;
+
+		if (fwrite(&header, sizeof(header), 1, f) != 1 || fwrite(path, 1, header.pathLength, f) != (size_t)header.pathLength)
+			return false;
+
+		for (unsigned int i = 0; i < context->nb_streams; i++)
+		{
+			AVStream *st = context->streams[i];
+			AVCodecContext *c = st->codec;
+
+			StreamRecord r;
+			memset(&r, 0, sizeof(r));
+			r.codecType = c->codec_type;
+			r.codecId = c->codec_id;
+			r.codecTag = c->codec_tag;
+			r.format = c->codec_type == AVMEDIA_TYPE_AUDIO ? (int)c->sample_fmt : (int)c->pix_fmt;
+			r.width = c->width;
+			r.height = c->height;
+			r.sampleRate = c->sample_rate;
+			r.channels = c->channels;
+			r.channelLayout = c->channel_layout;
+			r.bitRate = c->bit_rate;
+			r.frameSize = c->frame_size;
+			r.ticksPerFrame = c->ticks_per_frame;
+			r.profile = c->profile;
+			r.level = c->level;
+			r.timeBase = st->time_base;
+			r.codecTimeBase = c->time_base;
+			r.avgFrameRate = st->avg_frame_rate;
+			r.realFrameRate = st->r_frame_rate;
+			r.sampleAspect = st->sample_aspect_ratio;
+			r.startTime = st->start_time;
+			r.duration = st->duration;
+			r.extradataSize = c->extradata ? c->extradata_size : 0;
+			r.indexEntries = st->nb_index_entries;
+
+			if (fwrite(&r, sizeof(r), 1, f) != 1)
+				return false;
+			if (r.extradataSize > 0 && fwrite(c->extradata, 1, r.extradataSize, f) != (size_t)r.extradataSize)
+				return false;
+
+			for (int n = 0; n < st->nb_index_entries; n++)
+			{
+				AVIndexEntry *e = &st->index_entries[n];
+				IndexRecord ir = { e->pos, e->timestamp, e->size, e->min_distance, e->flags };
+				if (fwrite(&ir, sizeof(ir), 1, f) != 1)
+					return false;
+			}
+		}
+
+		return true;
+	}
+
+	// Everything is read and checked before the context is touched
+	static bool Read(FILE *f, AVFormatContext *context, const char *path, FileIdentity id)
+	{
+		Header header;
+		if (fread(&header, sizeof(header), 1, f) != 1)
+			return false;
+
+		if (memcmp(header.magic, "FFPC", 4) != 0 || header.version != PROBE_CACHE_VERSION ||
+			header.fileSize != id.size || header.fileTime != id.mtime ||
+			header.pathLength != (int32_t)strlen(path) || header.streams != (int32_t)context->nb_streams)
+			return false;
+
+		std::vector<char> storedPath(header.pathLength);
+		if (header.pathLength > 0 && fread(&storedPath[0], 1, header.pathLength, f) != (size_t)header.pathLength)
+			return false;
+		if (header.pathLength > 0 && memcmp(&storedPath[0], path, header.pathLength) != 0)
+			return false;
+
+		std::vector<StreamRecord> records(header.streams);
+		std::vector< std::vector<uint8_t> > extradata(header.streams);
+		std::vector< std::vector<IndexRecord> > index(header.streams);
+
+		for (int i = 0; i < header.streams; i++)
+		{
+			StreamRecord &r = records[i];
+			if (fread(&r, sizeof(r), 1, f) != 1)
+				return false;
+
+			// The container must still agree on what each stream is
+			if (r.codecType != context->streams[i]->codecpar->codec_type || r.codecId != context->streams[i]->codecpar->codec_id)
+				return false;
+
+			if (r.extradataSize < 0 || r.extradataSize > PROBE_CACHE_MAX_EXTRADATA || r.indexEntries < 0)
+				return false;
+
+			extradata[i].resize(r.extradataSize);
+			if (r.extradataSize > 0 && fread(&extradata[i][0], 1, r.extradataSize, f) != (size_t)r.extradataSize)
+				return false;
+
+			index[i].resize(r.indexEntries);
+			if (r.indexEntries > 0 && fread(&index[i][0], sizeof(IndexRecord), r.indexEntries, f) != (size_t)r.indexEntries)
+				return false;
+		}
+
+		context->start_time = header.startTime;
+		context->duration = header.duration;
+		context->bit_rate = header.bitRate;
+
+		for (int i = 0; i < header.streams; i++)
+		{
+			Apply(context->streams[i], records[i], extradata[i]);
+
+			for (size_t n = 0; n < index[i].size(); n++)
+			{
+				IndexRecord &ir = index[i][n];
+				av_add_index_entry(context->streams[i], ir.pos, ir.timestamp, ir.size, ir.distance, ir.flags);
+			}
+		}
+
+		return true;
+	}
+
+	// What avformat_find_stream_info would have left in the stream
+	static void Apply(AVStream *st, const StreamRecord &r, const std::vector<uint8_t> &extradata)
+	{
+		AVCodecContext *c = st->codec;
+
+		c->codec_type = (AVMediaType)r.codecType;
+		c->codec_id = (AVCodecID)r.codecId;
+		c->codec_tag = r.codecTag;
+		if (r.codecType == AVMEDIA_TYPE_AUDIO)
+			c->sample_fmt = (AVSampleFormat)r.format;
+		else
+			c->pix_fmt = (AVPixelFormat)r.format;
+		c->width = r.width;
+		c->height = r.height;
+		c->sample_rate = r.sampleRate;
+		c->channels = r.channels;
+		c->channel_layout = r.channelLayout;
+		c->bit_rate = r.bitRate;
+		c->frame_size = r.frameSize;
+		c->ticks_per_frame = r.ticksPerFrame;
+		c->profile = r.profile;
+		c->level = r.level;
+		c->time_base = r.codecTimeBase;
+		c->sample_aspect_ratio = r.sampleAspect;
+
+		if (!extradata.empty())
+		{
+			av_freep(&c->extradata);
+			c->extradata = (uint8_t *)av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+			memcpy(c->extradata, &extradata[0], extradata.size());
+			c->extradata_size = (int)extradata.size();
+		}
+
+		st->time_base = r.timeBase;
+		st->avg_frame_rate = r.avgFrameRate;
+		st->r_frame_rate = r.realFrameRate;
+		st->sample_aspect_ratio = r.sampleAspect;
+		st->start_time = r.startTime;
+		st->duration = r.duration;
+
+		// Keep the demuxer's view in step with the decoder's
+		avcodec_parameters_from_context(st->codecpar, c);
+	}
+};
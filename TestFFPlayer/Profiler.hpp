@@ -0,0 +1,359 @@
+#pragma once
+
+#include "stdafx.h"
+#include <SDL.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <algorithm>
+#include "Telemetry.hpp"
+
+#define PROFILE_MAX_STAGES 32
+#define PROFILE_MAX_LOCKS 64
+#define PROFILE_NAME_SIZE 32
+#define PROFILE_TOP 8					// rows per table in the report
+
+// Opt-in profiling build. With FF_PROFILE defined, heap allocations are
+// counted against the stage the calling thread is in (see ProfileScope) and
+// every named mutex records how long it was waited for and held. Without it
+// the hooks are empty inlines around the plain SDL calls.
+
+#ifdef FF_PROFILE
+
+struct StageStats
+{
+	char			name[PROFILE_NAME_SIZE];
+	SDL_SpinLock	spin;
+	Uint64			allocs;
+	Uint64			bytes;
+};
+
+struct LockStats
+{
+	char			name[PROFILE_NAME_SIZE];
+	SDL_SpinLock	spin;
+	Uint64			acquired;
+	Uint64			contended;			// acquisitions that found the mutex taken
+	Uint64			waitTicks;
+	Uint64			maxWait;
+	Uint64			holdTicks;
+	Uint64			maxHold;
+	Uint64			condWaits;
+	Uint64			condTicks;			// parked in SDL_CondWait with the mutex released
+};
+
+// One per mutex. Mutexes with the same name add up in the same LockStats.
+// Only touched by the thread holding the mutex.
+struct LockProfile
+{
+	LockStats		*stats;
+	Uint64			since;				// outermost acquisition - SDL mutexes are recursive
+	int				depth;
+};
+
+class Profiler
+{
+public:
+	static void NameLock(LockProfile &p, const char *name)
+	{
+		p.stats = Find(locks(), lockCount(), PROFILE_MAX_LOCKS, name);
+		p.since = 0;
+		p.depth = 0;
+	}
+
+	static int Lock(SDL_mutex *mutex, LockProfile &p)
+	{
+		Uint64 wait = 0;
+		bool contended = false;
+		int ret = 0;
+
+		if (SDL_TryLockMutex(mutex) != 0)
+		{
+			Uint64 t0 = SDL_GetPerformanceCounter();
+			ret = SDL_LockMutex(mutex);
+			wait = SDL_GetPerformanceCounter() - t0;
+			contended = true;
+		}
+
+		if (p.depth++ == 0)
+			p.since = SDL_GetPerformanceCounter();
+
+		if (p.stats)
+		{
+			SDL_AtomicLock(&p.stats->spin);
+			p.stats->acquired++;
+			if (contended)
+			{
+				p.stats->contended++;
+				p.stats->waitTicks += wait;
+				p.stats->maxWait = std::max(p.stats->maxWait, wait);
+			}
+			SDL_AtomicUnlock(&p.stats->spin);
+		}
+
+		return ret;
+	}
+
+	static int Unlock(SDL_mutex *mutex, LockProfile &p)
+	{
+		if (--p.depth == 0)
+			Held(p);
+
+		return SDL_UnlockMutex(mutex);
+	}
+
+	// The wait releases the mutex, so the hold ends here and restarts on wakeup
+	static int CondWait(SDL_cond *cond, SDL_mutex *mutex, LockProfile &p)
+	{
+		int depth = p.depth;
+		Held(p);
+		p.depth = 0;
+
+		Uint64 t0 = SDL_GetPerformanceCounter();
+		int ret = SDL_CondWait(cond, mutex);
+		Uint64 now = SDL_GetPerformanceCounter();
+		Telemetry::Instance().OnWakeup();
+
+		p.depth = depth;
+		p.since = now;
+
+		if (p.stats)
+		{
+			SDL_AtomicLock(&p.stats->spin);
+			p.stats->condWaits++;
+			p.stats->condTicks += now - t0;
+			SDL_AtomicUnlock(&p.stats->spin);
+		}
+
+		return ret;
+	}
+
+	// Charged to the calling thread's current stage
+	static void Alloc(int bytes)
+	{
+		StageStats &s = stages()[currentStage()];
+		SDL_AtomicLock(&s.spin);
+		s.allocs++;
+		s.bytes += bytes;
+		SDL_AtomicUnlock(&s.spin);
+	}
+
+	// Makes `name` the calling thread's stage; returns the previous one
+	static int EnterStage(const char *name)
+	{
+		StageStats *s = Find(stages(), stageCount(), PROFILE_MAX_STAGES, name);
+		int previous = currentStage();
+		currentStage() = s ? (int)(s - stages()) : 0;
+		return previous;
+	}
+
+	static void LeaveStage(int previous)
+	{
+		currentStage() = previous;
+	}
+
+	static Uint64 TotalAllocs()
+	{
+		Uint64 n = 0;
+		int count = SDL_AtomicGet(&stageCount());
+		for (int i = 0; i < count; i++)
+			n += stages()[i].allocs;
+		return n;
+	}
+
+	static double TotalWaitMs()
+	{
+		Uint64 ticks = 0;
+		int count = SDL_AtomicGet(&lockCount());
+		for (int i = 0; i < count; i++)
+			ticks += locks()[i].waitTicks;
+		return ToMs(ticks);
+	}
+
+	// Top allocating stages and most contended mutexes
+	static void Report()
+	{
+		StageStats *s[PROFILE_MAX_STAGES];
+		int stageN = Snapshot(stages(), stageCount(), s);
+		std::sort(s, s + stageN, MoreAllocs);
+
+		SDL_Log("[profile] %-20s %12s %14s", "stage", "allocs", "bytes");
+		for (int i = 0; i < stageN && i < PROFILE_TOP && s[i]->allocs > 0; i++)
+			SDL_Log("[profile] %-20s %12llu %14llu", s[i]->name, (unsigned long long)s[i]->allocs, (unsigned long long)s[i]->bytes);
+
+		LockStats *l[PROFILE_MAX_LOCKS];
+		int lockN = Snapshot(locks(), lockCount(), l);
+		std::sort(l, l + lockN, MoreWait);
+
+		SDL_Log("[profile] %-20s %10s %10s %10s %9s %10s %9s %10s", "mutex", "locks", "contended", "wait ms", "max ms", "hold ms", "max ms", "cond ms");
+		for (int i = 0; i < lockN && i < PROFILE_TOP && l[i]->acquired > 0; i++)
+			SDL_Log("[profile] %-20s %10llu %10llu %10.1f %9.2f %10.1f %9.2f %10.1f", l[i]->name,
+				(unsigned long long)l[i]->acquired, (unsigned long long)l[i]->contended,
+				ToMs(l[i]->waitTicks), ToMs(l[i]->maxWait), ToMs(l[i]->holdTicks), ToMs(l[i]->maxHold), ToMs(l[i]->condTicks));
+	}
+
+	// {"stages": {"name": [allocs, bytes], ..}, "locks": {"name": {..}, ..}}
+	static std::string FormatJson()
+	{
+		char buf[256];
+		std::string json = "{\"stages\": {";
+
+		int count = SDL_AtomicGet(&stageCount());
+		for (int i = 0; i < count; i++)
+		{
+			StageStats &s = stages()[i];
+			snprintf(buf, sizeof(buf), "%s\"%s\": [%llu, %llu]", i ? ", " : "", s.name, (unsigned long long)s.allocs, (unsigned long long)s.bytes);
+			json += buf;
+		}
+
+		json += "}, \"locks\": {";
+
+		count = SDL_AtomicGet(&lockCount());
+		for (int i = 0; i < count; i++)
+		{
+			LockStats &l = locks()[i];
+			snprintf(buf, sizeof(buf), "%s\"%s\": {\"acquired\": %llu, \"contended\": %llu, \"wait_ms\": %.3f, \"max_wait_ms\": %.3f, \"hold_ms\": %.3f, \"max_hold_ms\": %.3f, \"cond_ms\": %.3f}",
+				i ? ", " : "", l.name, (unsigned long long)l.acquired, (unsigned long long)l.contended,
+				ToMs(l.waitTicks), ToMs(l.maxWait), ToMs(l.holdTicks), ToMs(l.maxHold), ToMs(l.condTicks));
+			json += buf;
+		}
+
+		return json + "}}";
+	}
+
+private:
+	static void Held(LockProfile &p)
+	{
+		if (p.stats == NULL)
+			return;
+
+		Uint64 hold = SDL_GetPerformanceCounter() - p.since;
+		SDL_AtomicLock(&p.stats->spin);
+		p.stats->holdTicks += hold;
+		p.stats->maxHold = std::max(p.stats->maxHold, hold);
+		SDL_AtomicUnlock(&p.stats->spin);
+	}
+
+	// Append-only table; lookups do not lock, adding an entry does
+	template <typename T> static T* Find(T *table, SDL_atomic_t &count, int capacity, const char *name)
+	{
+		int n = SDL_AtomicGet(&count);
+		for (int i = 0; i < n; i++)
+			if (strcmp(table[i].name, name) == 0)
+				return &table[i];
+
+		static SDL_SpinLock registry = 0;
+		SDL_AtomicLock(&registry);
+
+		T *found = NULL;
+		n = SDL_AtomicGet(&count);
+		for (int i = 0; i < n && found == NULL; i++)
+			if (strcmp(table[i].name, name) == 0)
+				found = &table[i];
+
+		if (found == NULL && n < capacity)
+		{
+			found = &table[n];
+			strncpy(found->name, name, PROFILE_NAME_SIZE - 1);
+			SDL_AtomicSet(&count, n + 1);
+		}
+
+		SDL_AtomicUnlock(&registry);
+		return found;
+	}
+
+	template <typename T> static int Snapshot(T *table, SDL_atomic_t &count, T **out)
+	{
+		int n = SDL_AtomicGet(&count);
+		for (int i = 0; i < n; i++)
+			out[i] = &table[i];
+		return n;
+	}
+
+	static bool MoreAllocs(const StageStats *a, const StageStats *b) { return a->allocs > b->allocs; }
+	static bool MoreWait(const LockStats *a, const LockStats *b) { return a->waitTicks > b->waitTicks; }
+
+	static double ToMs(Uint64 ticks)
+	{
+		return (double)ticks * 1000 / SDL_GetPerformanceFrequency();
+	}
+
+	// Zero-initialized statics, usable from operator new before main
+	static StageStats* stages()
+	{
+		static StageStats table[PROFILE_MAX_STAGES] = { { "other" } };
+		return table;
+	}
+
+	static SDL_atomic_t& stageCount()
+	{
+		static SDL_atomic_t value = { 1 };
+		return value;
+	}
+
+	static LockStats* locks()
+	{
+		static LockStats table[PROFILE_MAX_LOCKS];
+		return table;
+	}
+
+	static SDL_atomic_t& lockCount()
+	{
+		static SDL_atomic_t value = { 0 };
+		return value;
+	}
+
+	static int& currentStage()
+	{
+		static thread_local int stage = 0;
+		return stage;
+	}
+};
+
+#else
+
+struct LockProfile
+{
+};
+
+class Profiler
+{
+public:
+	static void NameLock(LockProfile &, const char *) {}
+	static int Lock(SDL_mutex *mutex, LockProfile &) { return SDL_LockMutex(mutex); }
+	static int Unlock(SDL_mutex *mutex, LockProfile &) { return SDL_UnlockMutex(mutex); }
+	// Wakeups are counted in every build; paused players are measured by them
+	static int CondWait(SDL_cond *cond, SDL_mutex *mutex, LockProfile &)
+	{
+		int ret = SDL_CondWait(cond, mutex);
+		Telemetry::Instance().OnWakeup();
+		return ret;
+	}
+	static void Alloc(int) {}
+	static int EnterStage(const char *) { return 0; }
+	static void LeaveStage(int) {}
+	static Uint64 TotalAllocs() { return 0; }
+	static double TotalWaitMs() { return 0; }
+	static void Report() {}
+	static std::string FormatJson() { return "{\"enabled\": false}"; }
+};
+
+#endif
+
+// Attributes allocations on this thread to `stage` until the end of the scope
+class ProfileScope
+{
+public:
+	ProfileScope(const char *stage)
+	{
+		previous = Profiler::EnterStage(stage);
+	}
+
+	~ProfileScope()
+	{
+		Profiler::LeaveStage(previous);
+	}
+
+private:
+	int previous;
+};
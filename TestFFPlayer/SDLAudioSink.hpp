@@ -0,0 +1,57 @@
+#pragma once
+
+#include "stdafx.h"
+#include <SDL.h>
+#include "AudioSink.hpp"
+
+// The sound card through SDL's legacy single-device API
+class SDLAudioSink : public AudioSink
+{
+public:
+	SDLAudioSink() : bOpen(false)
+	{
+	}
+
+	~SDLAudioSink()
+	{
+		Close();
+	}
+
+	int Open(SDL_AudioSpec *desired, SDL_AudioSpec *obtained)
+	{
+		if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0)
+		{
+			SDL_Log("Failed to init audio: %s", SDL_GetError());
+			return -1;
+		}
+
+		// With an obtained spec SDL opens the device as-is and never converts;
+		// without one SDL converts to the desired spec
+		if (SDL_OpenAudio(desired, obtained) < 0)
+		{
+			SDL_Log("Failed to open audio: %s", SDL_GetError());
+			return -1;
+		}
+
+		bOpen = true;
+		return 0;
+	}
+
+	void Pause(bool bPause)
+	{
+		SDL_PauseAudio(bPause ? 1 : 0);
+	}
+
+	void Close()
+	{
+		if (bOpen)
+		{
+			SDL_PauseAudio(1);
+			SDL_CloseAudio();
+			bOpen = false;
+		}
+	}
+
+private:
+	bool	bOpen;
+};
@@ -0,0 +1,360 @@
+#pragma once
+
+#include "stdafx.h"
+#include <SDL.h>
+#include <SDL_ttf.h>
+#include "VideoSink.hpp"
+#include "Telemetry.hpp"
+#include "Pool.hpp"
+#include "Util.hpp"
+
+#define STATS_REFRESH_MS 500			// overlay text is re-rasterized at most this often
+#define GLYPH_CACHE_SIZE 128			// ASCII glyphs of the time line
+
+// Window output: IYUV streaming texture, vsynced presents, time/subtitle/stats text
+class SDLVideoSink : public VideoSink
+{
+public:
+	SDLVideoSink() : renderer(0), texture(0), screen(0), font(0), texSubtitle(0), bShowStats(false), statsLines(0), statsUpdated(0)
+	{
+		bFullScreen = false;
+		scanSpeed = 0;
+		screenRatio = 1;
+		memset(texGlyph, 0, sizeof(texGlyph));
+		memset(glyphWidth, 0, sizeof(glyphWidth));
+		glyphHeight = 0;
+	}
+
+	~SDLVideoSink()
+	{
+		resetSubtitleInfo();
+		clearStats();
+		for (int i = 0; i < GLYPH_CACHE_SIZE; i++)
+		{
+			if (texGlyph[i])
+				SDL_DestroyTexture(texGlyph[i]);
+		}
+
+		if (font)
+			TTF_CloseFont(font);
+
+		SDL_DestroyTexture(texture);
+		SDL_DestroyRenderer(renderer);
+		SDL_DestroyWindow(screen);
+	}
+
+	int Open(int width, int height)
+	{
+		if (SDL_InitSubSystem(SDL_INIT_VIDEO) < 0)
+		{
+			SDL_Log("Failed to init video: %s", SDL_GetError());
+			return -1;
+		}
+
+		TTF_Init();
+		font = TTF_OpenFont("NanumGothicBold.ttf", 24);
+		font_color = { 255, 255, 255 };
+
+		screen = SDL_CreateWindow("Test Player",
+							  SDL_WINDOWPOS_CENTERED_DISPLAY(0),
+							  SDL_WINDOWPOS_CENTERED_DISPLAY(0),
+							  width, height,
+							  SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN);
+
+		renderer = SDL_CreateRenderer(screen, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+		if (renderer == NULL)
+			renderer = SDL_CreateRenderer(screen, -1, SDL_RENDERER_ACCELERATED);
+
+		texture = SDL_CreateTexture(renderer,
+						SDL_PIXELFORMAT_IYUV,							// YUV420P
+						SDL_TEXTUREACCESS_STREAMING,
+						width, height);
+
+		screenRatio = float(height) / width;
+		return 0;
+	}
+
+	// Renderer calls stay on the event loop thread
+	void Resize(int width, int height)
+	{
+		SDL_DestroyTexture(texture);
+		texture = SDL_CreateTexture(renderer,
+						SDL_PIXELFORMAT_IYUV,
+						SDL_TEXTUREACCESS_STREAMING,
+						width, height);
+
+		screenRatio = float(height) / width;
+	}
+
+	void Upload(const uint8_t *picture, int pitch)
+	{
+		SDL_UpdateTexture(texture, NULL, picture, pitch);
+	}
+
+	void Present(double clock)
+	{
+		drawPicture();
+		drawTime(clock);
+		drawSubtitles(clock);
+		drawStats();
+
+		SDL_RenderPresent(renderer);
+	}
+
+	SDL_Window* window()
+	{
+		return screen;
+	}
+
+	void fullScreen(bool bFull)
+	{
+		bFullScreen = bFull;
+
+		if (bFullScreen)
+		{
+			SDL_SetWindowFullscreen(screen, SDL_WINDOW_FULLSCREEN_DESKTOP);	
+		}
+		else
+		{		
+			SDL_SetWindowFullscreen(screen,0);
+		}
+	}
+
+	bool isFullScreen()
+	{
+		return bFullScreen;
+	}
+
+	void toggleStats()
+	{
+		bShowStats = !bShowStats;
+		if (!bShowStats)
+			clearStats();
+	}
+
+	void setScanSpeed(int speed)
+	{
+		scanSpeed = speed;
+	}
+
+	void resetSubtitleInfo()
+	{
+		if (texSubtitle)
+		{
+			SDL_DestroyTexture(texSubtitle);
+			texSubtitle = 0;
+		}
+
+		VideoSink::resetSubtitleInfo();
+	}
+
+private:
+	void drawPicture()
+	{
+		if (bFullScreen)
+		{
+			int x = 0;
+			int y = 0;
+			SDL_GL_GetDrawableSize(screen, &x, &y);
+
+			SDL_Rect src;
+			src.x = 0;
+			src.y = 0;
+			src.w = x;
+			src.h = x*screenRatio;
+
+			SDL_Rect desc;
+			desc.x = 0;
+			desc.y = (y - x*screenRatio) / 2;
+			desc.w = x;
+			desc.h = x*screenRatio;
+
+			SDL_RenderCopy(renderer, texture, &src, &desc);
+
+		}
+		else
+		{
+			SDL_RenderCopy(renderer, texture, NULL, NULL);
+		}
+	}
+
+	// Rasterizes an ASCII character once; the time line is drawn from these
+	SDL_Texture* glyph(char c)
+	{
+		int i = (unsigned char)c;
+		if (i >= GLYPH_CACHE_SIZE)
+			return 0;
+
+		if (glyphWidth[i] == 0)
+		{
+			char text[2] = { c, 0 };
+			TTF_SizeUTF8(font, text, &glyphWidth[i], &glyphHeight);
+
+			SDL_Surface *sur = TTF_RenderUTF8_Blended(font, text, font_color);
+			if (sur)
+			{
+				texGlyph[i] = SDL_CreateTextureFromSurface(renderer, sur);
+				AllocStats::Count(sur->pitch * sur->h);
+				SDL_FreeSurface(sur);
+			}
+		}
+
+		return texGlyph[i];
+	}
+
+	void drawTime(double clock)
+	{
+		ProfileScope scope("overlay");
+
+		if (font == 0)
+			return;
+
+		char msg[100];
+		if (scanSpeed != 0)
+			sprintf(msg, "Time: %.2f s  %s x%d", clock, scanSpeed > 0 ? ">>" : "<<", scanSpeed > 0 ? scanSpeed : -scanSpeed);
+		else
+			sprintf(msg, "Time: %.2f s", clock);
+
+		SDL_Rect Message_rect;
+		Message_rect.x = 10;
+
+		if (bFullScreen)
+		{
+			int x = 0;
+			int y = 0;
+			SDL_GL_GetDrawableSize(screen, &x, &y);
+			Message_rect.y = (y - x*screenRatio) / 2;
+			Message_rect.y += 10;
+		}	
+		else
+		{
+			Message_rect.y = 10;			
+		}
+					
+		// Glyph by glyph, so the changing digits cost no rasterization
+		for (const char *p = msg; *p; p++)
+		{
+			SDL_Texture *tex = glyph(*p);
+			int i = (unsigned char)*p;
+			if (i >= GLYPH_CACHE_SIZE)
+				continue;
+
+			Message_rect.w = glyphWidth[i];
+			Message_rect.h = glyphHeight;
+			if (tex)
+				SDL_RenderCopy(renderer, tex, NULL, &Message_rect);
+			Message_rect.x += glyphWidth[i];
+		}
+	}
+
+	// Telemetry overlay under the time line
+	void drawStats()
+	{
+		if (!bShowStats)
+			return;
+
+		Uint32 now = SDL_GetTicks();
+		if (statsLines == 0 || now - statsUpdated >= STATS_REFRESH_MS)
+		{
+			clearStats();
+
+			char lines[TELEMETRY_MAX_LINES][128];
+			int count = Telemetry::Instance().FormatOverlay(lines, TELEMETRY_MAX_LINES);
+
+			for (int i = 0; i < count; i++)
+			{
+				SDL_Surface *sur = TTF_RenderUTF8_Blended(font, lines[i], font_color);
+				if (sur == 0)
+					break;
+
+				texStats[i] = SDL_CreateTextureFromSurface(renderer, sur);
+				SDL_FreeSurface(sur);
+				statsLines++;
+			}
+
+			statsUpdated = now;
+		}
+
+		SDL_Rect rect;
+		rect.x = 10;
+		rect.y = 40;
+
+		if (bFullScreen)
+		{
+			int x = 0;
+			int y = 0;
+			SDL_GL_GetDrawableSize(screen, &x, &y);
+			rect.y += (y - x*screenRatio) / 2;
+		}
+
+		for (int i = 0; i < statsLines; i++)
+		{
+			SDL_QueryTexture(texStats[i], NULL, NULL, &rect.w, &rect.h);
+			SDL_RenderCopy(renderer, texStats[i], NULL, &rect);
+			rect.y += rect.h;
+		}
+	}
+
+	void drawSubtitles(double clock)
+	{
+		ProfileScope scope("subtitles");
+
+		SubTitleInfo *cue = currentSubtitle(clock);		// ̱, ߱
+		if (cue == 0)
+			return;
+
+		// Upload the pre-rasterized cue once, then only blit the cached texture
+		if (texSubtitle == 0 && cue->surface)
+		{
+			texSubtitle = SDL_CreateTextureFromSurface(renderer, cue->surface);
+			AllocStats::Count(cue->surface->pitch * cue->surface->h);
+			SubTitle::ReleaseSurface(cue);
+		}
+
+		if (texSubtitle)
+		{
+			SDL_Rect Message_rect;
+			SDL_QueryTexture(texSubtitle, NULL, NULL, &Message_rect.w, &Message_rect.h);
+
+			int x = 0;
+			int y = 0;
+			SDL_GL_GetDrawableSize(screen, &x, &y);
+
+			Message_rect.x = (x - Message_rect.w)/2;
+			Message_rect.y = y - Message_rect.h * 2;
+
+			if (bFullScreen)
+				Message_rect.y -= (y - x*screenRatio) / 2;
+
+			SDL_RenderCopy(renderer, texSubtitle, NULL, &Message_rect);
+		}
+	}
+
+	void clearStats()
+	{
+		for (int i = 0; i < statsLines; i++)
+			SDL_DestroyTexture(texStats[i]);
+		statsLines = 0;
+	}
+
+private:
+	SDL_Renderer	*renderer;
+	SDL_Texture		*texture;
+	SDL_Window		*screen;
+	TTF_Font*		font;
+	SDL_Color		font_color;
+	float			screenRatio;
+	bool			bFullScreen;
+	int				scanSpeed;
+
+	SDL_Texture*	texSubtitle;
+
+	SDL_Texture*	texGlyph[GLYPH_CACHE_SIZE];
+	int				glyphWidth[GLYPH_CACHE_SIZE];
+	int				glyphHeight;
+
+	bool			bShowStats;
+	SDL_Texture*	texStats[TELEMETRY_MAX_LINES];
+	int				statsLines;
+	Uint32			statsUpdated;
+};
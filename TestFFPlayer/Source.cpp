@@ -12,41 +12,112 @@ extern "C"
 
 #include <SDL.h>
 #include <string>
-#include <mmdeviceapi.h>
-#include <endpointvolume.h>
+#include <vector>
 
 
 #undef main
 
 #define FF_REFRESH_EVENT (SDL_USEREVENT)
 #define FF_RESTART_EVENT (SDL_USEREVENT+1)
+#define FF_CONTROL_EVENT (SDL_USEREVENT+2)	// code = CONTROL_*, data1 = argument, data2 = milliseconds
+
+enum ControlCommand { CONTROL_PLAY, CONTROL_PAUSE, CONTROL_SEEK, CONTROL_SEEK_TO, CONTROL_STEP, CONTROL_OPEN };
+
+#define MAX_SCAN_SPEED 32
+#define SCAN_INTERVAL 0.1		// rewind steps back speed * SCAN_INTERVAL seconds per keyframe
+#define SCAN_QUEUE_DEPTH 2		// keep few keyframes queued so speed changes apply at once
+#define AUDIO_STANDBY_MARGIN 0.5	// seconds of unselected audio kept behind the clock
+#define TELEMETRY_DEFAULT_FILE "telemetry.json"
 
 #include "Video.hpp"
 #include "Audio.hpp"
 #include "Syncer.hpp"
 #include "SubTitle.hpp"
-
+#include "Thumbnailer.hpp"
+#include "DecodeHost.hpp"
+#include "Benchmark.hpp"
+#include "SDLVideoSink.hpp"
+#include "SDLAudioSink.hpp"
+#include "ControlSocket.hpp"
+#include "ProbeCache.hpp"
+#include "Profiler.hpp"
+#include "Tracer.hpp"
+
+#ifdef _MSC_VER
 #define INT64_MIN        (-9223372036854775807i64 - 1)
 #define INT64_MAX        9223372036854775807i64
+#endif
+
+#ifdef FF_PROFILE
+// Every C++ heap allocation is charged to the calling thread's stage
+void* operator new(size_t size)
+{
+	Profiler::Alloc((int)size);
+	void *p = malloc(size ? size : 1);
+	if (p == NULL)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+#endif
+
+// --vo / --ao: "sdl" (default), "null", or "file:<path>" for raw yuv420p / pcm
+static VideoSink* CreateVideoSink(const char *spec)
+{
+	if (strcmp(spec, "null") == 0)
+		return new NullVideoSink();
+	if (strncmp(spec, "file:", 5) == 0)
+		return new FileVideoSink(spec + 5);
+	return new SDLVideoSink();
+}
+
+static AudioSink* CreateAudioSink(const char *spec)
+{
+	if (strcmp(spec, "null") == 0)
+		return new NullAudioSink();
+	if (strncmp(spec, "file:", 5) == 0)
+		return new NullAudioSink(spec + 5);
+	return new SDLAudioSink();
+}
 
 class Multimedia
 {	
 
 public:
 
-	Multimedia() : A(0), V(0), S(0)
+	Multimedia() : A(0), V(0), S(0), allocTimer(0), telemetryPath(0), videoOutput("sdl"), audioOutput("sdl"), exportName(0), control(0), openedFile(0)
 	{
 		quitEvent = false;
+		scanSpeed = 0;
+		scanPos = 0;
+		audioTrack = 0;
+		audioTrackRequest = -1;
+		exactSeek = false;
+		videoFilter = 0;
+		syncMaster = SYNC_AUDIO_MASTER;
+		Sync = 0;
+		StateMutex = SDL_CreateMutex();
+		Profiler::NameLock(StateLockProfile, "player state");
 		formatContext = NULL;
-		int ret = SDL_Init(SDL_INIT_VIDEO| SDL_INIT_AUDIO |SDL_INIT_TIMER);
+		// Video and audio subsystems are brought up by the SDL sinks only
+		int ret = SDL_Init(SDL_INIT_EVENTS | SDL_INIT_TIMER);
 		av_register_all();
 		avformat_network_init();
 		bStop = false;
 
-		volumn = 0.3;
-		ChangeVolume(volumn, true);
+		volumn = 1.0;
 
 		SeekMutex = SDL_CreateMutex();
+		SeekRequestMutex = SDL_CreateMutex();
+		Profiler::NameLock(SeekLockProfile, "seek");
+		Profiler::NameLock(SeekRequestLockProfile, "seek request");
+		seekRequested = false;
+		seekRequestPos = 0;
+		pipeline = new Pipeline();
 	}		
 
 	~Multimedia()
@@ -55,13 +126,20 @@ public:
 		avformat_close_input(&formatContext);
 		avformat_network_deinit();
 
+		delete control;
+		free(openedFile);
 		SDL_DestroyMutex(SeekMutex);
+		SDL_DestroyMutex(SeekRequestMutex);
+		SDL_DestroyMutex(StateMutex);
+		delete pipeline;
 
 		SDL_Quit();		
 	}
 
 	void Open(char * f, char* fSmi = 0)
 	{
+		Profiler::Lock(StateMutex, StateLockProfile);
+
 		quitEvent = false;
 		filename = f;
 
@@ -72,15 +150,42 @@ public:
 		}
 
 		int ret = avformat_open_input (&formatContext, filename, NULL, NULL);
-		ret = avformat_find_stream_info(formatContext, NULL);
-		av_dump_format(formatContext, 0, filename, 0);
+
+		// Probing decodes the start of every stream; a valid sidecar makes it unnecessary
+		if (!ProbeCache::Load(formatContext, filename))
+		{
+			ret = avformat_find_stream_info(formatContext, NULL);
+			av_dump_format(formatContext, 0, filename, 0);
+			ProbeCache::Save(formatContext, filename);
+		}
 
 		videoStream = getStreamID(AVMEDIA_TYPE_VIDEO);
-		audioStream = getStreamID(AVMEDIA_TYPE_AUDIO);
+		audioStream = getStreamID(AVMEDIA_TYPE_AUDIO, audioTrack);
+		if (audioStream < 0)
+			audioStream = getStreamID(AVMEDIA_TYPE_AUDIO);
 		subtitleStream = getStreamID(AVMEDIA_TYPE_SUBTITLE);
 		
-		V = new Video(formatContext->streams[videoStream]);
-		A = new Audio(formatContext->streams[audioStream]);
+		V = new Video(formatContext->streams[videoStream], CreateVideoSink(videoOutput));
+		A = new Audio(formatContext->streams[audioStream], CreateAudioSink(audioOutput));
+
+		// The other audio streams are kept buffered so a track switch needs no seek
+		for (unsigned int i = 0; i < formatContext->nb_streams; i++)
+		{
+			PacketQueue *standby = NULL;
+			if (formatContext->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO)
+			{
+				char name[32];
+				snprintf(name, sizeof(name), "audio standby #%u", i);
+				standby = new PacketQueue(name);
+			}
+			standbyAudio.push_back(standby);
+		}
+
+		if (exportName)
+			V->setExport(new FrameExport(exportName));
+
+		if (videoFilter)
+			V->setFilter(videoFilter);
 
 		if (subtitleStream > 0)
 			S = new SubTitle(formatContext->streams[subtitleStream]);
@@ -89,33 +194,93 @@ public:
 			S = new SubTitle(formatContext->streams[subtitleStream], true);
 
 		Sync = new Syncer(V, A);
+		Sync->setMaster(syncMaster);
+
+		// Consumers taking packets wake the demux stage when it waits for space
+		V->setSpaceSignal(&demuxSignal);
+		A->setSpaceSignal(&demuxSignal);
+		if (S)
+			S->setSpaceSignal(&demuxSignal);
+
+		A->setVolume(volumn);
+
+		Telemetry::Instance().Reset();
+
+		Profiler::Unlock(StateMutex, StateLockProfile);
+	}
+
+	// Serves --control <path> for the rest of the process
+	void setControlPath(const char *path)
+	{
+		control = new ControlSocket(path, ControlThunk, this);
+		control->Start();
+	}
+
+	void setOutputs(const char *vo, const char *ao)
+	{
+		videoOutput = vo;
+		audioOutput = ao;
+	}
+
+	// Shared-memory name decoded pictures are published under
+	void setExportName(const char *name)
+	{
+		exportName = name;
+	}
+
+	// Telemetry is written here on exit as well as on the D key
+	void setTelemetryPath(char *path)
+	{
+		telemetryPath = path;
+	}
+
+	void setSyncMaster(SyncMaster master)
+	{
+		syncMaster = master;
+		if (Sync)
+			Sync->setMaster(master);
+
+		SDL_Log("Sync master: %s", Syncer::masterName(master));
+	}
+
+	// libavfilter graph description applied to every decoded picture
+	void setVideoFilter(const char *desc)
+	{
+		videoFilter = desc;
+	}
+
+	// Seek to the exact position instead of the nearest keyframe
+	void setExactSeek(bool exact)
+	{
+		exactSeek = exact;
 	}
 
 	void Play()
 	{
 		bStop = false;
+		scanSpeed = 0;
+		refreshParked = false;
 
 		SDL_AddTimer(10, PushRefreshEvent, V);
+		allocTimer = SDL_AddTimer(1000, AllocStats::ReportTimer, NULL);
 
-		demux = SDL_CreateThread(DemuxThread, "demux", this);
-		video = V->Start();
+		pipeline->Run("demux", DemuxThread, this);
+		V->Start(pipeline);
 		A->Start();
 
 		if (S)
 		{
-			if (S->useSMI() == false)
-				subtitle = S->Start();
+			S->Start(pipeline);
 
-			V->setSubTitle(S);
+			V->sink()->setSubTitle(S);
 		}
 
 		StartEventLoop();
 		
-		SDL_WaitThread(demux, NULL);
-		SDL_WaitThread(video, NULL);		
-		SDL_WaitThread(subtitle, NULL);
+		pipeline->Join();
 	}			
 
+	// Every stage blocks on an event while paused and no timer is left armed
 	void Stop()
 	{
 		bStop = true;
@@ -124,16 +289,19 @@ public:
 
 		if (S)
 			S->Stop();
+
+		SDL_RemoveTimer(allocTimer);
+		allocTimer = 0;
+		Telemetry::Instance().OnPause();
 	}
 
 	void Resume()
 	{
 		bStop = false;
+		demuxSignal.Notify();
+		ResumeStages();
 
-		A->Resume();
-
-		if (S)
-			S->Resume();
+		LeavePause();
 	}
 
 	void ReStart()
@@ -145,22 +313,34 @@ public:
 
 	void Reset()
 	{
-		V->resetSubtitleInfo();
+		Profiler::Lock(StateMutex, StateLockProfile);
+		SDL_RemoveTimer(allocTimer);
 
+		V->sink()->resetSubtitleInfo();
+
+		// Wake every stage, then wait for all of them before tearing down
 		quitEvent = true;
-		SDL_WaitThread(demux, NULL);
+		demuxSignal.Notify();
 
 		A->Quit();
 		V->Quit();
 		if (S)
-		{
 			S->Quit();
+
+		pipeline->Join();
+		seekRequested = false;
+		audioTrackRequest = -1;
+
+		for (size_t i = 0; i < standbyAudio.size(); i++)
+			delete standbyAudio[i];
+		standbyAudio.clear();
+
+		if (S)
+		{
 			delete S;
 			S = 0;
 		}
 
-		//SDL_WaitThread(video, NULL);
-
 		delete A;
 		A = 0;
 
@@ -172,69 +352,193 @@ public:
 
 		if (formatContext)
 		{
+			// Again with the seek index playback has built up
+			ProbeCache::Save(formatContext, filename);
+
 			avformat_flush(formatContext);
 			avformat_close_input(&formatContext);
 		}
+
+		Profiler::Unlock(StateMutex, StateLockProfile);
 	}
 
 	
 	void Quit()
 	{
+		delete control;
+		control = 0;
+
+		if (telemetryPath)
+			Telemetry::Instance().WriteJson(telemetryPath);
+
+		MemoryGovernor::Instance().Report();
+		Profiler::Report();
+
 		Reset();
+		Tracer::Stop();
 
 		SDL_Quit();
 
 		exit(0);
 	}
 	
-	void seek(int sec)
+	// Posts a relative seek to the demux thread and returns at once. Requests
+	// arriving before the demuxer gets to them add up to a single seek.
+	void seek(double sec)
 	{
-		Stop();
+		RequestSeek(sec, true);
+	}
 
-		AVRational avr;
-		avr.num = 1;
-		avr.den = formatContext->streams[videoStream]->time_base.den;
+	// Same for an absolute position in seconds
+	void seekTo(double pos)
+	{
+		RequestSeek(pos, false);
+	}
 
-		
-		// Video
-		int seek_flags = sec < 0 ? AVSEEK_FLAG_BACKWARD : AVSEEK_FLAG_FRAME;
-		int64_t seek_pos = (V->VideoClock() + sec)*formatContext->streams[videoStream]->time_base.den;
-		seek_pos = av_rescale_q(seek_pos, avr, formatContext->streams[videoStream]->time_base);
+	void RequestSeek(double value, bool relative)
+	{
+		Profiler::Lock(SeekRequestMutex, SeekRequestLockProfile);
 
-		if (seek_pos > formatContext->duration/1000)
-			seek_pos = formatContext->duration/1000 - 1000;
+		if (!seekRequested)
+		{
+			seekRequestPos = V->VideoClock();
+			Telemetry::Instance().OnSeekStart(exactSeek);
+			Tracer::Instant("seek request", seekRequestPos);
+		}
 
-		SDL_LockMutex(SeekMutex);
+		seekRequestPos = relative ? seekRequestPos + value : value;
+		if (seekRequestPos < 0)
+			seekRequestPos = 0;
+		seekRequested = true;
 
-		if (av_seek_frame(formatContext, videoStream, seek_pos, seek_flags) < 0)
-		{
-			SDL_UnlockMutex(SeekMutex);
+		Profiler::Unlock(SeekRequestMutex, SeekRequestLockProfile);
 
-			fprintf(stderr, "%s: error while seeking\n", formatContext->filename);
+		if (bStop)
+			Resume();
+		else
+			demuxSignal.Notify();
+	}
 
-			SDL_Event e;
-			e.type = SDL_QUIT;
-			SDL_PushEvent(&e);
+	// Switch to the nth audio stream; done by the demux thread, returns at once
+	void RequestAudioTrack(int nth)
+	{
+		Profiler::Lock(SeekRequestMutex, SeekRequestLockProfile);
+		audioTrackRequest = nth;
+		Profiler::Unlock(SeekRequestMutex, SeekRequestLockProfile);
 
-			return;
+		demuxSignal.Notify();
+	}
+
+	int countStreams(AVMediaType type)
+	{
+		int count = 0;
+		for (unsigned int i = 0; i < formatContext->nb_streams; i++)
+			if (formatContext->streams[i]->codec->codec_type == type)
+				count++;
+
+		return count;
+	}
+
+	// Keyframe-only fast forward (speed > 0) or rewind (speed < 0) with audio muted
+	void Scan(int speed)
+	{
+		if (speed > MAX_SCAN_SPEED)
+			speed = MAX_SCAN_SPEED;
+		if (speed < -MAX_SCAN_SPEED)
+			speed = -MAX_SCAN_SPEED;
+
+		Profiler::Lock(SeekMutex, SeekLockProfile);
+
+		if (scanSpeed == 0)
+		{
+			if (bStop)
+			{
+				bStop = false;
+				LeavePause();
+			}
+			A->Stop();
+			A->flush_packet();
+			FlushStandbyAudio();
+			if (S)
+			{
+				S->Stop();
+				S->flush_packet();
+				V->sink()->resetSubtitleInfo();
+			}
+			V->setKeyframeOnly(true);
 		}
 
-		V->flush_packet();
-		A->flush_packet();
-		if (S)
+		if (scanSpeed == 0 || (scanSpeed > 0) != (speed > 0))
 		{
-			V->resetSubtitleInfo();
-			S->flush_packet();
+			// Direction changed - drop keyframes queued for the other direction
+			V->flush_packet();
+			scanPos = V->VideoClock();
 		}
 
-		SDL_UnlockMutex(SeekMutex);
+		scanSpeed = speed;
+		V->sink()->setScanSpeed(speed);
 
-		Resume();
+		Profiler::Unlock(SeekMutex, SeekLockProfile);
+		demuxSignal.Notify();
+	}
+
+	void StopScan()
+	{
+		if (scanSpeed == 0)
+			return;
+
+		Profiler::Lock(SeekMutex, SeekLockProfile);
+		scanSpeed = 0;
+		V->sink()->setScanSpeed(0);
+		V->setKeyframeOnly(false);
+		Profiler::Unlock(SeekMutex, SeekLockProfile);
+
+		// Scan stopped audio and subtitles. Paused, the seek resumes them;
+		// playing, it only wakes the demuxer.
+		if (!bStop)
+			ResumeStages();
+
+		// Continue normal playback from the last keyframe shown
+		seek(0);
+	}
+
+	bool isScanning()
+	{
+		return scanSpeed != 0;
 	}
 
 
 private:
 
+	// Restarts what Stop and Scan halted; the clocks start over
+	void ResumeStages()
+	{
+		Sync->Reset();
+
+		A->Resume();
+
+		if (S)
+			S->Resume();
+	}
+
+	// Playback goes on after a pause - re-arms what Stop disarmed. Event loop
+	// only: the refresh handler parks itself there without a lock.
+	void LeavePause()
+	{
+		Telemetry::Instance().OnResume();
+
+		if (allocTimer == 0)
+			allocTimer = SDL_AddTimer(1000, AllocStats::ReportTimer, NULL);
+
+		// The refresh loop parked itself; the decoded picture is waiting, so
+		// the first frame goes out on this refresh
+		if (refreshParked)
+		{
+			refreshParked = false;
+			PushRefreshEvent(0, NULL);
+		}
+	}
+
 	static Uint32 PushRefreshEvent(Uint32 interval, void *userdata)
 	{
 		SDL_Event e;
@@ -243,16 +547,169 @@ private:
 		return 0;
 	}
 
-	int getStreamID(AVMediaType type)
+	// Index of the nth stream of a type, or -1
+	int getStreamID(AVMediaType type, int nth = 0)
 	{
 		unsigned int i;
 		for (i = 0; i < formatContext->nb_streams; i++)
-			if (formatContext->streams[i]->codec->codec_type == type)
+			if (formatContext->streams[i]->codec->codec_type == type && nth-- == 0)
 				return i;
 
 		return -1;
 	}
 
+	static void ControlThunk(void *arg, const char *command, std::string &reply)
+	{
+		Multimedia *m = (Multimedia*)arg;
+		m->Control(command, reply);
+	}
+
+	// Runs on the control socket thread. Queries and thread-safe commands are
+	// answered here; anything that touches rendering is posted to the event loop.
+	void Control(const char *command, std::string &reply)
+	{
+		char arg[CONTROL_LINE_SIZE];
+		double value;
+		int n;
+
+		Profiler::Lock(StateMutex, StateLockProfile);
+
+		reply = "ok";
+
+		if (sscanf(command, "open %1023[^\n]", arg) == 1)
+			PostControl(CONTROL_OPEN, 0, strdup(arg));
+		else if (V == 0 || A == 0)
+			reply = "error no media";
+		else if (strcmp(command, "play") == 0)
+			PostControl(CONTROL_PLAY, 0, 0);
+		else if (strcmp(command, "pause") == 0)
+			PostControl(CONTROL_PAUSE, 0, 0);
+		else if (sscanf(command, "seek_to %lf", &value) == 1)
+			PostControl(CONTROL_SEEK_TO, ToMs(value), 0);
+		else if (sscanf(command, "seek %lf", &value) == 1)
+			PostControl(CONTROL_SEEK, ToMs(value), 0);
+		else if (strcmp(command, "step") == 0)
+			PostControl(CONTROL_STEP, 0, 0);
+		else if (sscanf(command, "volume %lf", &value) == 1)
+		{
+			volumn = value < 0 ? 0 : value > 1 ? 1 : value;
+			A->setVolume(volumn);
+		}
+		else if (sscanf(command, "track audio %d", &n) == 1)
+		{
+			if (getStreamID(AVMEDIA_TYPE_AUDIO, n) < 0)
+				reply = "error no such track";
+			else
+				RequestAudioTrack(n);
+		}
+		else if (strcmp(command, "status") == 0)
+			reply = FormatStatus();
+		else if (strcmp(command, "metrics") == 0)
+		{
+			char json[TELEMETRY_JSON_SIZE];
+			Telemetry::Instance().FormatJson(json, sizeof(json));
+			reply = "{\"status\": " + FormatStatus() + ", \"telemetry\": " + json + ", \"memory\": " + MemoryGovernor::Instance().FormatJson() + "}";
+		}
+		else if (strcmp(command, "memory") == 0)
+			reply = MemoryGovernor::Instance().FormatJson();
+		else if (strcmp(command, "profile") == 0)
+			reply = Profiler::FormatJson();
+		else
+			reply = "error unknown command";
+
+		Profiler::Unlock(StateMutex, StateLockProfile);
+	}
+
+	std::string FormatStatus()
+	{
+		// File names are the only free text - escape them for JSON
+		std::string file;
+		for (const char *p = filename; *p; p++)
+		{
+			if (*p == '"' || *p == '\\')
+				file += '\\';
+			file += *p;
+		}
+
+		char buf[CONTROL_LINE_SIZE];
+		snprintf(buf, sizeof(buf),
+			"{\"position\": %.3f, \"duration\": %.3f, \"paused\": %s, \"scan_speed\": %d, \"volume\": %.2f, \"audio_track\": %d, "
+			"\"queues\": {\"video\": %d, \"audio\": %d, \"subtitle\": %d}}",
+			V->VideoClock(), formatContext->duration / (double)AV_TIME_BASE, bStop ? "true" : "false", scanSpeed, volumn, audioTrack,
+			V->getPacketSize(), A->getPacketSize(), S ? S->getPacketSize() : 0);
+
+		return "{\"file\": \"" + file + "\", " + std::string(buf + 1);
+	}
+
+	static intptr_t ToMs(double seconds)
+	{
+		return (intptr_t)floor(seconds * 1000 + 0.5);
+	}
+
+	static void PostControl(int code, intptr_t ms, void *data)
+	{
+		SDL_Event e;
+		e.type = FF_CONTROL_EVENT;
+		e.user.code = code;
+		e.user.data1 = data;
+		e.user.data2 = (void *)ms;
+		SDL_PushEvent(&e);
+	}
+
+	// Control commands that have to run on the event loop
+	void HandleControlEvent(SDL_UserEvent &e)
+	{
+		double seconds = (intptr_t)e.data2 / 1000.0;
+
+		switch (e.code)
+		{
+		case CONTROL_PLAY:
+			if (bStop)
+				Resume();
+			break;
+
+		case CONTROL_PAUSE:
+			if (!bStop)
+				Stop();
+			break;
+
+		case CONTROL_SEEK:
+			StopScan();
+			seek(seconds);
+			break;
+
+		case CONTROL_SEEK_TO:
+			StopScan();
+			seekTo(seconds);
+			break;
+
+		case CONTROL_STEP:
+			Step();
+			break;
+
+		case CONTROL_OPEN:
+			// Reset saves the probe cache under the old name, so the
+			// name is swapped in between; the previous copy is then unused
+			Reset();
+			free(openedFile);
+			openedFile = filename = (char *)e.data1;
+			audioTrack = 0;
+			Open(filename);
+			Play();
+			break;
+		}
+	}
+
+	// Pause and show the next decoded frame, if one is ready
+	void Step()
+	{
+		if (!bStop)
+			Stop();
+
+		if (V->hasPicture())
+			V->RenderPicture();
+	}
+
 	static int DemuxThread(void *arg)
 	{
 		Multimedia *m = (Multimedia*)arg;
@@ -267,34 +724,277 @@ private:
 
 		while (!quitEvent)
 		{
-			if (V->getPacketSize() > 60 || A->getPacketSize() > 60 || bStop)
+			unsigned int seen = demuxSignal.Sequence();
+
+			double target;
+			if (TakeSeekRequest(&target))
+			{
+				if (SeekTo(target) < 0)
+					break;
+
+				continue;
+			}
+
+			int track = TakeAudioTrackRequest();
+			if (track >= 0)
+				SwitchAudioTrack(track);
+
+			if (scanSpeed != 0)
+			{
+				int ret = 1;
+
+				if (V->getPacketSize() < SCAN_QUEUE_DEPTH)
+				{
+					Profiler::Lock(SeekMutex, SeekLockProfile);
+					if (scanSpeed > 0)
+						ret = ScanForward();
+					else if (scanSpeed < 0)
+						ret = ScanBackward();
+					Profiler::Unlock(SeekMutex, SeekLockProfile);
+				}
+
+				if (ret < 0)
+				{
+					AVPacket packetLastV;
+					PacketQueue::MakeLast(&packetLastV);
+					V->PutPacket(&packetLastV);
+					break;
+				}
+
+				// Queue full or nothing to scan - wait for the decoder or a speed change
+				if (ret > 0)
+					demuxSignal.WaitChange(seen);
+
+				continue;
+			}
+
+			// Queue depth follows memory pressure; over budget, read only for a decoder that ran dry
+			MemoryGovernor &memory = MemoryGovernor::Instance();
+			int depth = memory.queueDepth();
+			bool starved = V->getPacketSize() == 0 || A->getPacketSize() == 0;
+
+			if (V->getPacketSize() > depth || A->getPacketSize() > depth || (memory.overBudget() && !starved) || bStop)
 			{
-				SDL_Delay(100);
+				demuxSignal.WaitChange(seen);
+				continue;
 			}
 		
-			SDL_LockMutex(SeekMutex);
+			Profiler::Lock(SeekMutex, SeekLockProfile);
 
+			TraceSpan span("read", TRACE_NO_PTS, V->getPacketSize());
 			if (av_read_frame(formatContext, &packet) < 0)
 			{
 				AVPacket packetLastV;
-				av_packet_from_data(&packetLastV, (uint8_t*)"LAST", 4);
+				PacketQueue::MakeLast(&packetLastV);
 				V->PutPacket(&packetLastV);
 
-				SDL_UnlockMutex(SeekMutex);
+				Profiler::Unlock(SeekMutex, SeekLockProfile);
 
 				break;
 			}
 
+			if (packet.pts != AV_NOPTS_VALUE)
+				span.setPts(packet.pts * av_q2d(formatContext->streams[packet.stream_index]->time_base));
+
 			if (packet.stream_index == videoStream)
 				V->PutPacket(&packet);
 			else if (packet.stream_index == audioStream)
 				A->PutPacket(&packet);
-			else if ( S->useSMI() == false && packet.stream_index == subtitleStream)
+			else if (packet.stream_index < (int)standbyAudio.size() && standbyAudio[packet.stream_index])
+			{
+				// Only what is still ahead of the clock is worth keeping
+				AVStream *st = formatContext->streams[packet.stream_index];
+				PacketQueue *standby = standbyAudio[packet.stream_index];
+				standby->Put(&packet);
+				standby->DropBefore((int64_t)((A->AudioClock() - AUDIO_STANDBY_MARGIN) / av_q2d(st->time_base)));
+			}
+			else if (S && S->useSMI() == false && packet.stream_index == subtitleStream)
 				S->PutPacket(&packet);
+			else
+				av_packet_unref(&packet);
+
+			Profiler::Unlock(SeekMutex, SeekLockProfile);
+		}
+
+		return 0;
+	}
+
+	bool TakeSeekRequest(double *target)
+	{
+		Profiler::Lock(SeekRequestMutex, SeekRequestLockProfile);
+		bool requested = seekRequested;
+		*target = seekRequestPos;
+		seekRequested = false;
+		Profiler::Unlock(SeekRequestMutex, SeekRequestLockProfile);
+
+		return requested;
+	}
+
+	// Runs on the demux thread. The flushes bump the queue serials, so the
+	// decoders drop whatever they still hold from before the seek.
+	int SeekTo(double target)
+	{
+		AVStream *st = formatContext->streams[videoStream];
+
+		if (formatContext->duration > 0 && target > formatContext->duration / (double)AV_TIME_BASE)
+			target = formatContext->duration / (double)AV_TIME_BASE - 1;
+
+		// Exact seeks must land on a keyframe before the target and decode forward to it
+		int flags = exactSeek || target <= V->VideoClock() ? AVSEEK_FLAG_BACKWARD : 0;
+
+		TraceSpan span("seek", target);
+
+		Profiler::Lock(SeekMutex, SeekLockProfile);
+
+		if (av_seek_frame(formatContext, videoStream, (int64_t)(target / av_q2d(st->time_base)), flags) < 0)
+		{
+			Profiler::Unlock(SeekMutex, SeekLockProfile);
+
+			fprintf(stderr, "%s: error while seeking\n", formatContext->filename);
+
+			SDL_Event e;
+			e.type = SDL_QUIT;
+			SDL_PushEvent(&e);
+
+			return -1;
+		}
+
+		V->setSeekTarget(exactSeek ? target : -1);
+		A->setSeekTarget(exactSeek ? target : -1);
+
+		V->flush_packet();
+		A->flush_packet();
+		FlushStandbyAudio();
+		if (S)
+			S->flush_packet();
+
+		Profiler::Unlock(SeekMutex, SeekLockProfile);
+		return 0;
+	}
+
+	// Standby packets from before a seek would head the queue and keep
+	// DropBefore from trimming anything after a backward seek
+	void FlushStandbyAudio()
+	{
+		for (size_t i = 0; i < standbyAudio.size(); i++)
+			if (standbyAudio[i])
+				standbyAudio[i]->flush();
+	}
+
+	int TakeAudioTrackRequest()
+	{
+		Profiler::Lock(SeekRequestMutex, SeekRequestLockProfile);
+		int track = audioTrackRequest;
+		audioTrackRequest = -1;
+		Profiler::Unlock(SeekRequestMutex, SeekRequestLockProfile);
+
+		return track;
+	}
+
+	// Runs on the demux thread. The new stream starts with its buffered
+	// packets from the current audio clock on, so the switch needs no seek.
+	// What was queued for the old stream becomes its standby buffer, so
+	// switching back is just as quick.
+	void SwitchAudioTrack(int track)
+	{
+		int stream = getStreamID(AVMEDIA_TYPE_AUDIO, track);
+		if (stream < 0 || stream == audioStream)
+			return;
+
+		AVStream *st = formatContext->streams[stream];
+		PacketQueue *buffered = standbyAudio[stream];
+		double clock = A->AudioClock();
+
+		Profiler::Lock(SeekMutex, SeekLockProfile);
+
+		// Right after a seek the clock still tells the old position, while
+		// the flushed standby buffer holds only packets from the new one
+		bool settled = A->clockSettled();
+
+		A->switchStream(st, standbyAudio[audioStream]);
+
+		if (settled)
+			buffered->DropBefore((int64_t)(clock / av_q2d(st->time_base)));
+
+		AVPacket packet;
+		int count = 0;
+		while (buffered->Get(&packet, NULL, false))
+		{
+			A->PutPacket(&packet);
+			count++;
+		}
+
+		audioStream = stream;
+		audioTrack = track;
+
+		Profiler::Unlock(SeekMutex, SeekLockProfile);
+
+		if (settled)
+			SDL_Log("Audio track %d (stream %d) from %.3f, %d packets already buffered", track, stream, clock, count);
+		else
+			SDL_Log("Audio track %d (stream %d) from the seek position, %d packets already buffered", track, stream, count);
+	}
+
+	// Reads on to the next video keyframe and queues only that packet
+	int ScanForward()
+	{
+		AVPacket packet;
+
+		for (;;)
+		{
+			if (av_read_frame(formatContext, &packet) < 0)
+				return -1;
+
+			if (packet.stream_index == videoStream && (packet.flags & AV_PKT_FLAG_KEY))
+			{
+				V->PutPacket(&packet);
+				return 0;
+			}
+
+			av_packet_unref(&packet);
+		}
+	}
+
+	// Seeks to the keyframe before scanPos - speed * SCAN_INTERVAL and queues it
+	int ScanBackward()
+	{
+		if (scanPos <= 0)
+			return 1;
+
+		AVStream *st = formatContext->streams[videoStream];
+		double target = scanPos + scanSpeed * SCAN_INTERVAL;
+		if (target < 0)
+			target = 0;
+
+		if (av_seek_frame(formatContext, videoStream, (int64_t)(target / av_q2d(st->time_base)), AVSEEK_FLAG_BACKWARD) < 0)
+			return -1;
+
+		AVPacket packet;
+		for (;;)
+		{
+			if (av_read_frame(formatContext, &packet) < 0)
+				return -1;
+
+			if (packet.stream_index == videoStream && (packet.flags & AV_PKT_FLAG_KEY))
+				break;
 
-			SDL_UnlockMutex(SeekMutex);
+			av_packet_unref(&packet);
 		}
 
+		int64_t ts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+		double keyPos = ts * av_q2d(st->time_base);
+
+		if (keyPos >= scanPos)
+		{
+			// Landed on the keyframe already shown - step further back next time
+			scanPos = target;
+			av_packet_unref(&packet);
+			return 0;
+		}
+
+		V->PutPacket(&packet);
+		scanPos = keyPos;
+
 		return 0;
 	}
 
@@ -306,32 +1006,65 @@ private:
 		{
 			if (SDL_WaitEvent(&event)) {
 
+				Telemetry::Instance().OnWakeup();
+
 				if (event.type == SDL_QUIT)
 				{
 					Quit();
 				}
 				else if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == SDL_SCANCODE_SPACE)
 				{
-					if (bStop)
+					if (isScanning())
+						StopScan();
+					else if (bStop)
 						Resume();
 					else
 						Stop();
 				}
 				else if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == SDL_SCANCODE_LEFT)
 				{
+					StopScan();
 					seek(-10);
 				}
 				else if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == SDL_SCANCODE_RIGHT)
 				{
+					StopScan();
 					seek(10);
 				}
+				else if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == SDL_SCANCODE_A)
+				{
+					// Next audio track
+					int tracks = countStreams(AVMEDIA_TYPE_AUDIO);
+					if (tracks > 1)
+						RequestAudioTrack((audioTrack + 1) % tracks);
+				}
+				else if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == SDL_SCANCODE_M)
+				{
+					// audio -> video -> external clock
+					setSyncMaster((SyncMaster)((syncMaster + 1) % (SYNC_EXTERNAL_CLOCK + 1)));
+				}
+				else if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == SDL_SCANCODE_E)
+				{
+					exactSeek = !exactSeek;
+					SDL_Log("%s seek", exactSeek ? "Exact" : "Keyframe");
+				}
+				else if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == SDL_SCANCODE_F)
+				{
+					// 2x, 4x ... 32x fast forward
+					Scan(scanSpeed > 0 ? scanSpeed * 2 : 2);
+				}
+				else if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == SDL_SCANCODE_R)
+				{
+					// 2x, 4x ... 32x rewind
+					Scan(scanSpeed < 0 ? scanSpeed * 2 : -2);
+				}
 				else if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == SDL_SCANCODE_UP)
 				{
 					volumn += 0.05;
 					if (volumn > 1)
 						volumn = 1;
 
-					ChangeVolume(volumn, true);
+					A->setVolume(volumn);
 
 				}
 				else if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == SDL_SCANCODE_DOWN)
@@ -340,15 +1073,25 @@ private:
 					if (volumn < 0)
 						volumn = 0;
 
-					ChangeVolume(volumn, true);
+					A->setVolume(volumn);
 
 				}
+				else if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == SDL_SCANCODE_S)
+				{
+					V->sink()->toggleStats();
+				}
+				else if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == SDL_SCANCODE_D)
+				{
+					Telemetry::Instance().WriteJson(telemetryPath ? telemetryPath : TELEMETRY_DEFAULT_FILE);
+					MemoryGovernor::Instance().Report();
+					Profiler::Report();
+				}
 				else if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == SDL_SCANCODE_RETURN)
 				{
-					if (V->isFullScreen())
-						V->fullScreen(false);
+					if (V->sink()->isFullScreen())
+						V->sink()->fullScreen(false);
 					else
-						V->fullScreen(true);
+						V->sink()->fullScreen(true);
 
 				}
 				else if (event.type == SDL_MOUSEBUTTONDOWN)
@@ -362,71 +1105,50 @@ private:
 				{
 					Resume();
 				}
+				else if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_EXPOSED)
+				{
+					// Playing, the next refresh redraws anyway
+					if (bStop && refreshParked)
+						V->Redraw();
+				}
 				else if (event.type == FF_RESTART_EVENT)
 				{
 					ReStart();
 				}
+				else if (event.type == FF_CONTROL_EVENT)
+				{
+					HandleControlEvent(event.user);
+				}
+				else if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == SDL_SCANCODE_PERIOD)
+				{
+					Step();
+				}
 
 				if (event.type == FF_REFRESH_EVENT)
 				{
 
 					if (bStop)
 					{
-						SDL_AddTimer(100, PushRefreshEvent, NULL);
+						// Parked until LeavePause; the last picture stays on screen
+						refreshParked = true;
 					}
 					else
 					{
-						Uint32 delay = (int)(Sync->computeFrameDelay() * 1000);
-						SDL_AddTimer(delay, PushRefreshEvent, NULL);
+						double delay = scanSpeed != 0 ? Sync->computeScanDelay(scanSpeed) : Sync->computeFrameDelay();
+
+						// Presents with vsync on the vblank planned for this frame,
+						// then plans the vblank for the next one
 						V->RenderPicture();
+						SDL_AddTimer(V->presentScheduler().ScheduleNext(delay), PushRefreshEvent, NULL);
 					}
 				}
 			}
 		}
 	}
 
-
-	bool ChangeVolume(double nVolume, bool bScalar)
-	{
-
-		HRESULT hr = NULL;
-		bool decibels = false;
-		bool scalar = false;
-		double newVolume = nVolume;
-
-		IMMDeviceEnumerator *deviceEnumerator = NULL;
-		hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), NULL, CLSCTX_INPROC_SERVER, __uuidof(IMMDeviceEnumerator), (LPVOID *)&deviceEnumerator);
-		IMMDevice *defaultDevice = NULL;
-
-		hr = deviceEnumerator->GetDefaultAudioEndpoint(eRender, eConsole, &defaultDevice);
-		deviceEnumerator->Release();
-		deviceEnumerator = NULL;
-
-		IAudioEndpointVolume *endpointVolume = NULL;
-		hr = defaultDevice->Activate(__uuidof(IAudioEndpointVolume), CLSCTX_INPROC_SERVER, NULL, (LPVOID *)&endpointVolume);
-		defaultDevice->Release();
-		defaultDevice = NULL;
-
-		float currentVolume = 0;
-		endpointVolume->GetMasterVolumeLevel(&currentVolume);
-
-		hr = endpointVolume->GetMasterVolumeLevelScalar(&currentVolume);
-
-		if (bScalar == false)
-		{
-			hr = endpointVolume->SetMasterVolumeLevel((float)newVolume, NULL);
-		}
-		else if (bScalar == true)
-		{
-			hr = endpointVolume->SetMasterVolumeLevelScalar((float)newVolume, NULL);
-		}
-		endpointVolume->Release();
-
-		return FALSE;
-	}
-
 public:
 	bool			bStop;
+	bool			refreshParked;		// paused with no refresh timer armed
 
 private:
 	bool			quitEvent;
@@ -439,11 +1161,32 @@ private:
 	int				videoStream;
 	int				audioStream;
 	int				subtitleStream;
-	SDL_Thread		*demux;
-	SDL_Thread		*video;
-	SDL_Thread		*subtitle;
-	SDL_mutex		*SeekMutex;
+	Pipeline		*pipeline;
+	StageSignal		demuxSignal;		// space available, resume, seek or quit
+	SDL_mutex		*SeekMutex;			// demuxer reads and seeks vs. scan mode changes
+	SDL_mutex		*SeekRequestMutex;	// pending seek and track switch - never held for long
+	LockProfile		SeekLockProfile;
+	LockProfile		SeekRequestLockProfile;
+	bool			seekRequested;
+	double			seekRequestPos;		// absolute target, seconds
+	SDL_TimerID		allocTimer;
+	int				scanSpeed;			// 0 = normal playback, < 0 rewind
+	double			scanPos;			// last keyframe queued while rewinding
 	double			volumn;
+	char			*telemetryPath;		// --telemetry <file>
+	const char		*videoOutput;		// --vo
+	const char		*audioOutput;		// --ao
+	const char		*exportName;		// --export
+	ControlSocket	*control;			// --control
+	char			*openedFile;		// file name of the last control "open", owned
+	SDL_mutex		*StateMutex;		// held while V/A/S are created or torn down
+	LockProfile		StateLockProfile;
+	int				audioTrack;			// nth audio stream of the file
+	int				audioTrackRequest;	// pending track switch, -1 for none
+	std::vector<PacketQueue*> standbyAudio;	// by stream index; NULL for non-audio streams
+	bool			exactSeek;			// --exact-seek, E key
+	const char		*videoFilter;		// --vf
+	SyncMaster		syncMaster;			// --sync, M key
 
 };
 
@@ -451,6 +1194,34 @@ int main(int argc, char *argv[])
 {
 	char * filename = "";
 
+	// Stand-alone benchmark of the software gain stage
+	if (argc > 1 && strcmp(argv[1], "--bench-gain") == 0)
+		return AudioGain::Benchmark(SDL_AUDIO_BUFFER_SIZE * MAX_AUDIO_CHANNELS);
+
+	// Batch seek-bar preview generation: --thumbs <file> <interval sec> <output prefix>
+	if (argc > 1 && strcmp(argv[1], "--thumbs") == 0)
+	{
+		if (argc < 5)
+		{
+			fprintf(stderr, "Usage: player.exe --thumbs <file> <interval> <prefix>\n");
+			return 1;
+		}
+
+		Thumbnailer t(argv[2], atof(argv[3]), argv[4]);
+		return t.Run();
+	}
+
+	// Headless multi-stream decode: --host <file> [file ...]
+	if (argc > 1 && strcmp(argv[1], "--host") == 0)
+	{
+		DecodeHost host;
+		return host.Run(argc - 2, argv + 2);
+	}
+
+	// Regression benchmark over generated media: --bench [baseline] [--update]
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+		return Benchmark::Run(argc - 2, argv + 2);
+
 #ifdef _DEBUG
 
 	//if (argc < 2) {
@@ -482,7 +1253,7 @@ int main(int argc, char *argv[])
 	// ׽Ʈ3
 
 	if (argc < 2) {
-		fprintf(stderr, "Usage: player.exe <file>\n");
+		fprintf(stderr, "Usage: player.exe <file> [--vo sdl|null|file:<path>] [--ao sdl|null|file:<path>] [--telemetry <file>] [--export <shm name>] [--control <socket>] [--mem-budget <MB>] [--exact-seek] [--sync audio|video|external] [--vf <filters>] [--trace <file>]\n");
 		exit(1);
 	} else {
 		filename = argv[1];
@@ -492,15 +1263,46 @@ int main(int argc, char *argv[])
 
 	if ( strcmp(filename,"") == 0)
 		return 0;
-	
-	CoInitialize(NULL);
 
 	Multimedia m;
+
+	// Options after the file name
+	const char *vo = "sdl";
+	const char *ao = "sdl";
+	for (int i = 2; i < argc; i++)
+	{
+		// Flags first; everything below takes the next argument as its value
+		if (strcmp(argv[i], "--exact-seek") == 0)
+			m.setExactSeek(true);
+		else if (i + 1 == argc)
+			fprintf(stderr, "Ignoring %s: no value\n", argv[i]);
+		else if (strcmp(argv[i], "--telemetry") == 0)
+			m.setTelemetryPath(argv[++i]);
+		else if (strcmp(argv[i], "--vo") == 0)
+			vo = argv[++i];
+		else if (strcmp(argv[i], "--ao") == 0)
+			ao = argv[++i];
+		else if (strcmp(argv[i], "--export") == 0)
+			m.setExportName(argv[++i]);
+		else if (strcmp(argv[i], "--control") == 0)
+			m.setControlPath(argv[++i]);
+		else if (strcmp(argv[i], "--mem-budget") == 0)
+			MemoryGovernor::Instance().setBudget(atoi(argv[++i]));
+		else if (strcmp(argv[i], "--vf") == 0)
+			m.setVideoFilter(argv[++i]);
+		else if (strcmp(argv[i], "--trace") == 0)
+			Tracer::Start(argv[++i]);
+		else if (strcmp(argv[i], "--sync") == 0)
+		{
+			const char *master = argv[++i];
+			m.setSyncMaster(strcmp(master, "video") == 0 ? SYNC_VIDEO_MASTER : strcmp(master, "external") == 0 ? SYNC_EXTERNAL_CLOCK : SYNC_AUDIO_MASTER);
+		}
+	}
+	m.setOutputs(vo, ao);
+
 	m.Open(filename);
 	m.Play();
 
-	CoUninitialize();
-
 	return 0;
 }
 
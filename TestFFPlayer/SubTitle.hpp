@@ -24,6 +24,8 @@ struct SubTitleInfo
 	uint32_t start_display_time;
 	uint32_t end_display_time; 
 	char text[256];
+	SDL_Surface* surface;		// rasterized on the subtitle thread, uploaded once by Video
+	int bytes;					// charged to the memory budget until freed
 };
 
 class SubTitle
@@ -31,15 +33,17 @@ class SubTitle
 
 public:
 
-	SubTitle(AVStream *sStream, bool bSmi = false)
+	SubTitle(AVStream *sStream, bool bSmi = false) : dataQueue("subtitle cues")
 	{
 		quitEvent = false;
-		packetQueue = new PacketQueue();
+		packetQueue = new PacketQueue("subtitle packets");
 		this->bSmi = bSmi;
 		codecContext = 0;
 		codec = 0;
 		subtitleStream = 0;
 		bStop = false;
+		font = 0;
+		font_color = { 255, 255, 255 };
 
 		if (bSmi)
 		{
@@ -51,21 +55,39 @@ public:
 			codecContext = subtitleStream->codec;
 			codec = avcodec_find_decoder(codecContext->codec_id);
 			avcodec_open2(codecContext, codec, NULL);
+
+			// Own font instance - TTF_Font must not be shared with the render thread
+			font = TTF_OpenFont("NanumGothicBold.ttf", 44);
 		}
 	}
 
 	~SubTitle()
 	{
+		Quit();
+
 		packetQueue->flush();
 		delete packetQueue;
 
-		Quit();		
+		if (codecContext)
+			avcodec_close(codecContext);
+
+		SubTitleInfo* subInfo;
+		while (dataQueue.pop(subInfo))
+			FreeSubTitle(subInfo);
+
+		if (font)
+			TTF_CloseFont(font);
 	}
 
-	SDL_Thread * Start()
+	void Start(Pipeline *pipeline)
 	{
 		if (bSmi == false)
-			return SDL_CreateThread(DecodeVideoThread, "subtitle", this);
+			pipeline->Run("subtitle", DecodeVideoThread, this);
+	}
+
+	void setSpaceSignal(StageSignal *signal)
+	{
+		packetQueue->setSpaceSignal(signal);
 	}
 
 	void PutPacket(AVPacket *pkt)
@@ -73,15 +95,13 @@ public:
 		packetQueue->Put(pkt);
 	}
 	
+	// Wakes the decode stage; the codec is closed in the destructor
 	void Quit()
 	{
 		bStop = false;
 		quitEvent = true;
-
-		if (codecContext)
-		{
-			avcodec_close(codecContext);
-		}
+		packetQueue->Abort();
+		resumeSignal.Notify();
 	}			
 	
 	int getPacketSize()
@@ -99,6 +119,40 @@ public:
 		return dataQueue.pop();
 	}
 
+	static void FreeSubTitle(SubTitleInfo* subInfo)
+	{
+		if (subInfo == 0)
+			return;
+
+		if (subInfo->surface)
+			SDL_FreeSurface(subInfo->surface);
+
+		MemoryGovernor::Instance().Charge(CueMemoryId(), -subInfo->bytes);
+		av_free(subInfo);
+	}
+
+	// The render thread uploaded and freed the cue's surface
+	static void ReleaseSurface(SubTitleInfo* subInfo)
+	{
+		if (subInfo->surface == 0)
+			return;
+
+		int bytes = subInfo->surface->pitch * subInfo->surface->h;
+		SDL_FreeSurface(subInfo->surface);
+		subInfo->surface = 0;
+
+		subInfo->bytes -= bytes;
+		MemoryGovernor::Instance().Charge(CueMemoryId(), -bytes);
+	}
+
+	// Cues outlive the SubTitle that decoded them (the sink holds one), so
+	// they are charged to one component for the whole process
+	static int CueMemoryId()
+	{
+		static int id = MemoryGovernor::Instance().Register("subtitle cues", MEMORY_QUEUE);
+		return id;
+	}
+
 	bool useSMI()
 	{
 		return bSmi;
@@ -112,6 +166,7 @@ public:
 	void Resume()
 	{
 		bStop = false;
+		resumeSignal.Notify();
 	}
 
 private:
@@ -131,17 +186,18 @@ private:
 
 		while (!quitEvent)
 		{
+			unsigned int seen = resumeSignal.Sequence();
 			if (bStop)
 			{
-			
-				SDL_Delay(100);
+				resumeSignal.WaitChange(seen);
 				continue;
 			}
 
-			packetQueue->Get(&subtitlePacket);
+			if (!packetQueue->Get(&subtitlePacket))
+				break;
 
 			//   
-			if (strcmp((char*)subtitlePacket.data, "LAST") == 0)
+			if (PacketQueue::IsLast(&subtitlePacket))
 			{
 				SDL_Event e;
 				e.type = SDL_QUIT;
@@ -160,11 +216,21 @@ private:
 					else // 
 					{
 						SubTitleInfo* subInfo = (SubTitleInfo*)av_malloc(sizeof(SubTitleInfo));
+						AllocStats::Count(sizeof(SubTitleInfo));
 
 						double sClock = av_q2d(subtitleStream->time_base) * sub->pts / 1000;
 						subInfo->start_display_time = sClock + (sub->start_display_time / 1000);
 						subInfo->end_display_time = sClock + (sub->end_display_time / 1000);
-						strcpy(subInfo->text, Util::ANSIToUTF8((char*)subtitlePacket.data));
+						char* szText = Util::ANSIToUTF8((char*)subtitlePacket.data);
+						strncpy(subInfo->text, szText, sizeof(subInfo->text) - 1);
+						subInfo->text[sizeof(subInfo->text) - 1] = 0;
+						free(szText);
+
+						// Rasterize here, ahead of the start time, so the render thread only blits
+						subInfo->surface = font ? TTF_RenderUTF8_Blended(font, subInfo->text, font_color) : 0;
+
+						subInfo->bytes = sizeof(SubTitleInfo) + (subInfo->surface ? subInfo->surface->pitch * subInfo->surface->h : 0);
+						MemoryGovernor::Instance().Charge(CueMemoryId(), subInfo->bytes);
 
 						dataQueue.push(subInfo);
 					}
@@ -174,7 +240,7 @@ private:
 			av_packet_unref(&subtitlePacket);
 		}
 
-		av_free(&sub);
+		av_free(sub);
 
 		return 0;
 	}
@@ -189,4 +255,7 @@ private:
 	ThreadQueue<SubTitleInfo*>     dataQueue;
 	bool			bSmi;
 	bool			bStop;
+	StageSignal		resumeSignal;
+	TTF_Font*		font;
+	SDL_Color		font_color;
 };
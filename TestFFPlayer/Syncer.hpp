@@ -2,6 +2,7 @@
 
 #include "stdafx.h"
 #include <SDL.h>
+#include <cmath>
 
 extern "C"
 {
@@ -14,11 +15,24 @@ extern "C"
 
 #include "Video.hpp"
 #include "Audio.hpp"
+#include "Telemetry.hpp"
 
 /* no AV sync correction is done if below the AV sync threshold */
 #define AV_SYNC_THRESHOLD 0.01
 /* no AV correction is done if too big error */
 #define AV_NOSYNC_THRESHOLD 10.0
+/* bounds for the keyframe display interval in scan mode */
+#define SCAN_MIN_DELAY 0.02
+#define SCAN_MAX_DELAY 2.0
+/* share of a frame's delay video may be moved per frame to follow the external clock */
+#define EXTERNAL_MAX_TRIM 0.1
+
+enum SyncMaster
+{
+	SYNC_AUDIO_MASTER,		// video follows audio by holding or rushing frames
+	SYNC_VIDEO_MASTER,		// video plays at its own pace, audio is resampled to it
+	SYNC_EXTERNAL_CLOCK		// both follow the wall clock; audio is resampled to it
+};
 
 class Syncer
 {
@@ -29,30 +43,156 @@ public:
 		A = a;
 		previousClock = 0;
 		previousDelay = 0;
+		syncMaster = SYNC_AUDIO_MASTER;
+		externalBase = -1;
+		externalStart = 0;
+		anchorSerial = 0;
+	}
+
+	void setMaster(SyncMaster master)
+	{
+		syncMaster = master;
+		Reset();
+
+		if (A && master == SYNC_AUDIO_MASTER)
+			A->stopSyncCorrection();
+	}
+
+	SyncMaster master()
+	{
+		return syncMaster;
+	}
+
+	static const char* masterName(SyncMaster master)
+	{
+		switch (master)
+		{
+		case SYNC_VIDEO_MASTER:		return "video";
+		case SYNC_EXTERNAL_CLOCK:	return "external";
+		default:					return "audio";
+		}
+	}
+
+	// Re-anchor the external clock on the next frame. Called on resume; a
+	// seek is noticed by the picture's serial.
+	void Reset()
+	{
+		externalBase = -1;
 	}
 
 	double computeFrameDelay()
 	{
-//		fprintf(stdout, "%f", V->VideoClock());
-		double delay = V->VideoClock() - previousClock;
+		double videoClock = V->VideoClock();
+		double audioClock = A->AudioClock();
+
+		switch (syncMaster)
+		{
+		case SYNC_VIDEO_MASTER:
+			{
+				// Frames keep their own timing; audio is stretched towards the video
+				double delay = nominalDelay(videoClock);
+				A->setSyncError(audioClock - videoClock);
+				Telemetry::Instance().OnSync(videoClock - audioClock);
+				return delay;
+			}
+
+		case SYNC_EXTERNAL_CLOCK:
+			{
+				// Video keeps its own cadence and is only trimmed towards the
+				// clock - no held or rushed frames; audio is resampled to it
+				double clock = ExternalClock(videoClock);
+				double delay = nominalDelay(videoClock);
+				double diff = videoClock - clock;
+
+				double trim = diff;
+				if (trim > delay * EXTERNAL_MAX_TRIM)
+					trim = delay * EXTERNAL_MAX_TRIM;
+				if (trim < -delay * EXTERNAL_MAX_TRIM)
+					trim = -delay * EXTERNAL_MAX_TRIM;
+
+				A->setSyncError(audioClock - clock);
+				Telemetry::Instance().OnSync(diff);
+				return delay + trim;
+			}
+
+		default:
+			return computeFrameDelay(videoClock, audioClock);
+		}
+	}
+
+	// Same decision on explicit clocks - lets the headless benchmark drive it
+	double computeFrameDelay(double videoClock, double audioClock)
+	{
+//		fprintf(stdout, "%f", videoClock);
+		double delay = nominalDelay(videoClock);
+
+		// Update delay to sync to audio
+		double diff = videoClock - audioClock;
+		Telemetry::Instance().OnSync(diff);
+
+		if (diff <= -delay)
+		{
+			delay = 0;				// Audio is ahead of video; display video ASAP
+			Telemetry::Instance().OnFrameRushed();
+		}
+
+		if (diff >= delay)
+		{
+			delay = 2 * delay;		// Video is ahead of audio; delay video
+			Telemetry::Instance().OnFrameHeld();
+		}
+
+		return delay;
+	}
+
+	// Keyframe scan: show each keyframe for its media distance divided by the speed
+	double computeScanDelay(int speed)
+	{
+		double distance = V->VideoClock() - previousClock;
+		previousClock = V->VideoClock();
+
+		if (distance < 0)
+			distance = -distance;
+
+		double delay = distance / (speed < 0 ? -speed : speed);
+		if (delay < SCAN_MIN_DELAY)
+			delay = SCAN_MIN_DELAY;
+		if (delay > SCAN_MAX_DELAY)
+			delay = SCAN_MAX_DELAY;
+
+		return delay;
+	}
+
+private:
+	// Media time since the previous frame
+	double nominalDelay(double videoClock)
+	{
+		double delay = videoClock - previousClock;
 		if (delay <= 0.0 || delay >=0.5) {
 			// Incorrect delay - use previous one
 			delay = previousDelay;
 		}
 		// Save for next time
-		previousClock = V->VideoClock();
+		previousClock = videoClock;
 		previousDelay = delay;
 
-		// Update delay to sync to audio
-		double diff = V->VideoClock() - A->AudioClock();
+		return delay;
+	}
 
-		if (diff <= -delay)		
-			delay = 0;				// Audio is ahead of video; display video ASAP
+	// Wall clock running at media speed from where the video was when
+	// anchored. Only a seek or Reset anchors it again, so it never follows
+	// the streams it corrects.
+	double ExternalClock(double videoClock)
+	{
+		double now = PresentScheduler::Now();
 
-		if (diff >= delay)
-			delay = 2 * delay;		// Video is ahead of audio; delay video				
+		if (externalBase >= 0 && V->pictureGeneration() == anchorSerial)
+			return externalBase + (now - externalStart);
 
-		return delay;
+		externalBase = videoClock;
+		externalStart = now;
+		anchorSerial = V->pictureGeneration();
+		return videoClock;
 	}
 
 private:
@@ -62,4 +202,9 @@ private:
 	double previousClock;
 	double previousDelay;
 
+	SyncMaster syncMaster;
+	double externalBase;		// media time at externalStart, -1 before anchoring
+	double externalStart;		// seconds, PresentScheduler::Now()
+	int anchorSerial;			// seek generation of the anchoring picture
+
 };
\ No newline at end of file
@@ -0,0 +1,356 @@
+#pragma once
+
+#include "stdafx.h"
+#include <SDL.h>
+#include <cstdio>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#define TELEMETRY_WINDOW 1000			// samples kept per rolling metric
+#define TELEMETRY_MAX_LINES 8
+#define TELEMETRY_JSON_SIZE 2048
+
+struct StatSummary
+{
+	int		count;
+	double	mean;
+	double	p50;
+	double	p95;
+	double	p99;
+	double	max;
+};
+
+// Fixed-size window over the most recent samples
+class RollingStat
+{
+public:
+	RollingStat() : values(TELEMETRY_WINDOW), count(0), pos(0)
+	{
+	}
+
+	void Add(double v)
+	{
+		values[pos] = v;
+		pos = (pos + 1) % TELEMETRY_WINDOW;
+		if (count < TELEMETRY_WINDOW)
+			count++;
+	}
+
+	void Clear()
+	{
+		count = 0;
+		pos = 0;
+	}
+
+	StatSummary Summarize() const
+	{
+		StatSummary s = { count, 0, 0, 0, 0, 0 };
+		if (count == 0)
+			return s;
+
+		std::vector<double> sorted(values.begin(), values.begin() + count);
+		std::sort(sorted.begin(), sorted.end());
+
+		double sum = 0;
+		for (int i = 0; i < count; i++)
+			sum += sorted[i];
+
+		s.mean = sum / count;
+		s.p50 = sorted[(count - 1) * 50 / 100];
+		s.p95 = sorted[(count - 1) * 95 / 100];
+		s.p99 = sorted[(count - 1) * 99 / 100];
+		s.max = sorted[count - 1];
+		return s;
+	}
+
+private:
+	std::vector<double>	values;
+	int					count;
+	int					pos;
+};
+
+// Frame pacing and A/V sync measurements for the running session.
+// Fed by Video::RenderPicture, Syncer and the audio callback.
+class Telemetry
+{
+public:
+	Telemetry()
+	{
+		mutex = SDL_CreateMutex();
+		SDL_AtomicSet(&wakeups, 0);
+		Reset();
+	}
+
+	~Telemetry()
+	{
+		SDL_DestroyMutex(mutex);
+	}
+
+	static Telemetry& Instance()
+	{
+		static Telemetry telemetry;
+		return telemetry;
+	}
+
+	void Reset()
+	{
+		SDL_LockMutex(mutex);
+		jitter.Clear();
+		interval.Clear();
+		avOffset.Clear();
+		exactSeeks.Clear();
+		fastSeeks.Clear();
+		filterCost.Clear();
+		lastPts = -1;
+		lastPresent = 0;
+		presented = 0;
+		held = 0;
+		rushed = 0;
+		dropped = 0;
+		vblankRepeats = 0;
+		vblankSkips = 0;
+		decodeLevel = 0;
+		decodeLoad = 0;
+		SDL_AtomicSet(&underruns, 0);
+		seekPending = false;
+		pausedAt = 0;
+		pauseWakeupRate = -1;
+		SDL_UnlockMutex(mutex);
+	}
+
+	// A player thread woke up: event loop, condition wait or timer - lock free
+	void OnWakeup()
+	{
+		SDL_AtomicAdd(&wakeups, 1);
+	}
+
+	// Wakeups are counted from here until OnResume
+	void OnPause()
+	{
+		SDL_LockMutex(mutex);
+		pausedAt = SDL_GetPerformanceCounter();
+		pauseWakeups = SDL_AtomicGet(&wakeups);
+		SDL_UnlockMutex(mutex);
+	}
+
+	void OnResume()
+	{
+		SDL_LockMutex(mutex);
+		if (pausedAt)
+		{
+			double seconds = (double)(SDL_GetPerformanceCounter() - pausedAt) / SDL_GetPerformanceFrequency();
+			int n = SDL_AtomicGet(&wakeups) - pauseWakeups;
+			if (seconds > 0)
+				pauseWakeupRate = n / seconds;
+			pausedAt = 0;
+			SDL_Log("[pause] %.1f s paused, %d wakeups (%.2f/s)", seconds, n, pauseWakeupRate);
+		}
+		SDL_UnlockMutex(mutex);
+	}
+
+	// A seek was issued; the latency runs until the first picture after it is shown
+	void OnSeekStart(bool exact)
+	{
+		SDL_LockMutex(mutex);
+		seekStart = SDL_GetPerformanceCounter();
+		seekExact = exact;
+		seekPending = true;
+		SDL_UnlockMutex(mutex);
+	}
+
+	void OnSeekShown()
+	{
+		SDL_LockMutex(mutex);
+		if (seekPending)
+		{
+			double ms = (double)(SDL_GetPerformanceCounter() - seekStart) * 1000 / SDL_GetPerformanceFrequency();
+			(seekExact ? exactSeeks : fastSeeks).Add(ms);
+			seekPending = false;
+			SDL_Log("[seek] %s seek shown after %.1f ms", seekExact ? "exact" : "fast", ms);
+		}
+		SDL_UnlockMutex(mutex);
+	}
+
+	// A frame with presentation time `pts` (media seconds) reached the screen
+	// at `now` (seconds). Jitter is how far the on-screen interval strayed
+	// from the PTS interval.
+	void OnPresent(double pts, double now)
+	{
+		SDL_LockMutex(mutex);
+
+		double mediaDelta = pts - lastPts;
+		if (lastPts >= 0 && mediaDelta > 0 && mediaDelta < 1.0)
+		{
+			double wallDelta = now - lastPresent;
+			interval.Add(wallDelta * 1000);
+			jitter.Add((wallDelta - mediaDelta) * 1000);
+		}
+
+		lastPts = pts;
+		lastPresent = now;
+		presented++;
+
+		SDL_UnlockMutex(mutex);
+	}
+
+	void OnSync(double offset)
+	{
+		SDL_LockMutex(mutex);
+		avOffset.Add(offset * 1000);
+		SDL_UnlockMutex(mutex);
+	}
+
+	// Filter stage time for one output frame, ms
+	void OnFilterFrame(double ms)
+	{
+		SDL_LockMutex(mutex);
+		filterCost.Add(ms);
+		SDL_UnlockMutex(mutex);
+	}
+
+	void OnFrameHeld()		{ SDL_LockMutex(mutex); held++; SDL_UnlockMutex(mutex); }
+	void OnFrameRushed()	{ SDL_LockMutex(mutex); rushed++; SDL_UnlockMutex(mutex); }
+	void OnFrameDropped()	{ SDL_LockMutex(mutex); dropped++; SDL_UnlockMutex(mutex); }
+
+	// Called from the audio callback - lock free
+	void OnAudioUnderrun()
+	{
+		SDL_AtomicAdd(&underruns, 1);
+	}
+
+	// Frames the Syncer had to hold or rush
+	int syncCorrections()
+	{
+		SDL_LockMutex(mutex);
+		int n = held + rushed;
+		SDL_UnlockMutex(mutex);
+		return n;
+	}
+
+	// Decode governor state, see DecodeGovernor
+	void setDecodeQuality(int level, double load)
+	{
+		SDL_LockMutex(mutex);
+		decodeLevel = level;
+		decodeLoad = load;
+		SDL_UnlockMutex(mutex);
+	}
+
+	void setVblankErrors(int repeats, int skips)
+	{
+		SDL_LockMutex(mutex);
+		vblankRepeats = repeats;
+		vblankSkips = skips;
+		SDL_UnlockMutex(mutex);
+	}
+
+	// Short text lines for the on-screen overlay
+	int FormatOverlay(char lines[][128], int maxLines)
+	{
+		SDL_LockMutex(mutex);
+		StatSummary j = jitter.Summarize();
+		StatSummary a = avOffset.Summarize();
+		StatSummary f = interval.Summarize();
+		StatSummary se = exactSeeks.Summarize();
+		StatSummary sf = fastSeeks.Summarize();
+		StatSummary fc = filterCost.Summarize();
+
+		int n = 0;
+		if (n < maxLines)
+			snprintf(lines[n++], 128, "frame interval  p50 %.1f  p99 %.1f ms", f.p50, f.p99);
+		if (n < maxLines)
+			snprintf(lines[n++], 128, "jitter  p50 %+.1f  p95 %+.1f  p99 %+.1f ms", j.p50, j.p95, j.p99);
+		if (n < maxLines)
+			snprintf(lines[n++], 128, "A/V offset  p50 %+.1f  p99 %+.1f  max %+.1f ms", a.p50, a.p99, a.max);
+		if (n < maxLines)
+			snprintf(lines[n++], 128, "frames %d  held %d  rushed %d  dropped %d", presented, held, rushed, dropped);
+		if (n < maxLines)
+			snprintf(lines[n++], 128, "vblank repeats %d  skips %d  audio underruns %d", vblankRepeats, vblankSkips, SDL_AtomicGet(&underruns));
+		if (n < maxLines)
+			snprintf(lines[n++], 128, "decode load %.2f  level %d", decodeLoad, decodeLevel);
+		if (n < maxLines && fc.count > 0)
+			snprintf(lines[n++], 128, "filter  p50 %.1f  p99 %.1f  max %.1f ms/frame", fc.p50, fc.p99, fc.max);
+		if (n < maxLines && se.count + sf.count > 0)
+			snprintf(lines[n++], 128, "seek exact p50 %.0f p99 %.0f  fast p50 %.0f p99 %.0f ms", se.p50, se.p99, sf.p50, sf.p99);
+		SDL_UnlockMutex(mutex);
+
+		return n;
+	}
+
+	// Machine readable snapshot as one line of JSON; returns the length
+	int FormatJson(char *buf, int size)
+	{
+		SDL_LockMutex(mutex);
+
+		int n = snprintf(buf, size, "{");
+		n += FormatSummary(buf + n, size - n, "frame_interval_ms", interval.Summarize());
+		n += FormatSummary(buf + n, size - n, "jitter_ms", jitter.Summarize());
+		n += FormatSummary(buf + n, size - n, "av_offset_ms", avOffset.Summarize());
+		n += FormatSummary(buf + n, size - n, "exact_seek_ms", exactSeeks.Summarize());
+		n += FormatSummary(buf + n, size - n, "fast_seek_ms", fastSeeks.Summarize());
+		n += FormatSummary(buf + n, size - n, "filter_ms", filterCost.Summarize());
+		n += snprintf(buf + n, size - n,
+			"\"frames_presented\": %d, \"frames_held\": %d, \"frames_rushed\": %d, \"frames_dropped\": %d, "
+			"\"vblank_repeats\": %d, \"vblank_skips\": %d, \"audio_underruns\": %d, \"paused_wakeups_per_sec\": %.3f, "
+			"\"decode_level\": %d, \"decode_load\": %.3f}",
+			presented, held, rushed, dropped, vblankRepeats, vblankSkips, SDL_AtomicGet(&underruns), pauseWakeupRate,
+			decodeLevel, decodeLoad);
+
+		SDL_UnlockMutex(mutex);
+		return n < size ? n : size - 1;
+	}
+
+	int WriteJson(const char *path)
+	{
+		FILE *f = fopen(path, "w");
+		if (f == NULL)
+		{
+			SDL_Log("Cannot write %s", path);
+			return -1;
+		}
+
+		char json[TELEMETRY_JSON_SIZE];
+		FormatJson(json, sizeof(json));
+		fprintf(f, "%s\n", json);
+		fclose(f);
+
+		SDL_Log("Telemetry written to %s", path);
+		return 0;
+	}
+
+private:
+	static int FormatSummary(char *buf, int size, const char *name, StatSummary s)
+	{
+		int n = snprintf(buf, size, "\"%s\": {\"count\": %d, \"mean\": %.3f, \"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f}, ",
+			name, s.count, s.mean, s.p50, s.p95, s.p99, s.max);
+		return n < size ? n : size - 1;
+	}
+
+private:
+	SDL_mutex		*mutex;
+	RollingStat		jitter;
+	RollingStat		interval;
+	RollingStat		avOffset;
+	RollingStat		exactSeeks;			// seek to first shown picture, ms
+	RollingStat		fastSeeks;
+	RollingStat		filterCost;			// filter stage per output frame, ms
+	Uint64			seekStart;
+	bool			seekExact;
+	bool			seekPending;
+	double			lastPts;
+	double			lastPresent;
+	int				presented;
+	int				held;				// Syncer doubled the delay - video ahead of audio
+	int				rushed;				// Syncer zeroed the delay - video behind audio
+	int				dropped;
+	int				vblankRepeats;
+	int				vblankSkips;
+	int				decodeLevel;
+	double			decodeLoad;			// decode time over frame time
+	SDL_atomic_t	underruns;
+	SDL_atomic_t	wakeups;
+	Uint64			pausedAt;			// 0 while playing
+	int				pauseWakeups;		// wakeups when the pause began
+	double			pauseWakeupRate;	// during the last pause, -1 before any
+};
@@ -0,0 +1,194 @@
+#pragma once
+
+#include "stdafx.h"
+#include <SDL.h>
+#include <deque>
+#include <vector>
+
+// Work-stealing thread pool. Each worker runs its own queue front to back, so
+// tasks that re-submit themselves take turns; idle workers steal from the
+// back of a busy worker's queue.
+class ThreadPool
+{
+public:
+	typedef void (*TaskFunction)(void *arg);
+
+	struct Task
+	{
+		TaskFunction	fn;
+		void			*arg;
+	};
+
+	ThreadPool(int threadCount = 0)
+	{
+		if (threadCount <= 0)
+			threadCount = SDL_GetCPUCount();
+
+		quit = false;
+		pending = 0;
+		nextQueue = 0;
+		idleMutex = SDL_CreateMutex();
+		idleCond = SDL_CreateCond();
+
+		for (int i = 0; i < threadCount; i++)
+		{
+			Worker *w = new Worker();
+			w->pool = this;
+			w->index = i;
+			w->mutex = SDL_CreateMutex();
+			workers.push_back(w);
+		}
+
+		for (int i = 0; i < threadCount; i++)
+			workers[i]->thread = SDL_CreateThread(WorkerThread, "pool", workers[i]);
+	}
+
+	~ThreadPool()
+	{
+		SDL_LockMutex(idleMutex);
+		quit = true;
+		SDL_CondBroadcast(idleCond);
+		SDL_UnlockMutex(idleMutex);
+
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			SDL_WaitThread(workers[i]->thread, NULL);
+			SDL_DestroyMutex(workers[i]->mutex);
+			delete workers[i];
+		}
+
+		SDL_DestroyMutex(idleMutex);
+		SDL_DestroyCond(idleCond);
+	}
+
+	int size()
+	{
+		return (int)workers.size();
+	}
+
+	// From a worker the task goes to the back of that worker's own queue,
+	// otherwise queues are filled round-robin.
+	void Submit(TaskFunction fn, void *arg)
+	{
+		Task task = { fn, arg };
+
+		Worker *w = CurrentWorker();
+		if (w == NULL || w->pool != this)
+		{
+			SDL_LockMutex(idleMutex);
+			w = workers[nextQueue++ % workers.size()];
+			SDL_UnlockMutex(idleMutex);
+		}
+
+		SDL_LockMutex(w->mutex);
+		w->tasks.push_back(task);
+		SDL_UnlockMutex(w->mutex);
+
+		SDL_LockMutex(idleMutex);
+		pending++;
+		SDL_CondSignal(idleCond);
+		SDL_UnlockMutex(idleMutex);
+	}
+
+private:
+	struct Worker
+	{
+		ThreadPool			*pool;
+		int					index;
+		SDL_Thread			*thread;
+		SDL_mutex			*mutex;
+		std::deque<Task>	tasks;
+	};
+
+	static Worker*& CurrentWorker()
+	{
+		static thread_local Worker *current = NULL;
+		return current;
+	}
+
+	static int WorkerThread(void *arg)
+	{
+		Worker *w = (Worker*)arg;
+		CurrentWorker() = w;
+		w->pool->Run(w);
+		return 0;
+	}
+
+	bool PopOwn(Worker *w, Task &task)
+	{
+		bool found = false;
+
+		SDL_LockMutex(w->mutex);
+		if (!w->tasks.empty())
+		{
+			task = w->tasks.front();
+			w->tasks.pop_front();
+			found = true;
+		}
+		SDL_UnlockMutex(w->mutex);
+
+		return found;
+	}
+
+	bool Steal(Worker *thief, Task &task)
+	{
+		size_t n = workers.size();
+
+		for (size_t i = 1; i < n; i++)
+		{
+			Worker *victim = workers[(thief->index + i) % n];
+			bool found = false;
+
+			SDL_LockMutex(victim->mutex);
+			if (!victim->tasks.empty())
+			{
+				task = victim->tasks.back();
+				victim->tasks.pop_back();
+				found = true;
+			}
+			SDL_UnlockMutex(victim->mutex);
+
+			if (found)
+				return true;
+		}
+
+		return false;
+	}
+
+	void Run(Worker *w)
+	{
+		for (;;)
+		{
+			// Sleep until there is work somewhere; pending counts queued tasks.
+			// Tasks are only taken under the idle lock and Submit queues before
+			// it counts, so with pending > 0 the search always finds one.
+			Task task;
+			SDL_LockMutex(idleMutex);
+			for (;;)
+			{
+				if (quit)
+				{
+					SDL_UnlockMutex(idleMutex);
+					return;
+				}
+
+				if (pending > 0 && (PopOwn(w, task) || Steal(w, task)))
+					break;
+
+				SDL_CondWait(idleCond, idleMutex);
+			}
+			pending--;
+			SDL_UnlockMutex(idleMutex);
+
+			task.fn(task.arg);
+		}
+	}
+
+private:
+	std::vector<Worker*>	workers;
+	SDL_mutex				*idleMutex;
+	SDL_cond				*idleCond;
+	int						pending;
+	unsigned int			nextQueue;
+	bool					quit;
+};
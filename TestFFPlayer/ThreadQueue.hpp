@@ -2,13 +2,15 @@
 
 #include <queue>
 #include <SDL.h>
+#include "Profiler.hpp"
 
 template <typename T> class ThreadQueue
 {
 public:
-	ThreadQueue()
+	ThreadQueue(const char *name = "thread queue")
 	{
 		mutex_ = SDL_CreateMutex();
+		Profiler::NameLock(lockProfile_, name);
 	}
 
 
@@ -20,18 +22,18 @@ public:
 
 	void push(T item) 
 	{
-		SDL_LockMutex(mutex_);
+		Profiler::Lock(mutex_, lockProfile_);
 		queue_.push(item);
-		SDL_UnlockMutex(mutex_);
+		Profiler::Unlock(mutex_, lockProfile_);
 	}
 
 	T pop() 
 	{
-		SDL_LockMutex(mutex_);
+		Profiler::Lock(mutex_, lockProfile_);
 
 		if (queue_.empty())
 		{
-			SDL_UnlockMutex(mutex_);
+			Profiler::Unlock(mutex_, lockProfile_);
 			return NULL;
 		}
 			
@@ -39,7 +41,7 @@ public:
 		auto ressult = queue_.front();
 		queue_.pop();
 
-		SDL_UnlockMutex(mutex_);
+		Profiler::Unlock(mutex_, lockProfile_);
 
 		return ressult;
 	}
@@ -48,70 +50,70 @@ public:
 	{
 		item = NULL;
 
-		SDL_LockMutex(mutex_);
+		Profiler::Lock(mutex_, lockProfile_);
 
 		if (queue_.empty()) 
 		{
-			SDL_UnlockMutex(mutex_);
+			Profiler::Unlock(mutex_, lockProfile_);
 			return false;
 		}
 
 		item = queue_.front();
 		queue_.pop();
 
-		SDL_UnlockMutex(mutex_);
+		Profiler::Unlock(mutex_, lockProfile_);
 
 		return true;
 	}
 
 	T front()
 	{
-		SDL_LockMutex(mutex_);
+		Profiler::Lock(mutex_, lockProfile_);
 
 		if (queue_.empty()) 
 		{
-			SDL_UnlockMutex(mutex_);
+			Profiler::Unlock(mutex_, lockProfile_);
 			return NULL;
 		}
 
 		T item = queue_.front();
 
-		SDL_UnlockMutex(mutex_);
+		Profiler::Unlock(mutex_, lockProfile_);
 
 		return item;
 	}
 
 	T back()
 	{
-		SDL_LockMutex(mutex_);
+		Profiler::Lock(mutex_, lockProfile_);
 
 		if (queue_.empty())
 		{
-			SDL_UnlockMutex(mutex_);
+			Profiler::Unlock(mutex_, lockProfile_);
 			return NULL;
 		}
 
 		T item = queue_.back();
 
-		SDL_UnlockMutex(mutex_);
+		Profiler::Unlock(mutex_, lockProfile_);
 
 		return item;
 	}
 
 	bool is_empty() 
 	{
-		SDL_LockMutex(mutex_);
+		Profiler::Lock(mutex_, lockProfile_);
 		bool bEmpty = queue_.empty();
-		SDL_UnlockMutex(mutex_);
+		Profiler::Unlock(mutex_, lockProfile_);
 
 		return bEmpty;
 	}
 
 	int size() 
 	{
-		SDL_LockMutex(mutex_);
+		Profiler::Lock(mutex_, lockProfile_);
 		int nSize = queue_.size();
-		SDL_UnlockMutex(mutex_);
+		Profiler::Unlock(mutex_, lockProfile_);
 
 		return nSize;
 	}
@@ -119,4 +121,5 @@ public:
 private:
 	std::queue<T> queue_;
 	SDL_mutex* mutex_;
+	LockProfile lockProfile_;
 };
@@ -0,0 +1,334 @@
+#pragma once
+
+#include "stdafx.h"
+
+extern "C"
+{
+	#include <libavcodec/avcodec.h>
+	#include <libavformat/avformat.h>
+	#include <libswscale/swscale.h>
+	#include <libavutil/mem.h>
+	#include <libavutil/time.h>
+}
+
+#include <SDL.h>
+#include <cstdio>
+#include <vector>
+
+#define THUMB_WIDTH 160
+#define THUMB_COLUMNS 10
+#define THUMB_ROWS 10				// tiles per sheet = THUMB_COLUMNS * THUMB_ROWS
+
+// Batch trickplay generator: grabs one keyframe every `interval` seconds on a
+// pool of worker threads, each with its own demuxer and decoder over a slice
+// of the timeline, and scales it once straight into its sprite sheet tile.
+// Writes <prefix>_NNN.bmp sheets plus a <prefix>.vtt timestamp index.
+class Thumbnailer
+{
+public:
+	Thumbnailer(const char *filename, double interval, const char *prefix)
+	{
+		this->filename = filename;
+		this->interval = interval;
+		this->prefix = prefix;
+		tileCount = 0;
+		tileWidth = 0;
+		tileHeight = 0;
+	}
+
+	~Thumbnailer()
+	{
+		for (size_t i = 0; i < sheets.size(); i++)
+			av_free(sheets[i]);
+	}
+
+	int Run()
+	{
+		av_register_all();
+		avformat_network_init();
+
+		if (Probe() < 0)
+			return 1;
+
+		int sheetCount = (tileCount + TilesPerSheet() - 1) / TilesPerSheet();
+		for (int i = 0; i < sheetCount; i++)
+			sheets.push_back((uint8_t *)av_mallocz(SheetPitch() * tileHeight * THUMB_ROWS));
+
+		int workerCount = SDL_GetCPUCount();
+		if (workerCount > tileCount)
+			workerCount = tileCount;
+
+		std::vector<Worker> workers(workerCount);
+		std::vector<SDL_Thread*> threads(workerCount);
+
+		Uint64 start = SDL_GetPerformanceCounter();
+
+		// Contiguous slices keep each worker seeking forward through its own part of the file
+		for (int i = 0; i < workerCount; i++)
+		{
+			workers[i].owner = this;
+			workers[i].first = tileCount * i / workerCount;
+			workers[i].last = tileCount * (i + 1) / workerCount;
+			workers[i].done = 0;
+			threads[i] = SDL_CreateThread(WorkerThread, "thumbnail", &workers[i]);
+		}
+
+		int done = 0;
+		for (int i = 0; i < workerCount; i++)
+		{
+			SDL_WaitThread(threads[i], NULL);
+			done += workers[i].done;
+		}
+
+		double elapsed = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+		fprintf(stdout, "%d/%d thumbnails, %d workers, %.2f s (%.1f thumbnails/s)\n",
+			done, tileCount, workerCount, elapsed, elapsed > 0 ? done / elapsed : 0);
+
+		return (WriteSheets() < 0 || WriteIndex() < 0) ? 1 : 0;
+	}
+
+private:
+	struct Worker
+	{
+		Thumbnailer	*owner;
+		int			first;
+		int			last;
+		int			done;
+	};
+
+	int TilesPerSheet() { return THUMB_COLUMNS * THUMB_ROWS; }
+	int SheetPitch() { return tileWidth * THUMB_COLUMNS * 3; }
+
+	int Probe()
+	{
+		AVFormatContext *formatContext = NULL;
+		if (avformat_open_input(&formatContext, filename, NULL, NULL) < 0)
+		{
+			fprintf(stderr, "%s: cannot open\n", filename);
+			return -1;
+		}
+
+		avformat_find_stream_info(formatContext, NULL);
+
+		int stream = av_find_best_stream(formatContext, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+		if (stream < 0 || formatContext->duration <= 0 || interval <= 0)
+		{
+			fprintf(stderr, "%s: no video stream or unknown duration\n", filename);
+			avformat_close_input(&formatContext);
+			return -1;
+		}
+
+		AVCodecContext *codecContext = formatContext->streams[stream]->codec;
+		if (codecContext->width <= 0 || codecContext->height <= 0)
+		{
+			fprintf(stderr, "%s: unknown video size\n", filename);
+			avformat_close_input(&formatContext);
+			return -1;
+		}
+
+		tileWidth = THUMB_WIDTH;
+		tileHeight = (THUMB_WIDTH * codecContext->height / codecContext->width + 1) & ~1;
+
+		double duration = (double)formatContext->duration / AV_TIME_BASE;
+		tileCount = (int)(duration / interval) + 1;
+
+		avformat_close_input(&formatContext);
+		return 0;
+	}
+
+	static int WorkerThread(void *arg)
+	{
+		Worker *w = (Worker*)arg;
+		w->owner->Generate(w);
+		return 0;
+	}
+
+	void Generate(Worker *w)
+	{
+		AVFormatContext *formatContext = NULL;
+		if (avformat_open_input(&formatContext, filename, NULL, NULL) < 0)
+			return;
+
+		avformat_find_stream_info(formatContext, NULL);
+
+		int stream = av_find_best_stream(formatContext, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+		AVStream *videoStream = formatContext->streams[stream];
+
+		// Keep only the video stream; parallelism comes from the workers, not the decoder
+		for (unsigned int i = 0; i < formatContext->nb_streams; i++)
+			if ((int)i != stream)
+				formatContext->streams[i]->discard = AVDISCARD_ALL;
+
+		AVCodec *codec = avcodec_find_decoder(videoStream->codec->codec_id);
+		AVCodecContext *codecContext = avcodec_alloc_context3(codec);
+		avcodec_copy_context(codecContext, videoStream->codec);
+		codecContext->thread_count = 1;
+		codecContext->skip_frame = AVDISCARD_NONKEY;
+
+		if (avcodec_open2(codecContext, codec, NULL) < 0)
+		{
+			avcodec_free_context(&codecContext);
+			avformat_close_input(&formatContext);
+			return;
+		}
+
+		AVFrame *frame = av_frame_alloc();
+		SwsContext *swsContext = NULL;
+		double startTime = videoStream->start_time != AV_NOPTS_VALUE ? videoStream->start_time * av_q2d(videoStream->time_base) : 0;
+
+		for (int i = w->first; i < w->last; i++)
+		{
+			int64_t ts = (int64_t)((startTime + i * interval) / av_q2d(videoStream->time_base));
+			if (av_seek_frame(formatContext, stream, ts, AVSEEK_FLAG_BACKWARD) < 0)
+				continue;
+
+			avcodec_flush_buffers(codecContext);
+
+			if (DecodeKeyframe(formatContext, codecContext, stream, frame) < 0)
+				continue;
+
+			// Scale once, directly into this tile of the sheet
+			swsContext = sws_getCachedContext(swsContext,
+				frame->width, frame->height, (AVPixelFormat)frame->format,
+				tileWidth, tileHeight, AV_PIX_FMT_RGB24,
+				SWS_AREA, NULL, NULL, NULL);
+
+			uint8_t *dst[4] = { TilePointer(i), NULL, NULL, NULL };
+			int dstPitch[4] = { SheetPitch(), 0, 0, 0 };
+
+			sws_scale(swsContext, frame->data, frame->linesize, 0, frame->height, dst, dstPitch);
+			w->done++;
+		}
+
+		sws_freeContext(swsContext);
+		av_frame_free(&frame);
+		avcodec_free_context(&codecContext);
+		avformat_close_input(&formatContext);
+	}
+
+	int DecodeKeyframe(AVFormatContext *formatContext, AVCodecContext *codecContext, int stream, AVFrame *frame)
+	{
+		AVPacket packet;
+		int frameFinished = 0;
+
+		while (!frameFinished)
+		{
+			if (av_read_frame(formatContext, &packet) < 0)
+				return -1;
+
+			if (packet.stream_index == stream && (packet.flags & AV_PKT_FLAG_KEY))
+			{
+				avcodec_decode_video2(codecContext, frame, &frameFinished, &packet);
+
+				if (!frameFinished)
+				{
+					// Drain the reorder delay so the keyframe comes out now
+					AVPacket drainPacket;
+					av_init_packet(&drainPacket);
+					drainPacket.data = NULL;
+					drainPacket.size = 0;
+					avcodec_decode_video2(codecContext, frame, &frameFinished, &drainPacket);
+
+					// The drain leaves the decoder at end of stream; it refuses
+					// further packets until flushed
+					if (!frameFinished)
+						avcodec_flush_buffers(codecContext);
+				}
+			}
+
+			av_packet_unref(&packet);
+		}
+
+		return 0;
+	}
+
+	uint8_t* TilePointer(int i)
+	{
+		int tile = i % TilesPerSheet();
+		int x = (tile % THUMB_COLUMNS) * tileWidth;
+		int y = (tile / THUMB_COLUMNS) * tileHeight;
+
+		return sheets[i / TilesPerSheet()] + y * SheetPitch() + x * 3;
+	}
+
+	int WriteSheets()
+	{
+		char path[1024];
+
+		for (size_t i = 0; i < sheets.size(); i++)
+		{
+			snprintf(path, sizeof(path), "%s_%03d.bmp", prefix, (int)i);
+
+			SDL_Surface *surface = SDL_CreateRGBSurfaceFrom(sheets[i],
+				tileWidth * THUMB_COLUMNS, tileHeight * THUMB_ROWS, 24, SheetPitch(),
+				0x0000FF, 0x00FF00, 0xFF0000, 0);
+
+			int ret = SDL_SaveBMP(surface, path);
+			SDL_FreeSurface(surface);
+
+			if (ret < 0)
+			{
+				fprintf(stderr, "%s: %s\n", path, SDL_GetError());
+				return -1;
+			}
+		}
+
+		return 0;
+	}
+
+	// WebVTT thumbnail track: one cue per interval pointing at its tile
+	int WriteIndex()
+	{
+		char path[1024];
+		snprintf(path, sizeof(path), "%s.vtt", prefix);
+
+		FILE *f = fopen(path, "w");
+		if (f == NULL)
+		{
+			fprintf(stderr, "%s: cannot write\n", path);
+			return -1;
+		}
+
+		fprintf(f, "WEBVTT\n\n");
+
+		for (int i = 0; i < tileCount; i++)
+		{
+			int tile = i % TilesPerSheet();
+			char start[32], end[32];
+			FormatTime(start, i * interval);
+			FormatTime(end, (i + 1) * interval);
+
+			fprintf(f, "%s --> %s\n%s_%03d.bmp#xywh=%d,%d,%d,%d\n\n", start, end,
+				BaseName(prefix), i / TilesPerSheet(),
+				(tile % THUMB_COLUMNS) * tileWidth, (tile / THUMB_COLUMNS) * tileHeight,
+				tileWidth, tileHeight);
+		}
+
+		fclose(f);
+		return 0;
+	}
+
+	static void FormatTime(char *buf, double t)
+	{
+		int ms = (int)(t * 1000 + 0.5);
+		sprintf(buf, "%02d:%02d:%02d.%03d", ms / 3600000, ms / 60000 % 60, ms / 1000 % 60, ms % 1000);
+	}
+
+	static const char* BaseName(const char *path)
+	{
+		const char *name = path;
+		for (const char *p = path; *p; p++)
+			if (*p == '/' || *p == '\\')
+				name = p + 1;
+		return name;
+	}
+
+private:
+	const char				*filename;
+	const char				*prefix;
+	double					interval;
+	int						tileCount;
+	int						tileWidth;
+	int						tileHeight;
+	std::vector<uint8_t*>	sheets;
+};
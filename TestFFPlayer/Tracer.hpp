@@ -0,0 +1,284 @@
+#pragma once
+
+#include "stdafx.h"
+#include <SDL.h>
+#include <cstdio>
+
+#define TRACE_BUFFER_EVENTS 16384		// per thread, power of two
+#define TRACE_MAX_THREADS 64
+#define TRACE_FLUSH_MS 500
+#define TRACE_NO_PTS -1e9
+
+// One span ('X') or instant ('i') on one thread
+struct TraceEvent
+{
+	const char	*name;					// string literal
+	Uint64		start;					// performance counter
+	Uint64		duration;
+	double		pts;					// media seconds, TRACE_NO_PTS if none
+	int			depth;					// packet queue depth, -1 if none
+	char		phase;
+};
+
+// Single producer ring: only the owning thread advances head, only the
+// flusher advances tail, so recording never takes a lock
+struct TraceBuffer
+{
+	SDL_atomic_t	head;
+	SDL_atomic_t	tail;
+	SDL_threadID	thread;
+	const char		*name;
+	SDL_atomic_t	dropped;			// events lost to a full ring
+	TraceEvent		events[TRACE_BUFFER_EVENTS];
+};
+
+// --trace <file>: records pipeline spans into per-thread rings and streams
+// them to a Chrome trace-event JSON file (chrome://tracing, ui.perfetto.dev).
+// While not started every hook is a single flag test.
+class Tracer
+{
+public:
+	static bool Start(const char *path)
+	{
+		State &s = state();
+
+		s.file = fopen(path, "w");
+		if (s.file == NULL)
+		{
+			SDL_Log("Cannot write %s", path);
+			return false;
+		}
+
+		fprintf(s.file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+		fprintf(s.file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"TestFFPlayer\"}}");
+
+		s.mutex = SDL_CreateMutex();
+		s.base = SDL_GetPerformanceCounter();
+		s.frequency = (double)SDL_GetPerformanceFrequency();
+		SDL_AtomicSet(&s.enabled, 1);
+		s.timer = SDL_AddTimer(TRACE_FLUSH_MS, FlushTimer, NULL);
+
+		NameThread("main");
+		SDL_Log("Tracing to %s", path);
+		return true;
+	}
+
+	// Writes what is left, the thread names and closes the file. Frees the
+	// rings, so call it once the traced threads have been joined.
+	static void Stop()
+	{
+		State &s = state();
+		if (!SDL_AtomicCAS(&s.enabled, 1, 0))
+			return;
+
+		SDL_RemoveTimer(s.timer);
+
+		SDL_LockMutex(s.mutex);
+		Flush();
+
+		int dropped = SDL_AtomicGet(&s.unregistered);
+		int count = SDL_AtomicGet(&s.count);
+		for (int i = 0; i < count; i++)
+		{
+			TraceBuffer *b = s.buffers[i];
+			fprintf(s.file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %lu, \"args\": {\"name\": \"%s\"}}",
+				(unsigned long)b->thread, b->name ? b->name : "thread");
+			dropped += SDL_AtomicGet(&b->dropped);
+			delete b;
+			s.buffers[i] = NULL;
+		}
+		SDL_AtomicSet(&s.count, 0);
+
+		fprintf(s.file, "\n]}\n");
+		fclose(s.file);
+		s.file = NULL;
+		SDL_UnlockMutex(s.mutex);
+
+		if (dropped > 0)
+			SDL_Log("[trace] %d events dropped - rings full or more than %d threads", dropped, TRACE_MAX_THREADS);
+	}
+
+	static bool Enabled()
+	{
+		return SDL_AtomicGet(&state().enabled) != 0;
+	}
+
+	// Thread names shown in the viewer; pool threads carry their latest stage
+	static void NameThread(const char *name)
+	{
+		if (!Enabled())
+			return;
+
+		TraceBuffer *b = Buffer();
+		if (b)
+			b->name = name;
+	}
+
+	static void Span(const char *name, Uint64 start, double pts, int depth)
+	{
+		Record(name, 'X', start, SDL_GetPerformanceCounter() - start, pts, depth);
+	}
+
+	static void Instant(const char *name, double pts = TRACE_NO_PTS, int depth = -1)
+	{
+		if (Enabled())
+			Record(name, 'i', SDL_GetPerformanceCounter(), 0, pts, depth);
+	}
+
+private:
+	struct State
+	{
+		SDL_atomic_t	enabled;
+		SDL_atomic_t	unregistered;		// events of threads beyond TRACE_MAX_THREADS
+		FILE			*file;
+		SDL_mutex		*mutex;				// flusher side only
+		SDL_TimerID		timer;
+		Uint64			base;
+		double			frequency;
+		SDL_SpinLock	registry;
+		SDL_atomic_t	count;
+		TraceBuffer		*buffers[TRACE_MAX_THREADS];
+	};
+
+	static State& state()
+	{
+		static State s;
+		return s;
+	}
+
+	// The calling thread's ring, created on its first event
+	static TraceBuffer* Buffer()
+	{
+		static thread_local TraceBuffer *buffer = NULL;
+		static thread_local bool refused = false;
+		if (buffer || refused)
+			return buffer;
+
+		State &s = state();
+		SDL_AtomicLock(&s.registry);
+		int n = SDL_AtomicGet(&s.count);
+		if (n < TRACE_MAX_THREADS)
+		{
+			buffer = new TraceBuffer();
+			buffer->thread = SDL_ThreadID();
+			s.buffers[n] = buffer;
+			SDL_AtomicSet(&s.count, n + 1);
+		}
+		else
+		{
+			refused = true;
+		}
+		SDL_AtomicUnlock(&s.registry);
+
+		return buffer;
+	}
+
+	static void Record(const char *name, char phase, Uint64 start, Uint64 duration, double pts, int depth)
+	{
+		TraceBuffer *b = Buffer();
+		if (b == NULL)
+		{
+			SDL_AtomicAdd(&state().unregistered, 1);
+			return;
+		}
+
+		int head = SDL_AtomicGet(&b->head);
+		if (head - SDL_AtomicGet(&b->tail) >= TRACE_BUFFER_EVENTS)
+		{
+			SDL_AtomicAdd(&b->dropped, 1);
+			return;
+		}
+
+		TraceEvent &e = b->events[head & (TRACE_BUFFER_EVENTS - 1)];
+		e.name = name;
+		e.phase = phase;
+		e.start = start;
+		e.duration = duration;
+		e.pts = pts;
+		e.depth = depth;
+
+		// Publishes the event to the flusher
+		SDL_AtomicSet(&b->head, head + 1);
+	}
+
+	static Uint32 FlushTimer(Uint32 interval, void *)
+	{
+		State &s = state();
+		SDL_LockMutex(s.mutex);
+		if (s.file)
+			Flush();
+		SDL_UnlockMutex(s.mutex);
+		return interval;
+	}
+
+	// Drains every ring; called with the flusher mutex held
+	static void Flush()
+	{
+		State &s = state();
+		int count = SDL_AtomicGet(&s.count);
+
+		for (int i = 0; i < count; i++)
+		{
+			TraceBuffer *b = s.buffers[i];
+			int head = SDL_AtomicGet(&b->head);
+			int tail = SDL_AtomicGet(&b->tail);
+
+			for (; tail != head; tail++)
+				Write(s, b, b->events[tail & (TRACE_BUFFER_EVENTS - 1)]);
+
+			SDL_AtomicSet(&b->tail, tail);
+		}
+
+		fflush(s.file);
+	}
+
+	static void Write(State &s, TraceBuffer *b, const TraceEvent &e)
+	{
+		double ts = (double)(Sint64)(e.start - s.base) * 1000000 / s.frequency;
+
+		fprintf(s.file, ",\n{\"name\": \"%s\", \"ph\": \"%c\", \"pid\": 1, \"tid\": %lu, \"ts\": %.3f",
+			e.name, e.phase, (unsigned long)b->thread, ts);
+
+		if (e.phase == 'X')
+			fprintf(s.file, ", \"dur\": %.3f", e.duration * 1000000 / s.frequency);
+		else
+			fprintf(s.file, ", \"s\": \"t\"");
+
+		if (e.pts != TRACE_NO_PTS && e.depth >= 0)
+			fprintf(s.file, ", \"args\": {\"pts\": %.3f, \"queue\": %d}}", e.pts, e.depth);
+		else if (e.pts != TRACE_NO_PTS)
+			fprintf(s.file, ", \"args\": {\"pts\": %.3f}}", e.pts);
+		else if (e.depth >= 0)
+			fprintf(s.file, ", \"args\": {\"queue\": %d}}", e.depth);
+		else
+			fprintf(s.file, "}");
+	}
+};
+
+// Records the enclosing scope as one span on the calling thread
+class TraceSpan
+{
+public:
+	TraceSpan(const char *name, double pts = TRACE_NO_PTS, int depth = -1) : name(name), pts(pts), depth(depth)
+	{
+		start = Tracer::Enabled() ? SDL_GetPerformanceCounter() : 0;
+	}
+
+	~TraceSpan()
+	{
+		if (start && Tracer::Enabled())
+			Tracer::Span(name, start, pts, depth);
+	}
+
+	// Known only once the work is done, e.g. the pts of a decoded frame
+	void setPts(double value)
+	{
+		pts = value;
+	}
+
+private:
+	const char	*name;
+	Uint64		start;
+	double		pts;
+	int			depth;
+};
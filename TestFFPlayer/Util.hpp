@@ -1,11 +1,16 @@
 #pragma once
 
+#ifdef _WIN32
 #include <windows.h>
+#endif
+#include <cstdlib>
+#include <cstring>
 
 class Util
 {
 public:
 
+#ifdef _WIN32
 	static char* ANSIToUTF8(const char * pszCode){
 		int     nLength, nLength2;
 		BSTR    bstrWide;
@@ -42,6 +47,20 @@ public:
 
 		return pszAnsi;
 	}
+#else
+	// Other platforms run with UTF-8 locales - same ownership as the Win32 versions
+	static char* ANSIToUTF8(const char * pszCode){
+		char* pszUTFCode = (char*)malloc(strlen(pszCode) + 1);
+		strcpy(pszUTFCode, pszCode);
+		return pszUTFCode;
+	}
+
+	static char* UTF8ToANSI(const char *pszCode){
+		char* pszAnsi = new char[strlen(pszCode) + 1];
+		strcpy(pszAnsi, pszCode);
+		return pszAnsi;
+	}
+#endif
 
 };
 
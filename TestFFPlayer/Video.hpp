@@ -12,68 +12,124 @@ extern "C"
 }
 
 #include <SDL.h>
-#include <SDL_ttf.h>
 #include "PacketQueue.hpp"
 #include <cstdio>
-#include "SubTitle.hpp"
+#include "VideoSink.hpp"
+#include "PresentScheduler.hpp"
+#include "Telemetry.hpp"
+#include "FrameExport.hpp"
+#include "VideoFilter.hpp"
+#include "Tracer.hpp"
+#include "DecodeGovernor.hpp"
 
 class Video
 {
 	public:
 
-		Video(AVStream *vStream) : S(0), subData(0)
+		// Takes ownership of the sink
+		Video(AVStream *vStream, VideoSink *sink)
 		{
 			quitEvent = false;
 
-			packetQueue = new PacketQueue();
-
-			TTF_Init();
-			font = TTF_OpenFont("NanumGothicBold.ttf", 24);
-			fontSubTitle = TTF_OpenFont("NanumGothicBold.ttf", 44);
-			font_color = { 255, 255, 255 };
+			packetQueue = new PacketQueue("video packets");
+			output = sink;
+			exporter = 0;
+			filter = 0;
 
 			videoStream = vStream;
-			codecContext = videoStream->codec;
-			codec = avcodec_find_decoder(codecContext->codec_id);
+			// A private copy of the stream's context, so lowres can replace it
+			// mid-stream without reopening the one the demuxer shares
+			codec = avcodec_find_decoder(videoStream->codec->codec_id);
+			codecContext = avcodec_alloc_context3(codec);
+			avcodec_copy_context(codecContext, videoStream->codec);
 			avcodec_open2(codecContext, codec, NULL);
 
-			screen = SDL_CreateWindow("Test Player",
-								  SDL_WINDOWPOS_CENTERED_DISPLAY(0),
-								  SDL_WINDOWPOS_CENTERED_DISPLAY(0),
-								  codecContext->width, codecContext->height,
-								  SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN);
+			AVRational rate = videoStream->avg_frame_rate;
+			governor.Reset(rate.num > 0 && rate.den > 0 ? (double)rate.den / rate.num : 0, codec ? codec->max_lowres : 0);
+			decodeTime = 0;
 
-			renderer = SDL_CreateRenderer(screen, -1, SDL_RENDERER_ACCELERATED);
-			texture = SDL_CreateTexture(renderer,
-							SDL_PIXELFORMAT_IYUV,							// YUV420P
-							SDL_TEXTUREACCESS_STREAMING,
-							codecContext->width, codecContext->height);
+			output->Open(codecContext->width, codecContext->height);
+			outputWidth = codecContext->width;
+			outputHeight = codecContext->height;
+			resizePending = false;
+			scheduler.setDisplay(output->window());
 
 			PictureMutex = SDL_CreateMutex();
+			Profiler::NameLock(PictureLockProfile, "picture");
 			PictureReadyCond = SDL_CreateCond();
 			PictureReady = false;
-			bFullScreen = false;
-			screenRatio = float(codecContext->height) / codecContext->width;
+			keyframeOnly = false;
+			clock = 0;
+			shownClock = 0;
+			decodeClock = 0;
+			seekTarget = -1;
+			discardTarget = -1;
+			discarded = 0;
+			decodeSerial = 0;
+			pictureSerial = 0;
+			shownSerial = 0;
+
+			// The converted picture ToYUV420 keeps
+			picture = NULL;
+			pictureWidth = 0;
+			pictureHeight = 0;
+			pictureBytes = 0;
+			swsContext = NULL;
+			memoryId = MemoryGovernor::Instance().Register("picture buffer", MEMORY_FIXED);
 		}
 
 		~Video()
 		{
+			Quit();
+
+			SDL_Log("Presented %d frames, cadence errors: %d repeated, %d skipped vblanks",
+				scheduler.presentedCount(), scheduler.repeatedVblanks(), scheduler.skippedVblanks());
+
 			packetQueue->flush();
 			delete packetQueue;
 
-			Quit();
+			if (codecContext)
+			{
+				avcodec_close(codecContext);
+				avcodec_free_context(&codecContext);
+			}
 
-			SDL_DestroyTexture(texture);
-			SDL_DestroyRenderer(renderer);
+			delete output;
+			delete exporter;
+			delete filter;
+			av_free(picture);
+			sws_freeContext(swsContext);
+			MemoryGovernor::Instance().Unregister(memoryId);
 			SDL_DestroyMutex(PictureMutex);
 			SDL_DestroyCond(PictureReadyCond);
-			SDL_DestroyWindow(screen);
 		
 		}
 
-		SDL_Thread * Start()
+		void Start(Pipeline *pipeline)
 		{
-			return SDL_CreateThread(DecodeVideoThread, "video", this);
+			pipeline->Run("video", DecodeVideoThread, this);
+
+			if (filter)
+				filter->Start(pipeline);
+		}
+
+		// Runs decoded frames through a libavfilter graph on a stage of its own
+		void setFilter(const char *desc)
+		{
+			filter = new VideoFilter(desc, FilterOutputThunk, this);
+
+			// A description that does not parse would fail on every frame
+			if (filter->Validate(codecContext->width, codecContext->height, codecContext->pix_fmt, codecContext->sample_aspect_ratio) < 0)
+			{
+				SDL_Log("[filter] ignoring \"%s\", playing unfiltered", desc);
+				delete filter;
+				filter = 0;
+			}
+		}
+
+		void setSpaceSignal(StageSignal *signal)
+		{
+			packetQueue->setSpaceSignal(signal);
 		}
 
 		void PutPacket(AVPacket *pkt)
@@ -88,140 +144,88 @@ class Video
 
 		void RenderPicture()
 		{
-			while (!PictureReady)
 			{
-				SDL_CondWait(PictureReadyCond, PictureMutex);
-				if (quitEvent)
-					return;
+				// Empty unless the decode stage is behind
+				TraceSpan wait("wait picture", TRACE_NO_PTS, packetQueue->getSize());
+				Profiler::Lock(PictureMutex, PictureLockProfile);
+				while (!PictureReady && !quitEvent)
+					Profiler::CondWait(PictureReadyCond, PictureMutex, PictureLockProfile);
+				Profiler::Unlock(PictureMutex, PictureLockProfile);
 			}
-	
-			drawPicture();
-			drawTime();
-			drawSubtitles();
-
-			SDL_RenderPresent(renderer);
 
-			SDL_LockMutex(PictureMutex);			
-			PictureReady = false;
-			SDL_CondSignal(PictureReadyCond);
-			SDL_UnlockMutex(PictureMutex);
-
-		}
+			if (quitEvent)
+				return;
 
-		void drawPicture()
-		{
-			if (bFullScreen)
+			// Decoded before a seek the demuxer has since made - never shown
+			if (pictureSerial != packetQueue->getSerial())
 			{
-				int x = 0;
-				int y = 0;
-				SDL_GL_GetDrawableSize(screen, &x, &y);
-
-				SDL_Rect src;
-				src.x = 0;
-				src.y = 0;
-				src.w = x;
-				src.h = x*screenRatio;
-
-				SDL_Rect desc;
-				desc.x = 0;
-				desc.y = (y - x*screenRatio) / 2;
-				desc.w = x;
-				desc.h = x*screenRatio;
-
-				SDL_RenderCopy(renderer, texture, &src, &desc);
-
+				Profiler::Lock(PictureMutex, PictureLockProfile);
+				PictureReady = false;
+				SDL_CondSignal(PictureReadyCond);
+				Profiler::Unlock(PictureMutex, PictureLockProfile);
+				return;
 			}
-			else
+
+			// First picture after a seek: timing and subtitles start over
+			if (pictureSerial != shownSerial)
 			{
-				SDL_RenderCopy(renderer, texture, NULL, NULL);
+				scheduler.Reset();
+				output->resetSubtitleInfo();
 			}
-		}
 
-		void drawTime()
-		{
-			double clock = VideoClock();
-			char msg[100];
-			sprintf(msg, "Time: %.2f s", clock);
-			char* szMsg = Util::ANSIToUTF8(msg);
-
-			//surfaceMessage = TTF_RenderText_Solid(font, msg, font_color);
-			surTime = TTF_RenderUTF8_Blended(font, szMsg, font_color);
-			texTime = SDL_CreateTextureFromSurface(renderer, surTime);
-			SDL_Rect Message_rect;
-			Message_rect.x = 10;
-			TTF_SizeUTF8(font, szMsg, &Message_rect.w, &Message_rect.h);
-
-			if (bFullScreen)
+			// The texture only ever holds the picture on screen, so a paused
+			// Redraw shows the frame paused on. The picture buffer stays put
+			// until PictureReady is cleared below.
+			if (resizePending)
 			{
-				int x = 0;
-				int y = 0;
-				SDL_GL_GetDrawableSize(screen, &x, &y);
-				Message_rect.y = (y - x*screenRatio) / 2;
-				Message_rect.y += 10;
-			}	
-			else
+				output->Resize(pictureWidth, pictureHeight);
+				resizePending = false;
+			}
 			{
-				Message_rect.y = 10;			
+				TraceSpan span("upload", clock);
+				output->Upload(picture, pictureWidth);
 			}
-						
-			SDL_RenderCopy(renderer, texTime, NULL, &Message_rect);
-			SDL_FreeSurface(surTime);
-			SDL_DestroyTexture(texTime);
-		}
-
-		void drawSubtitles()
-		{
-			if (S == 0)
-				return;
-
-			if (subData == 0)
-				subData = S->getSubTitle();
-
-			if (subData)
+	
 			{
-				double start = subData->start_display_time;
-				double end = subData->end_display_time;
-		
-				if (clock > start ) // ̱
-				{
-					surSubtitle = TTF_RenderUTF8_Blended(fontSubTitle, subData->text, font_color);
-					texSubtitle = SDL_CreateTextureFromSurface(renderer, surSubtitle);
-
-					SDL_Rect Message_rect;
-					TTF_SizeUTF8(fontSubTitle, subData->text, &Message_rect.w, &Message_rect.h);
-
-					int x = 0;
-					int y = 0;
-					SDL_GL_GetDrawableSize(screen, &x, &y);
+				TraceSpan span("present", clock);
+				output->Present(clock);
+			}
+			scheduler.Presented();
+			shownClock = clock;
 
-					Message_rect.x = (x - Message_rect.w)/2;
-					Message_rect.y = y - Message_rect.h * 2;
+			Telemetry::Instance().OnPresent(clock, PresentScheduler::Now());
+			if (pictureSerial != shownSerial)
+			{
+				shownSerial = pictureSerial;
+				Telemetry::Instance().OnSeekShown();
+			}
+			Telemetry::Instance().setVblankErrors(scheduler.repeatedVblanks(), scheduler.skippedVblanks());
 
-					if (bFullScreen)
-						Message_rect.y -= (y - x*screenRatio) / 2;
+			Profiler::Lock(PictureMutex, PictureLockProfile);			
+			PictureReady = false;
+			SDL_CondSignal(PictureReadyCond);
+			Profiler::Unlock(PictureMutex, PictureLockProfile);
 
-					SDL_RenderCopy(renderer, texSubtitle, NULL, &Message_rect);
-					SDL_FreeSurface(surSubtitle);
-					SDL_DestroyTexture(texSubtitle);
-				}
+		}
 
-				if (clock > end) // ߱
-				{
-					av_free(subData);
-					subData = 0;
-				}
-			}
+		// Paused and the window was exposed: show the last presented picture
+		// again without touching the decoder
+		void Redraw()
+		{
+			output->Present(shownClock);
 		}
-			
+
+		// Wakes the decode stage and the renderer; the codec is closed in the destructor
 		void Quit()
 		{
 			quitEvent = true;
-			SDL_CondSignal(PictureReadyCond);
+			packetQueue->Abort();
+			if (filter)
+				filter->Quit();
 
-			if (codecContext)
-			{
-				avcodec_close(codecContext);
-			}
+			Profiler::Lock(PictureMutex, PictureLockProfile);
+			SDL_CondBroadcast(PictureReadyCond);
+			Profiler::Unlock(PictureMutex, PictureLockProfile);
 		}			
 		
 		int getPacketSize()
@@ -229,24 +233,35 @@ class Video
 			return packetQueue->getSize();
 		}
 
-		void fullScreen(bool bFull)
+		PresentScheduler& presentScheduler()
 		{
-			bFullScreen = bFull;
+			return scheduler;
+		}
 
-			if (bFullScreen)
-			{
-				SDL_SetWindowFullscreen(screen, SDL_WINDOW_FULLSCREEN_DESKTOP);	
-			}
-			else
-			{		
-				SDL_SetWindowFullscreen(screen,0);
-			}
+		VideoSink* sink()
+		{
+			return output;
+		}
+
+		// Seek generation of the prepared picture; changes with every seek
+		int pictureGeneration()
+		{
+			return pictureSerial;
 		}
 
+		// A decoded picture is waiting - RenderPicture will not block
+		bool hasPicture()
+		{
+			Profiler::Lock(PictureMutex, PictureLockProfile);
+			bool ready = PictureReady != 0;
+			Profiler::Unlock(PictureMutex, PictureLockProfile);
+			return ready;
+		}
 
-		bool isFullScreen()
+		// Also publish every shown picture to shared memory; takes ownership
+		void setExport(FrameExport *exporter)
 		{
-			return bFullScreen;
+			this->exporter = exporter;
 		}
 
 		void flush_packet()
@@ -254,15 +269,17 @@ class Video
 			packetQueue->flush();
 		}
 
-		void setSubTitle(SubTitle*   S)
+		// Exact seek: frames ending before `target` (seconds) are decoded but not
+		// shown. Call before flush_packet; -1 shows the first frame after the seek.
+		void setSeekTarget(double target)
 		{
-			this->S = S;
+			seekTarget = target;
 		}
 
-		void resetSubtitleInfo()
+		// Decode keyframes only (scan mode); applied by the decode thread
+		void setKeyframeOnly(bool bKeyOnly)
 		{
-			av_free(subData);
-			subData = 0;
+			keyframeOnly = bKeyOnly;
 		}
 
 private:
@@ -270,17 +287,17 @@ private:
 		double UpdateClock(AVFrame* frame)
 		{
 			if (frame->pkt_dts != AV_NOPTS_VALUE)
-				clock = av_q2d(videoStream->time_base) * frame->pkt_dts;
+				decodeClock = av_q2d(videoStream->time_base) * frame->pkt_dts;
 			else if (frame->pkt_pts != AV_NOPTS_VALUE)
-				clock = av_q2d(videoStream->time_base) * frame->pkt_pts;
+				decodeClock = av_q2d(videoStream->time_base) * frame->pkt_pts;
 		
 			double frame_delay = av_q2d(codecContext->time_base);
 		
 			/* if we are repeating a frame, adjust clock accordingly */
 			frame_delay += frame->repeat_pict * (frame_delay * 0.5);
-			clock += frame_delay;
+			decodeClock += frame_delay;
 		
-			return clock;
+			return decodeClock;
 		}
 		
 		static int DecodeVideoThread(void *arg)
@@ -293,15 +310,30 @@ private:
 		int DecodeVideo()
 		{
 			AVPacket videoPacket;
-			AVFrame*  frame = av_frame_alloc();
+			AVFrame*  frame = FramePool::Instance().Get();
 			int frameFinished;
+			int serial;
 		
 			while (!quitEvent)
 			{
-				packetQueue->Get(&videoPacket);
+				if (!packetQueue->Get(&videoPacket, &serial))
+					break;
+
+				// First packet after a seek - drop what the decoder still holds from before
+				if (serial != decodeSerial)
+				{
+					avcodec_flush_buffers(codecContext);
+					decodeSerial = serial;
+					discardTarget = seekTarget;
+					discarded = 0;
+					governor.Restart();
+					decodeTime = 0;
+					if (filter)
+						filter->Flush();
+				}
 		
 				//   
-				if (strcmp((char*)videoPacket.data, "LAST") == 0)
+				if (PacketQueue::IsLast(&videoPacket))
 				{
 					SDL_Event e;
 					e.type = SDL_QUIT;
@@ -311,11 +343,69 @@ private:
 				}
 				else
 				{
-					int ret = avcodec_decode_video2(codecContext, frame, &frameFinished, &videoPacket);
+					// Scan mode decodes keyframes only; otherwise the governor decides
+					AVDiscard skipFrame = keyframeOnly ? AVDISCARD_NONKEY : governor.skipFrame();
+					if (codecContext->skip_frame != skipFrame)
+					{
+						if (keyframeOnly != (codecContext->skip_frame == AVDISCARD_NONKEY))
+							avcodec_flush_buffers(codecContext);
+						codecContext->skip_frame = skipFrame;
+					}
+
+					// Pictures that are never shown may skip the loop filter on non-reference frames
+					codecContext->skip_loop_filter = BeforeTarget(&videoPacket) ? AVDISCARD_NONREF : governor.skipLoopFilter();
+
+					// The picture size changes, so only on a keyframe
+					if (codecContext->lowres != governor.lowres() && !keyframeOnly && (videoPacket.flags & AV_PKT_FLAG_KEY))
+						SetLowres(governor.lowres());
+
+					int ret;
+					{
+						int64_t ts = videoPacket.pts != AV_NOPTS_VALUE ? videoPacket.pts : videoPacket.dts;
+						TraceSpan span("decode", ts != AV_NOPTS_VALUE ? ts * av_q2d(videoStream->time_base) : TRACE_NO_PTS, packetQueue->getSize());
+						Uint64 start = SDL_GetPerformanceCounter();
+						ret = avcodec_decode_video2(codecContext, frame, &frameFinished, &videoPacket);
+						decodeTime += (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+					}
+
+					if (keyframeOnly)
+					{
+						// Keyframes are not contiguous in scan mode - drain the
+						// decoder's reorder delay so this one shows now, then reset
+						if (!frameFinished)
+						{
+							AVPacket drainPacket;
+							av_init_packet(&drainPacket);
+							drainPacket.data = NULL;
+							drainPacket.size = 0;
+							avcodec_decode_video2(codecContext, frame, &frameFinished, &drainPacket);
+						}
+
+						// Keyframes go straight to the screen - a filter's history means nothing here
+						if (frameFinished)
+							PreparePicture(frame, UpdateClock(frame), serial);
+
+						avcodec_flush_buffers(codecContext);
+						frameFinished = 0;
+						decodeTime = 0;
+					}
+
+					// A seek happened while this packet was decoding
+					if (serial != packetQueue->getSerial())
+						frameFinished = 0;
+
 					if (frameFinished)
 					{
-						UpdateClock(frame);
-						PreparePicture(frame, codecContext);
+						double pts = UpdateClock(frame);
+						if (!Discard())
+						{
+							Govern(pts);
+							if (filter)
+								filter->Push(frame, pts, serial);
+							else
+								PreparePicture(frame, pts, serial);
+						}
+						decodeTime = 0;
 					}
 		
 					//av_free_packet(&videoPacket);
@@ -324,25 +414,106 @@ private:
 				av_packet_unref(&videoPacket);
 			}
 		
-			av_frame_free(&frame);
+			FramePool::Instance().Put(frame);
 		
 			return 0;
 		}
+
+		bool BeforeTarget(AVPacket *packet)
+		{
+			if (discardTarget < 0 || packet->pts == AV_NOPTS_VALUE)
+				return false;
+
+			return av_q2d(videoStream->time_base) * packet->pts < discardTarget;
+		}
+
+		// Exact seek: true while decoded frames still end before the target.
+		// They are dropped here - no conversion, upload or sync.
+		bool Discard()
+		{
+			if (discardTarget < 0)
+				return false;
+
+			if (decodeClock <= discardTarget)
+			{
+				discarded++;
+				return true;
+			}
+
+			SDL_Log("[seek] exact: %d frames decoded and discarded to reach %.3f", discarded, discardTarget);
+			discardTarget = -1;
+			return false;
+		}
 		
 		
-		uint8_t * ToYUV420(AVFrame* frame, AVCodecContext *codecContext)
+		// Hands the governor what this frame cost in the decoder
+		void Govern(double pts)
 		{
-			static int numPixels = avpicture_get_size(AV_PIX_FMT_YUV420P, codecContext->width, codecContext->height);
-			static uint8_t * buffer = (uint8_t *)malloc(numPixels);
-		
+			int skipped = governor.OnFrame(decodeTime, pts);
+			for (int i = 0; i < skipped; i++)
+				Telemetry::Instance().OnFrameDropped();
+
+			Telemetry::Instance().setDecodeQuality(governor.level(), governor.load());
+		}
+
+		// lowres is read when the codec opens, so a new context replaces the
+		// current one on a keyframe. The frames come out smaller; the filter
+		// rebuilds its graph for the first of them and the render thread
+		// resizes the sink. If the filter cannot take the new size, or the
+		// codec will not open, the governor stops short of lowres.
+		void SetLowres(int lowres)
+		{
+			AVCodecContext *context = avcodec_alloc_context3(codec);
+			avcodec_copy_context(context, videoStream->codec);
+			context->lowres = lowres;
+			context->skip_frame = codecContext->skip_frame;
+			context->skip_loop_filter = codecContext->skip_loop_filter;
+
+			bool usable = avcodec_open2(context, codec, NULL) >= 0;
+			if (usable && filter)
+				usable = filter->Accepts(context->width, context->height, context->pix_fmt, context->sample_aspect_ratio);
+
+			if (!usable)
+			{
+				SDL_Log("[decode] lowres %d not usable for this stream", lowres);
+				avcodec_close(context);
+				avcodec_free_context(&context);
+				governor.disableLowres();
+				return;
+			}
+
+			avcodec_close(codecContext);
+			avcodec_free_context(&codecContext);
+			codecContext = context;
+		}
+
+		// Converts into the picture buffer, which follows the frame size
+		uint8_t * ToYUV420(AVFrame* frame)
+		{
+			ProfileScope scope("convert");
+
+			if (frame->width != pictureWidth || frame->height != pictureHeight)
+			{
+				int size = avpicture_get_size(AV_PIX_FMT_YUV420P, frame->width, frame->height);
+
+				av_free(picture);
+				picture = (uint8_t *)av_malloc(size);
+				AllocStats::Count(size);
+				pictureWidth = frame->width;
+				pictureHeight = frame->height;
+
+				MemoryGovernor::Instance().Charge(memoryId, size - pictureBytes);
+				pictureBytes = size;
+			}
+
 			//Set context for conversion
-			static struct SwsContext *swsContext = sws_getCachedContext(
+			swsContext = sws_getCachedContext(
 				swsContext,
-				codecContext->width,
-				codecContext->height,
-				codecContext->pix_fmt,
-				codecContext->width,
-				codecContext->height,
+				frame->width,
+				frame->height,
+				(AVPixelFormat)frame->format,
+				frame->width,
+				frame->height,
 				AV_PIX_FMT_YUV420P,
 				SWS_BILINEAR,
 				NULL,
@@ -350,42 +521,66 @@ private:
 				NULL
 				);
 		
-			AVFrame* frameYUV420P = av_frame_alloc();
-			avpicture_fill((AVPicture *)frameYUV420P, buffer, AV_PIX_FMT_YUV420P, codecContext->width, codecContext->height);
+			// Plane pointers into the picture buffer - no AVFrame needed per picture
+			AVPicture pictureYUV420P;
+			avpicture_fill(&pictureYUV420P, picture, AV_PIX_FMT_YUV420P, frame->width, frame->height);
 		
 			// Convert the image into YUV format that SDL uses
-			sws_scale(swsContext, frame->data, frame->linesize, 0, codecContext->height, frameYUV420P->data, frameYUV420P->linesize);
-		
-			av_frame_free(&frameYUV420P);
+			sws_scale(swsContext, frame->data, frame->linesize, 0, frame->height, pictureYUV420P.data, pictureYUV420P.linesize);
 		
-			return buffer;
+			return picture;
+		}
+
+		static void FilterOutputThunk(void *arg, AVFrame *frame, double pts, int serial)
+		{
+			Video *v = (Video*)arg;
+			v->PreparePicture(frame, pts, serial);
 		}
 		
-		void PreparePicture(AVFrame *frame, AVCodecContext *codecContext)
+		// Called by the decode thread, or by the filter stage when there is one
+		void PreparePicture(AVFrame *frame, double pts, int serial)
 		{
-			while (PictureReady)
 			{
-				SDL_CondWait(PictureReadyCond, PictureMutex);
-				if (quitEvent)
-					return;
+				// The renderer has not taken the previous picture yet
+				TraceSpan wait("wait display", pts);
+				Profiler::Lock(PictureMutex, PictureLockProfile);
+				while (PictureReady && !quitEvent)
+					Profiler::CondWait(PictureReadyCond, PictureMutex, PictureLockProfile);
+				Profiler::Unlock(PictureMutex, PictureLockProfile);
+			}
+
+			if (quitEvent)
+				return;
+
+			// A filter may scale, and streams may change size midway; the
+			// render thread resizes the sink before it uploads this picture
+			if (frame->width != outputWidth || frame->height != outputHeight)
+			{
+				outputWidth = frame->width;
+				outputHeight = frame->height;
+				resizePending = true;
 			}
 		
-			int pitch = codecContext->width * SDL_BYTESPERPIXEL(SDL_PIXELFORMAT_IYUV);
-			uint8_t * buffer = ToYUV420(frame, codecContext);
-			SDL_UpdateTexture(texture, NULL, buffer, pitch);
-		
-			SDL_LockMutex(PictureMutex);
+			uint8_t * buffer;
+			{
+				TraceSpan span("convert", pts);
+				buffer = ToYUV420(frame);
+			}
+			if (exporter)
+				exporter->Publish(buffer, frame->width, frame->height, pts);
+
+			Profiler::Lock(PictureMutex, PictureLockProfile);
+			clock = pts;
+			pictureSerial = serial;
 			PictureReady = true;
 			SDL_CondSignal(PictureReadyCond);
-			SDL_UnlockMutex(PictureMutex);
+			Profiler::Unlock(PictureMutex, PictureLockProfile);
 		}
 		
 private:
 	bool			quitEvent;
-
-	SDL_Renderer	*renderer;
-	SDL_Texture		*texture;
-	SDL_Window		*screen;
+	VideoSink		*output;
+	FrameExport		*exporter;
 
 	AVCodecContext  *codecContext;
 	AVCodec			*codec;
@@ -393,22 +588,33 @@ private:
 	PacketQueue		*packetQueue;
 
 	SDL_mutex		*PictureMutex;
+	LockProfile		PictureLockProfile;
 	SDL_cond		*PictureReadyCond;
 	int				PictureReady;
-	float			screenRatio;
-
-	bool			bFullScreen;
-	double			clock;
-	TTF_Font*		font;
-	TTF_Font*		fontSubTitle;
-	SDL_Color		font_color;
-
-	SDL_Surface*	surTime;
-	SDL_Texture*	texTime;
-
-	SDL_Surface*	surSubtitle;
-	SDL_Texture*	texSubtitle;
 
-	SubTitle		*S;
-	SubTitleInfo*   subData;
+	PresentScheduler scheduler;
+	DecodeGovernor	governor;
+	double			decodeTime;			// seconds in the decoder since the last frame came out
+	bool			keyframeOnly;
+	double			clock;				// of the prepared picture
+	double			shownClock;			// of the picture on screen
+	double			decodeClock;		// of the last decoded frame
+
+	VideoFilter		*filter;
+	int				outputWidth;		// size of the last prepared picture
+	int				outputHeight;
+	bool			resizePending;		// the sink still has the old size; RenderPicture resizes
+	uint8_t			*picture;			// YUV420P conversion target
+	int				pictureWidth;
+	int				pictureHeight;
+	int				pictureBytes;
+	SwsContext		*swsContext;
+
+	double			seekTarget;			// set by the seeking thread
+	double			discardTarget;		// decode thread's copy, taken with the new serial
+	int				discarded;
+	int				decodeSerial;		// packet queue serial being decoded
+	int				pictureSerial;		// serial of the prepared picture
+	int				shownSerial;
+	int				memoryId;
 };
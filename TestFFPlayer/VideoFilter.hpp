@@ -0,0 +1,312 @@
+#pragma once
+
+#include "stdafx.h"
+#include <SDL.h>
+#include <deque>
+
+extern "C"
+{
+	#include <libavfilter/avfilter.h>
+	#include <libavfilter/buffersrc.h>
+	#include <libavfilter/buffersink.h>
+	#include <libavutil/time.h>
+}
+
+#include "Pool.hpp"
+#include "Pipeline.hpp"
+#include "Telemetry.hpp"
+
+#define FILTER_QUEUE_DEPTH 4			// decoded frames waiting for the filter stage
+#define FILTER_THREADS 0				// slice threads per filter, 0 = one per core
+
+// Receives each filtered frame with its clock and the seek serial it was decoded in
+typedef void (*FilterOutput)(void *arg, AVFrame *frame, double pts, int serial);
+
+// libavfilter stage between the decoder and the picture upload, e.g.
+// "yadif", "scale=1280:-2" or "zscale=t=linear,tonemap=hable,zscale=t=bt709".
+// Runs on its own pipeline stage with slice threading, so filtering never
+// holds up decoding. The graph is built from the first frame and rebuilt
+// whenever the input size or format changes; frames of a size the graph
+// cannot be built for go through unfiltered.
+class VideoFilter
+{
+public:
+	VideoFilter(const char *desc, FilterOutput output, void *arg)
+	{
+		avfilter_register_all();
+
+		this->desc = desc;
+		this->output = output;
+		this->arg = arg;
+
+		graph = NULL;
+		source = NULL;
+		sink = NULL;
+		inWidth = 0;
+		inHeight = 0;
+		inFormat = -1;
+		rebuild = false;
+		aborted = false;
+
+		mutex = SDL_CreateMutex();
+		Profiler::NameLock(lockProfile, "filter queue");
+		cond = SDL_CreateCond();
+		memoryId = MemoryGovernor::Instance().Register("filter queue", MEMORY_QUEUE);
+	}
+
+	~VideoFilter()
+	{
+		Flush();
+		avfilter_graph_free(&graph);
+		MemoryGovernor::Instance().Unregister(memoryId);
+
+		SDL_DestroyMutex(mutex);
+		SDL_DestroyCond(cond);
+	}
+
+	// Builds the graph for the stream's own parameters once, before any
+	// frame is queued; < 0 when the description cannot be used at all
+	int Validate(int width, int height, int format, AVRational sar)
+	{
+		// Not probed yet: the first frame decides
+		if (width <= 0 || height <= 0 || format < 0)
+			return 0;
+
+		return Build(width, height, format, sar);
+	}
+
+	// Any thread: whether a graph can be built for pictures of this
+	// geometry. Builds a scratch graph; the stage's own is not touched.
+	bool Accepts(int width, int height, int format, AVRational sar)
+	{
+		AVFilterContext *scratchSource, *scratchSink;
+		AVFilterGraph *scratch = CreateGraph(width, height, format, sar, &scratchSource, &scratchSink);
+		bool built = scratch != NULL;
+		avfilter_graph_free(&scratch);
+		return built;
+	}
+
+	void Start(Pipeline *pipeline)
+	{
+		pipeline->Run("filter", FilterThread, this);
+	}
+
+	// Decode thread: queues a reference to `frame`; blocks while the stage is behind
+	void Push(AVFrame *frame, double pts, int serial)
+	{
+		AVFrame *queued = FramePool::Instance().Get();
+		av_frame_ref(queued, frame);
+
+		// Carried through the graph in microseconds
+		queued->pts = (int64_t)(pts * AV_TIME_BASE);
+
+		Profiler::Lock(mutex, lockProfile);
+		while (pending.size() >= FILTER_QUEUE_DEPTH && !aborted)
+			Profiler::CondWait(cond, mutex, lockProfile);
+
+		if (aborted)
+		{
+			Profiler::Unlock(mutex, lockProfile);
+			FramePool::Instance().Put(queued);
+			return;
+		}
+
+		// The queued reference keeps the decoded picture alive until filtered
+		int bytes = FramePool::BufferBytes(queued);
+		Item item = { queued, serial, bytes };
+		pending.push_back(item);
+		SDL_CondBroadcast(cond);
+		Profiler::Unlock(mutex, lockProfile);
+
+		MemoryGovernor::Instance().Charge(memoryId, bytes);
+	}
+
+	// Drops queued frames and the graph's history (seek)
+	void Flush()
+	{
+		int bytes = 0;
+
+		Profiler::Lock(mutex, lockProfile);
+		while (!pending.empty())
+		{
+			bytes += pending.front().bytes;
+			FramePool::Instance().Put(pending.front().frame);
+			pending.pop_front();
+		}
+		rebuild = true;
+		SDL_CondBroadcast(cond);
+		Profiler::Unlock(mutex, lockProfile);
+
+		MemoryGovernor::Instance().Charge(memoryId, -bytes);
+	}
+
+	void Quit()
+	{
+		Profiler::Lock(mutex, lockProfile);
+		aborted = true;
+		SDL_CondBroadcast(cond);
+		Profiler::Unlock(mutex, lockProfile);
+	}
+
+private:
+	struct Item
+	{
+		AVFrame		*frame;
+		int			serial;
+		int			bytes;			// charged picture data
+	};
+
+	static int FilterThread(void *arg)
+	{
+		VideoFilter *f = (VideoFilter*)arg;
+		f->Filter();
+		return 0;
+	}
+
+	void Filter()
+	{
+		AVFrame *filtered = FramePool::Instance().Get();
+
+		for (;;)
+		{
+			Profiler::Lock(mutex, lockProfile);
+			while (pending.empty() && !aborted)
+				Profiler::CondWait(cond, mutex, lockProfile);
+
+			if (aborted)
+			{
+				Profiler::Unlock(mutex, lockProfile);
+				break;
+			}
+
+			Item item = pending.front();
+			pending.pop_front();
+			bool reset = rebuild;
+			rebuild = false;
+			SDL_CondBroadcast(cond);
+			Profiler::Unlock(mutex, lockProfile);
+
+			MemoryGovernor::Instance().Charge(memoryId, -item.bytes);
+
+			AVFrame *frame = item.frame;
+			int64_t start = av_gettime_relative();
+
+			// A failed build is not retried until the input changes
+			if ((reset && graph != NULL) || frame->width != inWidth || frame->height != inHeight || frame->format != inFormat)
+				Build(frame->width, frame->height, frame->format, frame->sample_aspect_ratio);
+
+			if (graph == NULL)
+			{
+				output(arg, frame, frame->pts / (double)AV_TIME_BASE, item.serial);
+				FramePool::Instance().Put(frame);
+				continue;
+			}
+
+			if (av_buffersrc_add_frame(source, frame) < 0)
+				SDL_Log("[filter] cannot feed frame");
+
+			FramePool::Instance().Put(frame);
+
+			// A frame in may give none (deinterlacer warming up) or several (field rate output)
+			double tb = av_q2d(sink->inputs[0]->time_base);
+			while (av_buffersink_get_frame(sink, filtered) >= 0)
+			{
+				double pts = filtered->pts != AV_NOPTS_VALUE ? filtered->pts * tb : 0;
+
+				Telemetry::Instance().OnFilterFrame((av_gettime_relative() - start) / 1000.0);
+				output(arg, filtered, pts, item.serial);
+				av_frame_unref(filtered);
+
+				start = av_gettime_relative();
+			}
+		}
+
+		FramePool::Instance().Put(filtered);
+	}
+
+	// "buffer -> <desc> -> buffersink" for frames like `frame`
+	// The stage's graph for pictures of this geometry
+	int Build(int width, int height, int format, AVRational sar)
+	{
+		inWidth = width;
+		inHeight = height;
+		inFormat = format;
+
+		avfilter_graph_free(&graph);
+		graph = CreateGraph(width, height, format, sar, &source, &sink);
+		if (graph == NULL)
+			return -1;
+
+		SDL_Log("[filter] \"%s\": %dx%d in, %dx%d out", desc,
+			inWidth, inHeight, sink->inputs[0]->w, sink->inputs[0]->h);
+		return 0;
+	}
+
+	// "buffer -> <desc> -> buffersink"; NULL when it cannot be built
+	AVFilterGraph* CreateGraph(int width, int height, int format, AVRational sar, AVFilterContext **source, AVFilterContext **sink)
+	{
+		AVFilterGraph *g = avfilter_graph_alloc();
+		g->thread_type = AVFILTER_THREAD_SLICE;
+		g->nb_threads = FILTER_THREADS;
+
+		if (sar.num == 0)
+			sar = av_make_q(1, 1);
+
+		char args[256];
+		snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=1/%d:pixel_aspect=%d/%d",
+			width, height, format, AV_TIME_BASE, sar.num, sar.den);
+
+		if (avfilter_graph_create_filter(source, avfilter_get_by_name("buffer"), "in", args, NULL, g) < 0 ||
+			avfilter_graph_create_filter(sink, avfilter_get_by_name("buffersink"), "out", NULL, NULL, g) < 0)
+		{
+			SDL_Log("[filter] cannot create buffer source or sink");
+			avfilter_graph_free(&g);
+			return NULL;
+		}
+
+		AVFilterInOut *outputs = avfilter_inout_alloc();
+		outputs->name = av_strdup("in");
+		outputs->filter_ctx = *source;
+		outputs->pad_idx = 0;
+		outputs->next = NULL;
+
+		AVFilterInOut *inputs = avfilter_inout_alloc();
+		inputs->name = av_strdup("out");
+		inputs->filter_ctx = *sink;
+		inputs->pad_idx = 0;
+		inputs->next = NULL;
+
+		int ret = avfilter_graph_parse_ptr(g, desc, &inputs, &outputs, NULL);
+		avfilter_inout_free(&inputs);
+		avfilter_inout_free(&outputs);
+
+		if (ret < 0 || avfilter_graph_config(g, NULL) < 0)
+		{
+			SDL_Log("[filter] cannot build \"%s\" for %dx%d", desc, width, height);
+			avfilter_graph_free(&g);
+			return NULL;
+		}
+
+		return g;
+	}
+
+private:
+	const char			*desc;
+	FilterOutput		output;
+	void				*arg;
+
+	AVFilterGraph		*graph;
+	AVFilterContext		*source;
+	AVFilterContext		*sink;
+	int					inWidth;			// what the graph was last built for, even if that failed
+	int					inHeight;
+	int					inFormat;
+
+	SDL_mutex			*mutex;
+	LockProfile			lockProfile;
+	SDL_cond			*cond;
+	std::deque<Item>	pending;
+	bool				rebuild;			// drop the graph's history before the next frame
+	bool				aborted;
+	int					memoryId;
+};
@@ -0,0 +1,166 @@
+#pragma once
+
+#include "stdafx.h"
+#include <SDL.h>
+#include <cstdio>
+#include "SubTitle.hpp"
+
+// Where decoded pictures go. Video converts every frame to YUV420P on the
+// decode thread. Resize, Upload and Present all run on the event loop when
+// the frame is due, so the sink only ever holds the picture on screen.
+class VideoSink
+{
+public:
+	VideoSink() : S(0), subData(0)
+	{
+	}
+
+	virtual ~VideoSink()
+	{
+		SubTitle::FreeSubTitle(subData);
+	}
+
+	virtual int Open(int width, int height) = 0;
+
+	// Pictures from now on have a new size (filter output, lowres, stream
+	// change). Called on the event loop, like Present.
+	virtual void Resize(int width, int height) {}
+
+	// Contiguous YUV420P planes, luma rows `pitch` bytes apart
+	virtual void Upload(const uint8_t *picture, int pitch) = 0;
+
+	virtual void Present(double clock) = 0;
+
+	// Display the sink presents on; NULL when nothing paces presentation
+	virtual SDL_Window* window() { return 0; }
+
+	virtual void fullScreen(bool bFull) {}
+	virtual bool isFullScreen() { return false; }
+	virtual void toggleStats() {}
+	virtual void setScanSpeed(int speed) {}
+
+	void setSubTitle(SubTitle* S)
+	{
+		this->S = S;
+	}
+
+	virtual void resetSubtitleInfo()
+	{
+		SubTitle::FreeSubTitle(subData);
+		subData = 0;
+	}
+
+protected:
+	// Cue to show at `clock`, if any. Expired cues are released here so the
+	// subtitle queue drains whether or not the sink draws text.
+	SubTitleInfo* currentSubtitle(double clock)
+	{
+		if (S == 0)
+			return 0;
+
+		if (subData == 0)
+			subData = S->getSubTitle();
+
+		if (subData == 0)
+			return 0;
+
+		if (clock > subData->end_display_time)
+		{
+			resetSubtitleInfo();
+			return 0;
+		}
+
+		return clock > subData->start_display_time ? subData : 0;
+	}
+
+protected:
+	SubTitle		*S;
+	SubTitleInfo*	subData;
+};
+
+// Discards pictures - measures decode and convert without a display
+class NullVideoSink : public VideoSink
+{
+public:
+	int Open(int width, int height)
+	{
+		return 0;
+	}
+
+	void Upload(const uint8_t *picture, int pitch)
+	{
+	}
+
+	void Present(double clock)
+	{
+		currentSubtitle(clock);
+	}
+};
+
+// Appends every picture to a raw YUV420P file (play with -f rawvideo)
+class FileVideoSink : public VideoSink
+{
+public:
+	FileVideoSink(const char *path) : file(0), width(0), height(0)
+	{
+		this->path = path;
+	}
+
+	~FileVideoSink()
+	{
+		if (file)
+			fclose(file);
+	}
+
+	int Open(int width, int height)
+	{
+		this->width = width;
+		this->height = height;
+
+		file = fopen(path, "wb");
+		if (file == NULL)
+		{
+			SDL_Log("Cannot write %s", path);
+			return -1;
+		}
+
+		SDL_Log("Video: raw yuv420p %dx%d to %s", width, height, path);
+		return 0;
+	}
+
+	void Resize(int width, int height)
+	{
+		this->width = width;
+		this->height = height;
+		SDL_Log("Video: now %dx%d", width, height);
+	}
+
+	void Upload(const uint8_t *picture, int pitch)
+	{
+		if (file == NULL)
+			return;
+
+		// Luma plane, then the two quarter-size chroma planes; odd sizes round up
+		for (int y = 0; y < height; y++)
+			fwrite(picture + y * pitch, 1, width, file);
+
+		int chromaPitch = (pitch + 1) / 2;
+		int chromaWidth = (width + 1) / 2;
+		int chromaHeight = (height + 1) / 2;
+
+		const uint8_t *chroma = picture + height * pitch;
+		for (int y = 0; y < 2 * chromaHeight; y++)
+			fwrite(chroma + y * chromaPitch, 1, chromaWidth, file);
+	}
+
+	void Present(double clock)
+	{
+		currentSubtitle(clock);
+	}
+
+private:
+	const char	*path;
+	FILE		*file;
+	int			width;
+	int			height;
+};
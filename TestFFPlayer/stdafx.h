@@ -8,7 +8,11 @@
 #include "targetver.h"
 
 #include <stdio.h>
+#ifdef _WIN32
 #include <tchar.h>
+// Ahead of windows.h, which would otherwise pull in the old winsock.h
+#include <winsock2.h>
+#endif
 
 
 